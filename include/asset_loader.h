@@ -0,0 +1,183 @@
+#ifndef asset_loader_h_INCLUDED
+#define asset_loader_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Background threads that run jobs, such as reading and decoding a file,
+// independently of the thread pool so a slow load never holds up a frame.
+// Jobs start in submission order. Each finished job is handed back through a
+// lock-free list that a single consumer thread drains with assetLoaderPoll().
+
+typedef void (*AssetLoaderRun)(void *data);
+
+typedef struct AssetLoaderJob {
+    AssetLoaderRun         run;
+    void                  *data;
+    struct AssetLoaderJob *next;
+} AssetLoaderJob;
+
+typedef struct {
+    pthread_t *threads;
+    size_t     threadCount;
+
+    // Jobs waiting for a thread
+    pthread_mutex_t mutex;
+    pthread_cond_t  wake;
+    AssetLoaderJob *head;
+    AssetLoaderJob *tail;
+    bool            quit;
+
+    // Finished jobs, newest first. The loader threads push without a lock
+    // and the consumer takes the whole list at once.
+    _Atomic(AssetLoaderJob *) finished;
+
+    // Taken from finished by the consumer, oldest first
+    AssetLoaderJob *ready;
+} AssetLoader;
+
+#ifdef ASSET_LOADER_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void assetLoaderFinish(AssetLoader *loader, AssetLoaderJob *job)
+{
+    AssetLoaderJob *head = atomic_load_explicit(&loader->finished, memory_order_relaxed);
+
+    do
+        job->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&loader->finished, &head, job,
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+static void *assetLoaderThread(void *data)
+{
+    AssetLoader *loader = data;
+
+    pthread_mutex_lock(&loader->mutex);
+
+    for (;;) {
+        while (!loader->head && !loader->quit)
+            pthread_cond_wait(&loader->wake, &loader->mutex);
+
+        if (loader->quit)
+            break;
+
+        AssetLoaderJob *job = loader->head;
+        loader->head = job->next;
+        if (!loader->head)
+            loader->tail = NULL;
+
+        pthread_mutex_unlock(&loader->mutex);
+
+        job->run(job->data);
+        assetLoaderFinish(loader, job);
+
+        pthread_mutex_lock(&loader->mutex);
+    }
+
+    pthread_mutex_unlock(&loader->mutex);
+
+    return NULL;
+}
+
+void assetLoaderInit(AssetLoader *loader, size_t threadCount)
+{
+    loader->threadCount = threadCount > 0 ? threadCount : 1;
+    loader->threads     = malloc(loader->threadCount * sizeof(pthread_t));
+    loader->head        = NULL;
+    loader->tail        = NULL;
+    loader->quit        = false;
+    loader->ready       = NULL;
+
+    atomic_init(&loader->finished, NULL);
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->wake, NULL);
+
+    for (size_t i = 0; i < loader->threadCount; i++) {
+        if (pthread_create(&loader->threads[i], NULL, assetLoaderThread, loader) != 0) {
+            fprintf(stderr, "Failed to create asset loader thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// May be called from any thread
+void assetLoaderSubmit(AssetLoader *loader, AssetLoaderRun run, void *data)
+{
+    AssetLoaderJob *job = malloc(sizeof(AssetLoaderJob));
+    job->run  = run;
+    job->data = data;
+    job->next = NULL;
+
+    pthread_mutex_lock(&loader->mutex);
+
+    if (loader->tail)
+        loader->tail->next = job;
+    else
+        loader->head = job;
+    loader->tail = job;
+
+    pthread_cond_signal(&loader->wake);
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+// Returns the data of a finished job, or NULL if none finished since the last
+// call. Only one thread may poll.
+void *assetLoaderPoll(AssetLoader *loader)
+{
+    if (!loader->ready) {
+        AssetLoaderJob *job = atomic_exchange_explicit(&loader->finished, NULL, memory_order_acquire);
+
+        // Reverse, so jobs come out in the order they finished
+        while (job) {
+            AssetLoaderJob *next = job->next;
+            job->next = loader->ready;
+            loader->ready = job;
+            job = next;
+        }
+
+        if (!loader->ready)
+            return NULL;
+    }
+
+    AssetLoaderJob *job = loader->ready;
+    loader->ready = job->next;
+
+    void *data = job->data;
+    free(job);
+
+    return data;
+}
+
+// Waits for the running jobs and stops the threads. Jobs that never started
+// are handed back by assetLoaderPoll() afterwards without having run.
+void assetLoaderFree(AssetLoader *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+    loader->quit = true;
+    pthread_cond_broadcast(&loader->wake);
+    pthread_mutex_unlock(&loader->mutex);
+
+    for (size_t i = 0; i < loader->threadCount; i++)
+        pthread_join(loader->threads[i], NULL);
+
+    for (AssetLoaderJob *job = loader->head, *next; job; job = next) {
+        next = job->next;
+        assetLoaderFinish(loader, job);
+    }
+
+    loader->head = NULL;
+    loader->tail = NULL;
+
+    pthread_cond_destroy(&loader->wake);
+    pthread_mutex_destroy(&loader->mutex);
+    free(loader->threads);
+}
+
+#endif // ASSET_LOADER_IMPLEMENTATION
+
+#endif // asset_loader_h_INCLUDED
@@ -0,0 +1,528 @@
+#ifndef asset_pack_h_INCLUDED
+#define asset_pack_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A single file holding many assets, mapped into memory once and looked up by
+// path through a hash table, so loading an asset needs no syscalls. Entries
+// are stored as is and returned without a copy, or LZ compressed and
+// decompressed on lookup.
+//
+// Layout, in native byte order like the vmd and vtd formats:
+//   AssetPackHeader
+//   uint32_t slots[slotCount]      entry index + 1 by path hash, 0 if empty
+//   AssetPackEntry entries[entryCount]
+//   names                          NUL terminated paths
+//   data                           each entry aligned to its alignment
+
+#define ASSET_PACK_MAGIC   0x50414b56 // "VKAP"
+#define ASSET_PACK_VERSION 1
+
+// Enough for any optimalBufferCopyOffsetAlignment and nonCoherentAtomSize,
+// so stored entries can be copied into staging memory as is
+#define ASSET_PACK_ALIGN 256
+
+#define ASSET_PACK_COMPRESSED (1 << 0)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t slotCount; // A power of two
+    uint64_t slotsOffset;
+    uint64_t entriesOffset;
+    uint64_t namesOffset;
+    uint64_t fileSize;
+} AssetPackHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t size;       // Once decompressed
+    uint64_t storedSize;
+    uint32_t nameOffset; // From namesOffset
+    uint32_t alignment;
+    uint32_t flags;
+    uint32_t padding;
+} AssetPackEntry;
+
+typedef struct {
+    const char            *data; // The whole mapped file, NULL if none is open
+    size_t                 size;
+    const AssetPackHeader *header;
+    const uint32_t        *slots;
+    const AssetPackEntry  *entries;
+    const char            *names;
+} AssetPack;
+
+typedef struct {
+    const char *name;
+    const char *data;
+    size_t      size;
+    uint32_t    alignment; // 0 for ASSET_PACK_ALIGN
+    bool        compress;  // Only kept if it saves at least an eighth
+} AssetPackInput;
+
+#ifdef ASSET_PACK_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// FNV-1a
+static uint64_t assetPackHash(const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (; *name; name++)
+        hash = (hash ^ (uint8_t) *name) * 0x100000001b3;
+
+    return hash;
+}
+
+// The compressed format is a series of sequences, each a token byte with the
+// literal count in the high and the match length - 4 in the low nibble, a
+// nibble of 15 being continued by bytes that are added until one isn't 255.
+// Then the literals, a 16 bit offset back to the match, and the match length
+// continuation. The last sequence ends after its literals.
+
+#define ASSET_PACK_MIN_MATCH  4
+#define ASSET_PACK_HASH_BITS  14
+
+static size_t assetPackCompressBound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+static uint8_t *assetPackPutLength(uint8_t *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+
+    return op;
+}
+
+static uint32_t assetPackRead32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+
+    return value;
+}
+
+// dst must hold assetPackCompressBound(size) bytes, returns the compressed size
+static size_t assetPackCompress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    uint32_t *table = calloc(1 << ASSET_PACK_HASH_BITS, sizeof(uint32_t));
+    const uint8_t *literals = src;
+    uint8_t *op = dst;
+    size_t i = 0;
+
+    while (size >= ASSET_PACK_MIN_MATCH && i <= size - ASSET_PACK_MIN_MATCH) {
+        uint32_t sequence = assetPackRead32(src + i);
+        uint32_t slot = (sequence * 2654435761u) >> (32 - ASSET_PACK_HASH_BITS);
+        size_t candidate = table[slot];
+        table[slot] = i;
+
+        if (candidate >= i || i - candidate > 0xffff || assetPackRead32(src + candidate) != sequence) {
+            i++;
+            continue;
+        }
+
+        size_t match = ASSET_PACK_MIN_MATCH;
+        while (i + match < size && src[candidate + match] == src[i + match])
+            match++;
+
+        size_t literalCount = src + i - literals;
+        size_t extra = match - ASSET_PACK_MIN_MATCH;
+        *op++ = (literalCount < 15 ? literalCount : 15) << 4 | (extra < 15 ? extra : 15);
+
+        if (literalCount >= 15)
+            op = assetPackPutLength(op, literalCount - 15);
+        memcpy(op, literals, literalCount);
+        op += literalCount;
+
+        *op++ = (i - candidate) & 0xff;
+        *op++ = (i - candidate) >> 8;
+
+        if (extra >= 15)
+            op = assetPackPutLength(op, extra - 15);
+
+        i += match;
+        literals = src + i;
+    }
+
+    size_t literalCount = src + size - literals;
+    *op++ = (literalCount < 15 ? literalCount : 15) << 4;
+    if (literalCount >= 15)
+        op = assetPackPutLength(op, literalCount - 15);
+    memcpy(op, literals, literalCount);
+    op += literalCount;
+
+    free(table);
+
+    return op - dst;
+}
+
+static bool assetPackGetLength(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip >= end)
+            return false;
+
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+// Returns false if src doesn't decompress to exactly size bytes
+static bool assetPackDecompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t size)
+{
+    const uint8_t *ip = src, *end = src + srcSize;
+    uint8_t *op = dst, *opEnd = dst + size;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !assetPackGetLength(&ip, end, &literalCount))
+            return false;
+
+        if (literalCount > (size_t) (end - ip) || literalCount > (size_t) (opEnd - op))
+            return false;
+
+        memcpy(op, ip, literalCount);
+        ip += literalCount;
+        op += literalCount;
+
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return false;
+
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        size_t match = (token & 15) + ASSET_PACK_MIN_MATCH;
+        if ((token & 15) == 15 && !assetPackGetLength(&ip, end, &match))
+            return false;
+
+        if (offset == 0 || offset > (size_t) (op - dst) || match > (size_t) (opEnd - op))
+            return false;
+
+        // Byte by byte, the match may overlap what it writes
+        for (const uint8_t *from = op - offset; match > 0; match--)
+            *op++ = *from++;
+    }
+
+    return op == opEnd;
+}
+
+static bool assetPackFail(AssetPack *pack, const char *path, const char *reason)
+{
+    fprintf(stderr, "Asset pack %s is corrupt: %s\n", path, reason);
+    munmap((void *) pack->data, pack->size);
+    pack->data = NULL;
+
+    return false;
+}
+
+// Maps the pack at path, checking the whole table of contents up front so
+// lookups can trust it. Returns false if there's no valid pack.
+bool assetPackOpen(AssetPack *pack, const char *path)
+{
+    pack->data = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(AssetPackHeader)) {
+        close(fd);
+        fprintf(stderr, "Asset pack %s is too small\n", path);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map asset pack %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    pack->data   = data;
+    pack->size   = st.st_size;
+    pack->header = data;
+
+    const AssetPackHeader *header = pack->header;
+
+    if (header->magic != ASSET_PACK_MAGIC || header->version != ASSET_PACK_VERSION)
+        return assetPackFail(pack, path, "wrong magic or version");
+
+    if (header->fileSize != pack->size)
+        return assetPackFail(pack, path, "truncated");
+
+    if (header->slotCount == 0 || (header->slotCount & (header->slotCount - 1))
+        || header->slotCount <= header->entryCount)
+        return assetPackFail(pack, path, "bad slot count");
+
+    if (header->slotsOffset % sizeof(uint32_t) || header->entriesOffset % sizeof(uint64_t)
+        || header->slotsOffset > pack->size || header->entriesOffset > pack->size
+        || header->namesOffset > pack->size
+        || (pack->size - header->slotsOffset) / sizeof(uint32_t) < header->slotCount
+        || (pack->size - header->entriesOffset) / sizeof(AssetPackEntry) < header->entryCount)
+        return assetPackFail(pack, path, "table of contents out of bounds");
+
+    pack->slots   = (const uint32_t *) (pack->data + header->slotsOffset);
+    pack->entries = (const AssetPackEntry *) (pack->data + header->entriesOffset);
+    pack->names   = pack->data + header->namesOffset;
+
+    size_t namesSize = pack->size - header->namesOffset;
+
+    for (uint32_t i = 0; i < header->entryCount; i++) {
+        const AssetPackEntry *entry = &pack->entries[i];
+
+        if (entry->nameOffset >= namesSize || !memchr(pack->names + entry->nameOffset, '\0',
+                                                      namesSize - entry->nameOffset))
+            return assetPackFail(pack, path, "name out of bounds");
+
+        if (entry->offset > pack->size || entry->storedSize > pack->size - entry->offset)
+            return assetPackFail(pack, path, "data out of bounds");
+
+        if (!(entry->flags & ASSET_PACK_COMPRESSED) && entry->storedSize != entry->size)
+            return assetPackFail(pack, path, "size mismatch");
+    }
+
+    // Lookups stop at an empty slot, so one has to exist
+    uint32_t usedSlots = 0;
+
+    for (uint32_t i = 0; i < header->slotCount; i++) {
+        if (pack->slots[i] > header->entryCount)
+            return assetPackFail(pack, path, "slot out of bounds");
+
+        usedSlots += pack->slots[i] != 0;
+    }
+
+    if (usedSlots != header->entryCount)
+        return assetPackFail(pack, path, "slot count doesn't match the entries");
+
+    // Start reading everything in, most of the pack is needed at startup
+    madvise(data, pack->size, MADV_WILLNEED);
+
+    return true;
+}
+
+void assetPackClose(AssetPack *pack)
+{
+    if (pack->data)
+        munmap((void *) pack->data, pack->size);
+
+    pack->data = NULL;
+}
+
+// Returns NULL if the pack has no entry at path
+const AssetPackEntry *assetPackFind(const AssetPack *pack, const char *path)
+{
+    if (!pack->data)
+        return NULL;
+
+    uint64_t hash = assetPackHash(path);
+    uint32_t mask = pack->header->slotCount - 1;
+
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        uint32_t index = pack->slots[slot];
+        if (index == 0)
+            return NULL;
+
+        const AssetPackEntry *entry = &pack->entries[index - 1];
+        if (entry->hash == hash && strcmp(pack->names + entry->nameOffset, path) == 0)
+            return entry;
+    }
+}
+
+// Returns the contents of the entry at path, or NULL if there's none or it
+// doesn't decompress. Stored entries point into the mapping and set *owned to
+// NULL, compressed ones are decompressed into *owned for the caller to free.
+// Safe to call from any thread.
+const char *assetPackGet(const AssetPack *pack, const char *path, size_t *size, char **owned)
+{
+    *owned = NULL;
+
+    const AssetPackEntry *entry = assetPackFind(pack, path);
+    if (!entry)
+        return NULL;
+
+    const char *stored = pack->data + entry->offset;
+    *size = entry->size;
+
+    if (!(entry->flags & ASSET_PACK_COMPRESSED))
+        return stored;
+
+    *owned = malloc(entry->size > 0 ? entry->size : 1);
+
+    if (!assetPackDecompress((const uint8_t *) stored, entry->storedSize, (uint8_t *) *owned, entry->size)) {
+        fprintf(stderr, "Asset %s in the pack is corrupt\n", path);
+        free(*owned);
+        *owned = NULL;
+        return NULL;
+    }
+
+    return *owned;
+}
+
+static int assetPackPad(FILE *fp, uint64_t *offset, uint64_t alignment)
+{
+    static const char zeros[ASSET_PACK_ALIGN];
+
+    while (*offset % alignment) {
+        size_t count = alignment - *offset % alignment;
+        if (count > sizeof(zeros))
+            count = sizeof(zeros);
+
+        if (fwrite(zeros, 1, count, fp) != count)
+            return -1;
+        *offset += count;
+    }
+
+    return 0;
+}
+
+// Writes the inputs to a new pack at path. Every name must be unique and every
+// alignment a power of two.
+bool assetPackWrite(const char *path, const AssetPackInput *inputs, size_t count)
+{
+    uint32_t slotCount = 16;
+    while (slotCount < count * 2)
+        slotCount *= 2;
+
+    uint32_t *slots = calloc(slotCount, sizeof(uint32_t));
+    AssetPackEntry *entries = calloc(count > 0 ? count : 1, sizeof(AssetPackEntry));
+    const char **stored = calloc(count > 0 ? count : 1, sizeof(char *));
+    uint64_t namesSize = 0;
+    bool success = false;
+
+    for (size_t i = 0; i < count; i++) {
+        AssetPackEntry *entry = &entries[i];
+
+        entry->hash       = assetPackHash(inputs[i].name);
+        entry->size       = inputs[i].size;
+        entry->storedSize = inputs[i].size;
+        entry->nameOffset = namesSize;
+        entry->alignment  = inputs[i].alignment ? inputs[i].alignment : ASSET_PACK_ALIGN;
+        stored[i]         = inputs[i].data;
+        namesSize        += strlen(inputs[i].name) + 1;
+
+        if (entry->alignment & (entry->alignment - 1)) {
+            fprintf(stderr, "Alignment of %s isn't a power of two\n", inputs[i].name);
+            goto done;
+        }
+
+        uint32_t mask = slotCount - 1;
+        uint32_t slot = entry->hash & mask;
+
+        for (; slots[slot]; slot = (slot + 1) & mask) {
+            if (strcmp(inputs[slots[slot] - 1].name, inputs[i].name) == 0) {
+                fprintf(stderr, "%s is in the pack twice\n", inputs[i].name);
+                goto done;
+            }
+        }
+
+        slots[slot] = i + 1;
+
+        if (inputs[i].compress && inputs[i].size > 0) {
+            uint8_t *compressed = malloc(assetPackCompressBound(inputs[i].size));
+            size_t compressedSize = assetPackCompress((const uint8_t *) inputs[i].data, inputs[i].size, compressed);
+
+            if (compressedSize <= inputs[i].size - inputs[i].size / 8) {
+                entry->flags     |= ASSET_PACK_COMPRESSED;
+                entry->storedSize = compressedSize;
+                stored[i]         = (const char *) compressed;
+            } else {
+                free(compressed);
+            }
+        }
+    }
+
+    AssetPackHeader header = {
+        .magic       = ASSET_PACK_MAGIC,
+        .version     = ASSET_PACK_VERSION,
+        .entryCount  = count,
+        .slotCount   = slotCount,
+        .slotsOffset = sizeof(AssetPackHeader)
+    };
+
+    header.entriesOffset = header.slotsOffset + slotCount * sizeof(uint32_t);
+    header.entriesOffset = (header.entriesOffset + 7) & ~(uint64_t) 7;
+    header.namesOffset   = header.entriesOffset + count * sizeof(AssetPackEntry);
+
+    uint64_t offset = header.namesOffset + namesSize;
+    for (size_t i = 0; i < count; i++) {
+        offset = (offset + entries[i].alignment - 1) & ~(uint64_t) (entries[i].alignment - 1);
+        entries[i].offset = offset;
+        offset += entries[i].storedSize;
+    }
+
+    header.fileSize = offset;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    offset = header.slotsOffset + slotCount * sizeof(uint32_t);
+
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1
+                   && fwrite(slots, sizeof(uint32_t), slotCount, fp) == slotCount
+                   && assetPackPad(fp, &offset, 8) == 0
+                   && fwrite(entries, sizeof(AssetPackEntry), count, fp) == count;
+
+    for (size_t i = 0; written && i < count; i++)
+        written = fwrite(inputs[i].name, 1, strlen(inputs[i].name) + 1, fp) == strlen(inputs[i].name) + 1;
+
+    offset = header.namesOffset + namesSize;
+
+    for (size_t i = 0; written && i < count; i++) {
+        written = assetPackPad(fp, &offset, entries[i].alignment) == 0
+                  && fwrite(stored[i], 1, entries[i].storedSize, fp) == entries[i].storedSize;
+        offset += entries[i].storedSize;
+    }
+
+    if (fclose(fp) != 0 || !written) {
+        fprintf(stderr, "Error writing %s\n", path);
+        remove(path);
+        goto done;
+    }
+
+    success = true;
+
+done:
+    for (size_t i = 0; i < count; i++)
+        if (stored[i] != inputs[i].data)
+            free((void *) stored[i]);
+
+    free(stored);
+    free(entries);
+    free(slots);
+
+    return success;
+}
+
+#endif // ASSET_PACK_IMPLEMENTATION
+
+#endif // asset_pack_h_INCLUDED
@@ -0,0 +1,423 @@
+#ifndef derived_cache_h_INCLUDED
+#define derived_cache_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// An on-disk cache of data derived from assets, such as converted vertices,
+// so a load can skip the conversion when it has done it before. Entries are
+// keyed by the SHA-256 of the source bytes and the conversion's parameters,
+// so an edited asset or a changed conversion simply misses. Each entry is a
+// file in the cache directory, and once they add up to more than the size
+// limit the least recently used ones are deleted. Safe to use from any
+// thread, a cache that was never initialized misses everything.
+
+#define DERIVED_CACHE_MAGIC   0x43445644 // "DVDC"
+#define DERIVED_CACHE_VERSION 1
+
+typedef struct {
+    uint8_t bytes[32];
+} DerivedCacheKey;
+
+typedef struct {
+    char    *dir;
+    uint64_t maxSize;
+
+    // Sum of the entry sizes
+    pthread_mutex_t mutex;
+    uint64_t        size;
+
+    _Atomic uint32_t hits;
+    _Atomic uint32_t misses;
+    _Atomic uint32_t stores;
+    _Atomic uint32_t evictions;
+} DerivedCache;
+
+#ifdef DERIVED_CACHE_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t  block[64];
+} DerivedCacheSha256;
+
+static const uint32_t derivedCacheRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define DERIVED_CACHE_ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void derivedCacheSha256Block(DerivedCacheSha256 *sha, const uint8_t *block)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t) block[i * 4] << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = DERIVED_CACHE_ROTR(w[i - 15], 7) ^ DERIVED_CACHE_ROTR(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 = DERIVED_CACHE_ROTR(w[i - 2], 17) ^ DERIVED_CACHE_ROTR(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = DERIVED_CACHE_ROTR(e, 6) ^ DERIVED_CACHE_ROTR(e, 11) ^ DERIVED_CACHE_ROTR(e, 25);
+        uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + derivedCacheRoundConstants[i] + w[i];
+        uint32_t s0 = DERIVED_CACHE_ROTR(a, 2) ^ DERIVED_CACHE_ROTR(a, 13) ^ DERIVED_CACHE_ROTR(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
+
+static void derivedCacheSha256Init(DerivedCacheSha256 *sha)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+}
+
+static void derivedCacheSha256Update(DerivedCacheSha256 *sha, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    while (size > 0) {
+        size_t used = sha->length % 64;
+        size_t count = 64 - used < size ? 64 - used : size;
+
+        // Whole blocks are hashed in place
+        if (used == 0 && size >= 64) {
+            derivedCacheSha256Block(sha, bytes);
+            count = 64;
+        } else {
+            memcpy(sha->block + used, bytes, count);
+            if (used + count == 64)
+                derivedCacheSha256Block(sha, sha->block);
+        }
+
+        sha->length += count;
+        bytes       += count;
+        size        -= count;
+    }
+}
+
+static void derivedCacheSha256Final(DerivedCacheSha256 *sha, uint8_t digest[32])
+{
+    uint64_t bits = sha->length * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padCount = (sha->length % 64 < 56 ? 56 : 120) - sha->length % 64;
+
+    for (int i = 0; i < 8; i++)
+        padding[padCount + i] = bits >> (56 - i * 8);
+
+    derivedCacheSha256Update(sha, padding, padCount + 8);
+
+    for (int i = 0; i < 32; i++)
+        digest[i] = sha->state[i / 4] >> (24 - i % 4 * 8);
+}
+
+// The key of converting source with params, which should cover everything
+// the result depends on besides the source, including a version of the
+// conversion code
+void derivedCacheKey(DerivedCacheKey *key, const void *source, size_t sourceSize,
+                     const void *params, size_t paramsSize)
+{
+    DerivedCacheSha256 sha;
+    uint64_t sizes[2] = {paramsSize, sourceSize};
+
+    derivedCacheSha256Init(&sha);
+    derivedCacheSha256Update(&sha, sizes, sizeof(sizes));
+    derivedCacheSha256Update(&sha, params, paramsSize);
+    derivedCacheSha256Update(&sha, source, sourceSize);
+    derivedCacheSha256Final(&sha, key->bytes);
+}
+
+typedef struct {
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        size;
+    DerivedCacheKey key;
+} DerivedCacheHeader;
+
+// dir/<key in hex>, the caller frees it
+static char *derivedCachePath(DerivedCache *cache, const DerivedCacheKey *key)
+{
+    char *path = malloc(strlen(cache->dir) + 2 + sizeof(key->bytes) * 2 + 1);
+    char *p = path + sprintf(path, "%s/", cache->dir);
+
+    for (size_t i = 0; i < sizeof(key->bytes); i++)
+        p += sprintf(p, "%02x", key->bytes[i]);
+
+    return path;
+}
+
+typedef struct {
+    char    *path;
+    uint64_t size;
+    struct timespec used;
+} DerivedCacheFile;
+
+static int derivedCacheCompareUsed(const void *a, const void *b)
+{
+    const struct timespec *x = &((const DerivedCacheFile *) a)->used;
+    const struct timespec *y = &((const DerivedCacheFile *) b)->used;
+
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Called with the mutex held. Lists the entries to recount the size, then
+// deletes the least recently used ones until a quarter of the cache is free,
+// so the stores that follow don't have to trim again straight away.
+static void derivedCacheTrim(DerivedCache *cache)
+{
+    DIR *dir = opendir(cache->dir);
+    if (!dir)
+        return;
+
+    DerivedCacheFile *files = NULL;
+    size_t fileCount = 0, fileCapacity = 0;
+
+    cache->size = 0;
+
+    for (struct dirent *ent; (ent = readdir(dir));) {
+        // Entries are named by their 64 digit key, this skips temporary files
+        if (strlen(ent->d_name) != sizeof(DerivedCacheKey) * 2)
+            continue;
+
+        char *path = malloc(strlen(cache->dir) + strlen(ent->d_name) + 2);
+        sprintf(path, "%s/%s", cache->dir, ent->d_name);
+
+        struct stat st;
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        if (fileCount == fileCapacity) {
+            fileCapacity = fileCapacity ? fileCapacity * 2 : 64;
+            files = realloc(files, fileCapacity * sizeof(DerivedCacheFile));
+        }
+
+        files[fileCount++] = (DerivedCacheFile) {
+            .path = path,
+            .size = st.st_size,
+            .used = st.st_mtim
+        };
+
+        cache->size += st.st_size;
+    }
+
+    closedir(dir);
+
+    if (cache->size > cache->maxSize) {
+        qsort(files, fileCount, sizeof(DerivedCacheFile), derivedCacheCompareUsed);
+
+        for (size_t i = 0; i < fileCount && cache->size > cache->maxSize - cache->maxSize / 4; i++) {
+            if (unlink(files[i].path) == 0) {
+                cache->size -= files[i].size;
+                atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < fileCount; i++)
+        free(files[i].path);
+    free(files);
+}
+
+// Uses the directory at dir, creating it if needed, keeping up to maxSize
+// bytes of entries in it. Returns false if the directory can't be used, the
+// cache then misses everything.
+bool derivedCacheInit(DerivedCache *cache, const char *dir, uint64_t maxSize)
+{
+    cache->dir     = NULL;
+    cache->maxSize = maxSize;
+    cache->size    = 0;
+
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->stores, 0);
+    atomic_init(&cache->evictions, 0);
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create the derived cache %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+
+    cache->dir = strdup(dir);
+    pthread_mutex_init(&cache->mutex, NULL);
+    derivedCacheTrim(cache);
+
+    return true;
+}
+
+bool derivedCacheEnabled(const DerivedCache *cache)
+{
+    return cache->dir != NULL;
+}
+
+void derivedCacheFree(DerivedCache *cache)
+{
+    if (!cache->dir)
+        return;
+
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->dir);
+    cache->dir = NULL;
+}
+
+// Returns the data stored under key, for the caller to free, or NULL on a miss
+void *derivedCacheGet(DerivedCache *cache, const DerivedCacheKey *key, size_t *size)
+{
+    if (!cache->dir)
+        return NULL;
+
+    char *path = derivedCachePath(cache, key);
+    void *data = NULL;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        DerivedCacheHeader header;
+        struct stat st;
+        bool broken = true;
+
+        // The size has to match the file before it's trusted with an allocation
+        if (fstat(fileno(fp), &st) == 0 && (uint64_t) st.st_size >= sizeof(header)
+            && fread(&header, sizeof(header), 1, fp) == 1 && header.magic == DERIVED_CACHE_MAGIC
+            && header.version == DERIVED_CACHE_VERSION && memcmp(&header.key, key, sizeof(*key)) == 0
+            && header.size == (uint64_t) st.st_size - sizeof(header)) {
+            data = malloc(header.size > 0 ? header.size : 1);
+            broken = data && fread(data, 1, header.size, fp) != header.size;
+
+            if (broken) {
+                free(data);
+                data = NULL;
+            }
+        }
+
+        fclose(fp);
+
+        // Marks the entry as recently used, or drops it if it's broken. One
+        // that only failed to allocate is kept.
+        if (data)
+            utimensat(AT_FDCWD, path, NULL, 0);
+        else if (broken)
+            unlink(path);
+
+        *size = data ? header.size : 0;
+    }
+
+    free(path);
+
+    atomic_fetch_add_explicit(data ? &cache->hits : &cache->misses, 1, memory_order_relaxed);
+
+    return data;
+}
+
+// Stores size bytes of data under key, replacing what was there
+void derivedCachePut(DerivedCache *cache, const DerivedCacheKey *key, const void *data, size_t size)
+{
+    if (!cache->dir || size + sizeof(DerivedCacheHeader) > cache->maxSize)
+        return;
+
+    char *path = derivedCachePath(cache, key);
+
+    // Written next to the entry and renamed over it, so other threads and
+    // processes never see a partial entry
+    char *tempPath = malloc(strlen(path) + 8);
+    sprintf(tempPath, "%s.XXXXXX", path);
+
+    DerivedCacheHeader header = {
+        .magic   = DERIVED_CACHE_MAGIC,
+        .version = DERIVED_CACHE_VERSION,
+        .size    = size,
+        .key     = *key
+    };
+
+    int fd = mkstemp(tempPath);
+    FILE *fp = fd != -1 ? fdopen(fd, "wb") : NULL;
+
+    bool written = fp && fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(data, 1, size, fp) == size;
+
+    if (fp)
+        written = fclose(fp) == 0 && written;
+    else if (fd != -1)
+        close(fd);
+
+    if (written && rename(tempPath, path) == 0) {
+        atomic_fetch_add_explicit(&cache->stores, 1, memory_order_relaxed);
+
+        pthread_mutex_lock(&cache->mutex);
+        cache->size += sizeof(header) + size;
+        if (cache->size > cache->maxSize)
+            derivedCacheTrim(cache);
+        pthread_mutex_unlock(&cache->mutex);
+    } else if (fd != -1) {
+        unlink(tempPath);
+    }
+
+    free(tempPath);
+    free(path);
+}
+
+void derivedCachePrintStats(DerivedCache *cache)
+{
+    if (!cache->dir)
+        return;
+
+    pthread_mutex_lock(&cache->mutex);
+    uint64_t size = cache->size;
+    pthread_mutex_unlock(&cache->mutex);
+
+    printf("Derived cache %s: %u hits, %u misses, %u stores, %u evictions, %.1f of %.1f MiB used\n", cache->dir,
+           atomic_load(&cache->hits), atomic_load(&cache->misses), atomic_load(&cache->stores),
+           atomic_load(&cache->evictions), size / 1048576.0, cache->maxSize / 1048576.0);
+}
+
+#endif // DERIVED_CACHE_IMPLEMENTATION
+
+#endif // derived_cache_h_INCLUDED
@@ -0,0 +1,373 @@
+#ifndef file_batch_h_INCLUDED
+#define file_batch_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reads many whole files at once. On Linux the reads of a batch are split
+// into chunks that are all queued on an io_uring, so the drive sees a deep
+// queue instead of one read at a time. Without io_uring every file gets a
+// readahead hint up front and is then read with pread. Each file is handed
+// to a callback on the calling thread as soon as it's complete, so decoding
+// overlaps the reads still in flight.
+
+// Bypass the page cache with O_DIRECT where the file system allows it. The
+// data is then aligned to FILE_BATCH_ALIGN.
+#define FILE_BATCH_DIRECT (1 << 0)
+
+#define FILE_BATCH_ALIGN 4096
+
+typedef struct {
+    const char *path;
+
+    // Filled in by fileBatchRead(). data is NULL if the file couldn't be
+    // read, with error holding the errno, and is freed with free().
+    char  *data;
+    size_t size;
+    int    error;
+} FileBatchEntry;
+
+typedef void (*FileBatchDone)(FileBatchEntry *entry, size_t index, void *user);
+
+#ifdef FILE_BATCH_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#define FILE_BATCH_CHUNK_SIZE  (1 << 20)
+#define FILE_BATCH_QUEUE_DEPTH 64
+
+typedef struct {
+    int      fd;
+    bool     direct;
+    uint32_t chunkCount;
+    uint32_t chunksLeft;
+} FileBatchFile;
+
+// Length of a chunk's read, O_DIRECT reads whole blocks and stops short at
+// the end of the file
+static size_t fileBatchChunkLength(FileBatchEntry *entry, FileBatchFile *file, uint32_t chunk)
+{
+    size_t offset = (size_t) chunk * FILE_BATCH_CHUNK_SIZE;
+    size_t length = entry->size - offset < FILE_BATCH_CHUNK_SIZE ? entry->size - offset : FILE_BATCH_CHUNK_SIZE;
+
+    if (file->direct)
+        length = (length + FILE_BATCH_ALIGN - 1) & ~(size_t) (FILE_BATCH_ALIGN - 1);
+
+    return length;
+}
+
+static void fileBatchFail(FileBatchEntry *entry, int error)
+{
+    if (entry->error == 0)
+        entry->error = error;
+}
+
+static void fileBatchOpen(FileBatchEntry *entry, FileBatchFile *file, uint32_t flags)
+{
+    entry->data  = NULL;
+    entry->size  = 0;
+    entry->error = 0;
+
+    file->fd         = -1;
+    file->direct     = false;
+    file->chunkCount = 0;
+    file->chunksLeft = 0;
+
+#ifdef O_DIRECT
+    // Not every file system supports it, those get a buffered read
+    if (flags & FILE_BATCH_DIRECT) {
+        file->fd     = open(entry->path, O_RDONLY | O_DIRECT);
+        file->direct = file->fd != -1;
+    }
+#endif
+
+    if (file->fd == -1)
+        file->fd = open(entry->path, O_RDONLY);
+
+    struct stat st;
+
+    if (file->fd == -1 || fstat(file->fd, &st) == -1) {
+        fileBatchFail(entry, errno);
+        return;
+    }
+
+    entry->size = st.st_size;
+
+    if (file->direct) {
+        size_t capacity = (entry->size + FILE_BATCH_ALIGN - 1) & ~(size_t) (FILE_BATCH_ALIGN - 1);
+        entry->data = aligned_alloc(FILE_BATCH_ALIGN, capacity > 0 ? capacity : FILE_BATCH_ALIGN);
+    } else {
+        entry->data = malloc(entry->size > 0 ? entry->size : 1);
+
+        // Starts reading the whole file into the page cache in the background
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+
+    file->chunkCount = (entry->size + FILE_BATCH_CHUNK_SIZE - 1) / FILE_BATCH_CHUNK_SIZE;
+    file->chunksLeft = file->chunkCount;
+}
+
+// Reads what a chunk's read left out, retrying short reads and interruptions
+static void fileBatchReadRest(FileBatchEntry *entry, FileBatchFile *file, uint32_t chunk, size_t done)
+{
+    size_t offset = (size_t) chunk * FILE_BATCH_CHUNK_SIZE;
+    size_t length = fileBatchChunkLength(entry, file, chunk);
+
+    while (done < length && offset + done < entry->size) {
+        ssize_t result = pread(file->fd, entry->data + offset + done, length - done, offset + done);
+
+        if (result == -1 && errno == EINTR)
+            continue;
+
+        if (result <= 0) {
+            fileBatchFail(entry, result == 0 ? EIO : errno);
+            return;
+        }
+
+        done += result;
+    }
+}
+
+static void fileBatchClose(FileBatchEntry *entry, FileBatchFile *file, size_t index,
+                           FileBatchDone done, void *user)
+{
+    if (file->fd != -1)
+        close(file->fd);
+
+    if (entry->error != 0) {
+        fprintf(stderr, "Error reading %s: %s\n", entry->path, strerror(entry->error));
+        free(entry->data);
+        entry->data = NULL;
+        entry->size = 0;
+    }
+
+    done(entry, index, user);
+}
+
+#ifdef __linux__
+
+typedef struct {
+    int fd;
+
+    _Atomic unsigned *sqHead;
+    _Atomic unsigned *sqTail;
+    unsigned         *sqMask;
+    unsigned         *sqArray;
+    _Atomic unsigned *cqHead;
+    _Atomic unsigned *cqTail;
+    unsigned         *cqMask;
+
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void  *sqRing;
+    void  *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+} FileBatchRing;
+
+static void fileBatchRingFree(FileBatchRing *ring)
+{
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != MAP_FAILED)
+        munmap(ring->sqRing, ring->sqRingSize);
+
+    close(ring->fd);
+}
+
+// Fails on kernels without io_uring or without IORING_OP_READ, which came
+// with IORING_FEAT_RW_CUR_POS in 5.6, and where it's blocked
+static bool fileBatchRingInit(FileBatchRing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sqRing = MAP_FAILED;
+    ring->cqRing = MAP_FAILED;
+    ring->sqes   = MAP_FAILED;
+
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        fileBatchRingFree(ring);
+        return false;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize   = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Both rings share one mapping where the kernel allows it
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cqRingSize > ring->sqRingSize)
+        ring->sqRingSize = ring->cqRingSize;
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = single ? ring->sqRing
+                          : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes   = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        fileBatchRingFree(ring);
+        return false;
+    }
+
+    char *sq = ring->sqRing, *cq = ring->cqRing;
+
+    ring->sqHead  = (_Atomic unsigned *) (sq + params.sq_off.head);
+    ring->sqTail  = (_Atomic unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask  = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead  = (_Atomic unsigned *) (cq + params.cq_off.head);
+    ring->cqTail  = (_Atomic unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask  = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+// Keeps up to FILE_BATCH_QUEUE_DEPTH chunk reads in flight, user_data holds
+// the file index in the upper and the chunk in the lower 32 bits
+static void fileBatchReadRing(FileBatchRing *ring, FileBatchEntry *entries, FileBatchFile *files, size_t count,
+                              FileBatchDone done, void *user)
+{
+    size_t   nextFile  = 0;
+    uint32_t nextChunk = 0;
+    unsigned inFlight  = 0;
+    unsigned queued    = 0;
+
+    for (;;) {
+        unsigned tail = atomic_load_explicit(ring->sqTail, memory_order_relaxed);
+
+        while (inFlight + queued < FILE_BATCH_QUEUE_DEPTH && nextFile < count) {
+            FileBatchEntry *entry = &entries[nextFile];
+            FileBatchFile *file = &files[nextFile];
+
+            if (nextChunk >= file->chunkCount) {
+                // Empty files and ones that failed to open are already done
+                if (file->chunkCount == 0)
+                    fileBatchClose(entry, file, nextFile, done, user);
+
+                nextFile++;
+                nextChunk = 0;
+                continue;
+            }
+
+            unsigned slot = tail & *ring->sqMask;
+            struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode    = IORING_OP_READ;
+            sqe->fd        = file->fd;
+            sqe->addr      = (uint64_t) (uintptr_t) (entry->data + (size_t) nextChunk * FILE_BATCH_CHUNK_SIZE);
+            sqe->len       = fileBatchChunkLength(entry, file, nextChunk);
+            sqe->off       = (uint64_t) nextChunk * FILE_BATCH_CHUNK_SIZE;
+            sqe->user_data = (uint64_t) nextFile << 32 | nextChunk;
+
+            ring->sqArray[slot] = slot;
+            tail++;
+            queued++;
+            nextChunk++;
+        }
+
+        atomic_store_explicit(ring->sqTail, tail, memory_order_release);
+
+        if (inFlight + queued == 0)
+            break;
+
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno == EINTR)
+            continue;
+
+        if (submitted < 0) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        inFlight += submitted;
+        queued   -= submitted;
+
+        unsigned head = atomic_load_explicit(ring->cqHead, memory_order_relaxed);
+        unsigned cqTail = atomic_load_explicit(ring->cqTail, memory_order_acquire);
+
+        for (; head != cqTail; head++, inFlight--) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            size_t index = cqe->user_data >> 32;
+            uint32_t chunk = cqe->user_data & 0xffffffff;
+
+            FileBatchEntry *entry = &entries[index];
+            FileBatchFile *file = &files[index];
+
+            if (cqe->res < 0)
+                fileBatchFail(entry, -cqe->res);
+            else if (entry->error == 0)
+                fileBatchReadRest(entry, file, chunk, cqe->res);
+
+            if (--file->chunksLeft == 0)
+                fileBatchClose(entry, file, index, done, user);
+        }
+
+        atomic_store_explicit(ring->cqHead, head, memory_order_release);
+    }
+}
+
+#endif // __linux__
+
+// Reads every entry's path, calling done for each file once it's complete.
+// The order is up to the drive.
+void fileBatchRead(FileBatchEntry *entries, size_t count, uint32_t flags, FileBatchDone done, void *user)
+{
+    FileBatchFile *files = malloc(count * sizeof(FileBatchFile));
+
+    for (size_t i = 0; i < count; i++)
+        fileBatchOpen(&entries[i], &files[i], flags);
+
+#ifdef __linux__
+    FileBatchRing ring;
+
+    if (fileBatchRingInit(&ring, FILE_BATCH_QUEUE_DEPTH)) {
+        fileBatchReadRing(&ring, entries, files, count, done, user);
+        fileBatchRingFree(&ring);
+        free(files);
+        return;
+    }
+#endif
+
+    // The readahead hints above already have the files loading in parallel
+    for (size_t i = 0; i < count; i++) {
+        for (uint32_t chunk = 0; chunk < files[i].chunkCount && entries[i].error == 0; chunk++)
+            fileBatchReadRest(&entries[i], &files[i], chunk, 0);
+
+        fileBatchClose(&entries[i], &files[i], i, done, user);
+    }
+
+    free(files);
+}
+
+#endif // FILE_BATCH_IMPLEMENTATION
+
+#endif // file_batch_h_INCLUDED
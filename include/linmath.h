@@ -3,6 +3,23 @@
 
 #include <math.h>
 
+/* The matrix kernels below pick SSE or NEON at compile time. Define
+ * LINMATH_NO_SIMD to force the portable code, which stays callable as the
+ * *_scalar variants either way. */
+#if !defined(LINMATH_NO_SIMD)
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LINMATH_SSE
+#include <xmmintrin.h>
+#if defined(__AVX__)
+#define LINMATH_AVX
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LINMATH_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 #define LINMATH_H_DEFINE_VEC(n) \
 typedef float vec##n[n]; \
 static inline void vec##n##_add(vec##n r, vec##n const a, vec##n const b) \
@@ -150,7 +167,7 @@ static inline void mat4x4_scale_aniso(mat4x4 M, mat4x4 a, float x, float y, floa
 		M[3][i] = a[3][i];
 	}
 }
-static inline void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
+static inline void mat4x4_mul_scalar(mat4x4 M, mat4x4 a, mat4x4 b)
 {
 	mat4x4 temp;
 	int k, r, c;
@@ -161,7 +178,40 @@ static inline void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
 	}
 	mat4x4_dup(M, temp);
 }
-static inline void mat4x4_mul_vec4(vec4 r, mat4x4 M, vec4 v)
+static inline void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
+{
+#if defined(LINMATH_SSE)
+	/* Every column of the result is a linear combination of a's columns */
+	__m128 a0 = _mm_loadu_ps(a[0]), a1 = _mm_loadu_ps(a[1]);
+	__m128 a2 = _mm_loadu_ps(a[2]), a3 = _mm_loadu_ps(a[3]);
+	__m128 r[4];
+	int c;
+	for(c=0; c<4; ++c) {
+		r[c] = _mm_mul_ps(a0, _mm_set1_ps(b[c][0]));
+		r[c] = _mm_add_ps(r[c], _mm_mul_ps(a1, _mm_set1_ps(b[c][1])));
+		r[c] = _mm_add_ps(r[c], _mm_mul_ps(a2, _mm_set1_ps(b[c][2])));
+		r[c] = _mm_add_ps(r[c], _mm_mul_ps(a3, _mm_set1_ps(b[c][3])));
+	}
+	for(c=0; c<4; ++c)
+		_mm_storeu_ps(M[c], r[c]);
+#elif defined(LINMATH_NEON)
+	float32x4_t a0 = vld1q_f32(a[0]), a1 = vld1q_f32(a[1]);
+	float32x4_t a2 = vld1q_f32(a[2]), a3 = vld1q_f32(a[3]);
+	float32x4_t r[4];
+	int c;
+	for(c=0; c<4; ++c) {
+		r[c] = vmulq_n_f32(a0, b[c][0]);
+		r[c] = vmlaq_n_f32(r[c], a1, b[c][1]);
+		r[c] = vmlaq_n_f32(r[c], a2, b[c][2]);
+		r[c] = vmlaq_n_f32(r[c], a3, b[c][3]);
+	}
+	for(c=0; c<4; ++c)
+		vst1q_f32(M[c], r[c]);
+#else
+	mat4x4_mul_scalar(M, a, b);
+#endif
+}
+static inline void mat4x4_mul_vec4_scalar(vec4 r, mat4x4 M, vec4 v)
 {
 	int i, j;
 	for(j=0; j<4; ++j) {
@@ -170,6 +220,24 @@ static inline void mat4x4_mul_vec4(vec4 r, mat4x4 M, vec4 v)
 			r[j] += M[i][j] * v[i];
 	}
 }
+static inline void mat4x4_mul_vec4(vec4 r, mat4x4 M, vec4 v)
+{
+#if defined(LINMATH_SSE)
+	__m128 t = _mm_mul_ps(_mm_loadu_ps(M[0]), _mm_set1_ps(v[0]));
+	t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(M[1]), _mm_set1_ps(v[1])));
+	t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(M[2]), _mm_set1_ps(v[2])));
+	t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(M[3]), _mm_set1_ps(v[3])));
+	_mm_storeu_ps(r, t);
+#elif defined(LINMATH_NEON)
+	float32x4_t t = vmulq_n_f32(vld1q_f32(M[0]), v[0]);
+	t = vmlaq_n_f32(t, vld1q_f32(M[1]), v[1]);
+	t = vmlaq_n_f32(t, vld1q_f32(M[2]), v[2]);
+	t = vmlaq_n_f32(t, vld1q_f32(M[3]), v[3]);
+	vst1q_f32(r, t);
+#else
+	mat4x4_mul_vec4_scalar(r, M, v);
+#endif
+}
 static inline void mat4x4_translate(mat4x4 T, float x, float y, float z)
 {
 	mat4x4_identity(T);
@@ -263,7 +331,7 @@ static inline void mat4x4_rotate_Z(mat4x4 Q, mat4x4 M, float angle)
 	};
 	mat4x4_mul(Q, M, R);
 }
-static inline void mat4x4_invert(mat4x4 T, mat4x4 M)
+static inline void mat4x4_invert_scalar(mat4x4 T, mat4x4 M)
 {
 	float s[6];
 	float c[6];
@@ -304,6 +372,74 @@ static inline void mat4x4_invert(mat4x4 T, mat4x4 M)
 	T[3][2] = (-M[3][0] * s[3] + M[3][1] * s[1] - M[3][2] * s[0]) * idet;
 	T[3][3] = ( M[2][0] * s[3] - M[2][1] * s[1] + M[2][2] * s[0]) * idet;
 }
+#if defined(LINMATH_SSE)
+/* 2x2 matrices packed as (m00, m01, m10, m11) in one register */
+#define LINMATH_SWIZZLE(v, x, y, z, w) _mm_shuffle_ps(v, v, _MM_SHUFFLE(w, z, y, x))
+static inline __m128 linmath_mat2_mul(__m128 a, __m128 b)
+{
+	return _mm_add_ps(_mm_mul_ps(a, LINMATH_SWIZZLE(b, 0, 3, 0, 3)),
+	                  _mm_mul_ps(LINMATH_SWIZZLE(a, 1, 0, 3, 2), LINMATH_SWIZZLE(b, 2, 1, 2, 1)));
+}
+/* adj(a) * b */
+static inline __m128 linmath_mat2_adj_mul(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(LINMATH_SWIZZLE(a, 3, 3, 0, 0), b),
+	                  _mm_mul_ps(LINMATH_SWIZZLE(a, 1, 1, 2, 2), LINMATH_SWIZZLE(b, 2, 3, 0, 1)));
+}
+/* a * adj(b) */
+static inline __m128 linmath_mat2_mul_adj(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(a, LINMATH_SWIZZLE(b, 3, 0, 3, 0)),
+	                  _mm_mul_ps(LINMATH_SWIZZLE(a, 1, 0, 3, 2), LINMATH_SWIZZLE(b, 2, 1, 2, 1)));
+}
+#endif
+static inline void mat4x4_invert(mat4x4 T, mat4x4 M)
+{
+#if defined(LINMATH_SSE)
+	/* Blockwise inverse over the four 2x2 sub-matrices. Inverting the
+	 * transpose and transposing back is the same thing, so the row major
+	 * derivation applies to the column major storage unchanged. */
+	__m128 m0 = _mm_loadu_ps(M[0]), m1 = _mm_loadu_ps(M[1]);
+	__m128 m2 = _mm_loadu_ps(M[2]), m3 = _mm_loadu_ps(M[3]);
+
+	__m128 A = _mm_movelh_ps(m0, m1), B = _mm_movehl_ps(m1, m0);
+	__m128 C = _mm_movelh_ps(m2, m3), D = _mm_movehl_ps(m3, m2);
+
+	__m128 det = _mm_sub_ps(
+		_mm_mul_ps(_mm_shuffle_ps(m0, m2, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(m1, m3, _MM_SHUFFLE(3, 1, 3, 1))),
+		_mm_mul_ps(_mm_shuffle_ps(m0, m2, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_ps(m1, m3, _MM_SHUFFLE(2, 0, 2, 0))));
+	__m128 detA = LINMATH_SWIZZLE(det, 0, 0, 0, 0), detB = LINMATH_SWIZZLE(det, 1, 1, 1, 1);
+	__m128 detC = LINMATH_SWIZZLE(det, 2, 2, 2, 2), detD = LINMATH_SWIZZLE(det, 3, 3, 3, 3);
+
+	__m128 DC = linmath_mat2_adj_mul(D, C);
+	__m128 AB = linmath_mat2_adj_mul(A, B);
+
+	__m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), linmath_mat2_mul(B, DC));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), linmath_mat2_mul(C, AB));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), linmath_mat2_mul_adj(D, AB));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), linmath_mat2_mul_adj(A, DC));
+
+	/* Assumes it is invertible */
+	__m128 detM = _mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC));
+	__m128 tr = _mm_mul_ps(AB, LINMATH_SWIZZLE(DC, 0, 2, 1, 3));
+	tr = _mm_add_ps(tr, LINMATH_SWIZZLE(tr, 1, 0, 3, 2));
+	tr = _mm_add_ps(tr, LINMATH_SWIZZLE(tr, 2, 3, 0, 1));
+	detM = _mm_sub_ps(detM, tr);
+
+	__m128 idet = _mm_div_ps(_mm_setr_ps(1.f, -1.f, -1.f, 1.f), detM);
+	X = _mm_mul_ps(X, idet);
+	Y = _mm_mul_ps(Y, idet);
+	Z = _mm_mul_ps(Z, idet);
+	W = _mm_mul_ps(W, idet);
+
+	_mm_storeu_ps(T[0], _mm_shuffle_ps(X, Y, _MM_SHUFFLE(1, 3, 1, 3)));
+	_mm_storeu_ps(T[1], _mm_shuffle_ps(X, Y, _MM_SHUFFLE(0, 2, 0, 2)));
+	_mm_storeu_ps(T[2], _mm_shuffle_ps(Z, W, _MM_SHUFFLE(1, 3, 1, 3)));
+	_mm_storeu_ps(T[3], _mm_shuffle_ps(Z, W, _MM_SHUFFLE(0, 2, 0, 2)));
+#else
+	mat4x4_invert_scalar(T, M);
+#endif
+}
 static inline void mat4x4_orthonormalize(mat4x4 R, mat4x4 M)
 {
 	mat4x4_dup(R, M);
@@ -498,7 +634,7 @@ static inline void quat_rotate(quat r, float angle, vec3 axis) {
 	r[3] = cosf(angle / 2);
 }
 #define quat_norm vec4_norm
-static inline void quat_mul_vec3(vec3 r, quat q, vec3 v)
+static inline void quat_mul_vec3_scalar(vec3 r, quat q, vec3 v)
 {
 /*
  * Method by Fabian 'ryg' Giessen (of Farbrausch)
@@ -518,6 +654,32 @@ v' = v + q.w * t + cross(q.xyz, t)
 	vec3_add(r, v, t);
 	vec3_add(r, r, u);
 }
+#if defined(LINMATH_SSE)
+static inline __m128 linmath_cross(__m128 a, __m128 b)
+{
+	__m128 c = _mm_sub_ps(_mm_mul_ps(a, LINMATH_SWIZZLE(b, 1, 2, 0, 3)),
+	                      _mm_mul_ps(LINMATH_SWIZZLE(a, 1, 2, 0, 3), b));
+	return LINMATH_SWIZZLE(c, 1, 2, 0, 3);
+}
+#endif
+static inline void quat_mul_vec3(vec3 r, quat q, vec3 v)
+{
+#if defined(LINMATH_SSE)
+	__m128 qv = _mm_loadu_ps(q);
+	__m128 vv = _mm_setr_ps(v[0], v[1], v[2], 0.f);
+	__m128 t = linmath_cross(qv, vv);
+	t = _mm_add_ps(t, t);
+	__m128 u = linmath_cross(qv, t);
+	__m128 res = _mm_add_ps(_mm_add_ps(vv, u), _mm_mul_ps(LINMATH_SWIZZLE(qv, 3, 3, 3, 3), t));
+	float out[4];
+	_mm_storeu_ps(out, res);
+	r[0] = out[0];
+	r[1] = out[1];
+	r[2] = out[2];
+#else
+	quat_mul_vec3_scalar(r, q, v);
+#endif
+}
 static inline void mat4x4_from_quat(mat4x4 M, quat q)
 {
 	float a = q[3];
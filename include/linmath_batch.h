@@ -0,0 +1,213 @@
+#ifndef linmath_batch_h_INCLUDED
+#define linmath_batch_h_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linmath.h>
+
+// Batch versions of the linmath kernels that work on structure of arrays
+// data, LINMATH_BATCH_LANES elements at a time. The lane width follows the
+// SIMD level linmath.h picked: 8 with AVX, 4 with SSE or NEON, otherwise 1.
+//
+// Every SoA array must be aligned to LINMATH_BATCH_ALIGN bytes. The count
+// doesn't have to be a multiple of the lane width, the remainder is handled
+// one element at a time.
+
+#define LINMATH_BATCH_ALIGN 32
+
+typedef struct {
+    float *x;
+    float *y;
+    float *z;
+} vec3_soa;
+
+#if defined(LINMATH_AVX)
+#define LINMATH_BATCH_LANES 8
+typedef __m256 lanes_t;
+static inline lanes_t lanes_load(const float *p)        { return _mm256_load_ps(p); }
+static inline void    lanes_store(float *p, lanes_t v)  { _mm256_store_ps(p, v); }
+static inline lanes_t lanes_set(float f)                { return _mm256_set1_ps(f); }
+static inline lanes_t lanes_add(lanes_t a, lanes_t b)   { return _mm256_add_ps(a, b); }
+static inline lanes_t lanes_sub(lanes_t a, lanes_t b)   { return _mm256_sub_ps(a, b); }
+static inline lanes_t lanes_mul(lanes_t a, lanes_t b)   { return _mm256_mul_ps(a, b); }
+static inline lanes_t lanes_min(lanes_t a, lanes_t b)   { return _mm256_min_ps(a, b); }
+#elif defined(LINMATH_SSE)
+#define LINMATH_BATCH_LANES 4
+typedef __m128 lanes_t;
+static inline lanes_t lanes_load(const float *p)        { return _mm_load_ps(p); }
+static inline void    lanes_store(float *p, lanes_t v)  { _mm_store_ps(p, v); }
+static inline lanes_t lanes_set(float f)                { return _mm_set1_ps(f); }
+static inline lanes_t lanes_add(lanes_t a, lanes_t b)   { return _mm_add_ps(a, b); }
+static inline lanes_t lanes_sub(lanes_t a, lanes_t b)   { return _mm_sub_ps(a, b); }
+static inline lanes_t lanes_mul(lanes_t a, lanes_t b)   { return _mm_mul_ps(a, b); }
+static inline lanes_t lanes_min(lanes_t a, lanes_t b)   { return _mm_min_ps(a, b); }
+#elif defined(LINMATH_NEON)
+#define LINMATH_BATCH_LANES 4
+typedef float32x4_t lanes_t;
+static inline lanes_t lanes_load(const float *p)        { return vld1q_f32(p); }
+static inline void    lanes_store(float *p, lanes_t v)  { vst1q_f32(p, v); }
+static inline lanes_t lanes_set(float f)                { return vdupq_n_f32(f); }
+static inline lanes_t lanes_add(lanes_t a, lanes_t b)   { return vaddq_f32(a, b); }
+static inline lanes_t lanes_sub(lanes_t a, lanes_t b)   { return vsubq_f32(a, b); }
+static inline lanes_t lanes_mul(lanes_t a, lanes_t b)   { return vmulq_f32(a, b); }
+static inline lanes_t lanes_min(lanes_t a, lanes_t b)   { return vminq_f32(a, b); }
+#else
+#define LINMATH_BATCH_LANES 1
+typedef float lanes_t;
+static inline lanes_t lanes_load(const float *p)        { return *p; }
+static inline void    lanes_store(float *p, lanes_t v)  { *p = v; }
+static inline lanes_t lanes_set(float f)                { return f; }
+static inline lanes_t lanes_add(lanes_t a, lanes_t b)   { return a + b; }
+static inline lanes_t lanes_sub(lanes_t a, lanes_t b)   { return a - b; }
+static inline lanes_t lanes_mul(lanes_t a, lanes_t b)   { return a * b; }
+static inline lanes_t lanes_min(lanes_t a, lanes_t b)   { return a < b ? a : b; }
+#endif
+
+// a * x + b * y + c * z + d with broadcast coefficients
+static inline lanes_t lanes_plane(float a, float b, float c, float d, lanes_t x, lanes_t y, lanes_t z)
+{
+    return lanes_add(lanes_add(lanes_mul(lanes_set(a), x), lanes_mul(lanes_set(b), y)),
+                     lanes_add(lanes_mul(lanes_set(c), z), lanes_set(d)));
+}
+
+static inline lanes_t lanes_plane_abs(float a, float b, float c, lanes_t x, lanes_t y, lanes_t z)
+{
+    return lanes_add(lanes_add(lanes_mul(lanes_set(fabsf(a)), x), lanes_mul(lanes_set(fabsf(b)), y)),
+                     lanes_mul(lanes_set(fabsf(c)), z));
+}
+
+// R[i] = A[i] * B[i]
+static inline void mat4x4_mul_batch(mat4x4 *R, mat4x4 *A, mat4x4 *B, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        mat4x4_mul(R[i], A[i], B[i]);
+}
+
+// out[i] = M * (in[i], 1), without the perspective divide. out may be in.
+static inline void mat4x4_mul_points_soa(vec3_soa out, mat4x4 M, vec3_soa in, size_t count)
+{
+    size_t bulk = count - count % LINMATH_BATCH_LANES;
+    size_t i = 0;
+
+    for (; i < bulk; i += LINMATH_BATCH_LANES) {
+        lanes_t x = lanes_load(in.x + i), y = lanes_load(in.y + i), z = lanes_load(in.z + i);
+
+        lanes_store(out.x + i, lanes_plane(M[0][0], M[1][0], M[2][0], M[3][0], x, y, z));
+        lanes_store(out.y + i, lanes_plane(M[0][1], M[1][1], M[2][1], M[3][1], x, y, z));
+        lanes_store(out.z + i, lanes_plane(M[0][2], M[1][2], M[2][2], M[3][2], x, y, z));
+    }
+
+    for (; i < count; i++) {
+        float x = in.x[i], y = in.y[i], z = in.z[i];
+
+        out.x[i] = M[0][0] * x + M[1][0] * y + M[2][0] * z + M[3][0];
+        out.y[i] = M[0][1] * x + M[1][1] * y + M[2][1] * z + M[3][1];
+        out.z[i] = M[0][2] * x + M[1][2] * y + M[2][2] * z + M[3][2];
+    }
+}
+
+// Bounds of the axis aligned boxes (inMin[i], inMax[i]) after an affine
+// transform, through the box center and the absolute upper 3x3
+static inline void mat4x4_mul_aabbs_soa(vec3_soa outMin, vec3_soa outMax, mat4x4 M,
+                                        vec3_soa inMin, vec3_soa inMax, size_t count)
+{
+    size_t bulk = count - count % LINMATH_BATCH_LANES;
+    size_t i = 0;
+
+    for (; i < bulk; i += LINMATH_BATCH_LANES) {
+        lanes_t half = lanes_set(0.5f);
+        lanes_t minX = lanes_load(inMin.x + i), minY = lanes_load(inMin.y + i), minZ = lanes_load(inMin.z + i);
+        lanes_t maxX = lanes_load(inMax.x + i), maxY = lanes_load(inMax.y + i), maxZ = lanes_load(inMax.z + i);
+
+        lanes_t cx = lanes_mul(lanes_add(minX, maxX), half), ex = lanes_mul(lanes_sub(maxX, minX), half);
+        lanes_t cy = lanes_mul(lanes_add(minY, maxY), half), ey = lanes_mul(lanes_sub(maxY, minY), half);
+        lanes_t cz = lanes_mul(lanes_add(minZ, maxZ), half), ez = lanes_mul(lanes_sub(maxZ, minZ), half);
+
+        lanes_t x  = lanes_plane(M[0][0], M[1][0], M[2][0], M[3][0], cx, cy, cz);
+        lanes_t y  = lanes_plane(M[0][1], M[1][1], M[2][1], M[3][1], cx, cy, cz);
+        lanes_t z  = lanes_plane(M[0][2], M[1][2], M[2][2], M[3][2], cx, cy, cz);
+        lanes_t rx = lanes_plane_abs(M[0][0], M[1][0], M[2][0], ex, ey, ez);
+        lanes_t ry = lanes_plane_abs(M[0][1], M[1][1], M[2][1], ex, ey, ez);
+        lanes_t rz = lanes_plane_abs(M[0][2], M[1][2], M[2][2], ex, ey, ez);
+
+        lanes_store(outMin.x + i, lanes_sub(x, rx));
+        lanes_store(outMin.y + i, lanes_sub(y, ry));
+        lanes_store(outMin.z + i, lanes_sub(z, rz));
+        lanes_store(outMax.x + i, lanes_add(x, rx));
+        lanes_store(outMax.y + i, lanes_add(y, ry));
+        lanes_store(outMax.z + i, lanes_add(z, rz));
+    }
+
+    for (; i < count; i++) {
+        vec3 center = {
+            0.5f * (inMin.x[i] + inMax.x[i]),
+            0.5f * (inMin.y[i] + inMax.y[i]),
+            0.5f * (inMin.z[i] + inMax.z[i])
+        };
+        vec3 extent = {
+            0.5f * (inMax.x[i] - inMin.x[i]),
+            0.5f * (inMax.y[i] - inMin.y[i]),
+            0.5f * (inMax.z[i] - inMin.z[i])
+        };
+        vec3 c, r;
+
+        for (int k = 0; k < 3; k++) {
+            c[k] = M[0][k] * center[0] + M[1][k] * center[1] + M[2][k] * center[2] + M[3][k];
+            r[k] = fabsf(M[0][k]) * extent[0] + fabsf(M[1][k]) * extent[1] + fabsf(M[2][k]) * extent[2];
+        }
+
+        outMin.x[i] = c[0] - r[0];
+        outMin.y[i] = c[1] - r[1];
+        outMin.z[i] = c[2] - r[2];
+        outMax.x[i] = c[0] + r[0];
+        outMax.y[i] = c[1] + r[1];
+        outMax.z[i] = c[2] + r[2];
+    }
+}
+
+// Writes 1 to visible[i] for every sphere that isn't entirely behind one of
+// the planes (xyz pointing inwards, w the distance), 0 otherwise. Returns the
+// number of visible spheres.
+static inline size_t frustum_test_spheres_soa(uint8_t *visible, vec4 planes[6], vec3_soa centers,
+                                              const float *radii, size_t count)
+{
+    size_t visibleCount = 0;
+    size_t bulk = count - count % LINMATH_BATCH_LANES;
+    size_t i = 0;
+
+    for (; i < bulk; i += LINMATH_BATCH_LANES) {
+        lanes_t x = lanes_load(centers.x + i), y = lanes_load(centers.y + i), z = lanes_load(centers.z + i);
+        lanes_t r = lanes_load(radii + i);
+
+        // The smallest signed distance plus radius, negative means culled
+        lanes_t nearest = lanes_add(lanes_plane(planes[0][0], planes[0][1], planes[0][2], planes[0][3], x, y, z), r);
+        for (int p = 1; p < 6; p++)
+            nearest = lanes_min(nearest, lanes_add(lanes_plane(planes[p][0], planes[p][1], planes[p][2],
+                                                               planes[p][3], x, y, z), r));
+
+        _Alignas(LINMATH_BATCH_ALIGN) float distances[LINMATH_BATCH_LANES];
+        lanes_store(distances, nearest);
+
+        for (int k = 0; k < LINMATH_BATCH_LANES; k++) {
+            visible[i + k] = distances[k] >= 0.0f;
+            visibleCount  += visible[i + k];
+        }
+    }
+
+    for (; i < count; i++) {
+        visible[i] = 1;
+        for (int p = 0; p < 6; p++) {
+            if (planes[p][0] * centers.x[i] + planes[p][1] * centers.y[i] + planes[p][2] * centers.z[i]
+                + planes[p][3] + radii[i] < 0.0f) {
+                visible[i] = 0;
+                break;
+            }
+        }
+        visibleCount += visible[i];
+    }
+
+    return visibleCount;
+}
+
+#endif // linmath_batch_h_INCLUDED
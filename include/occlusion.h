@@ -0,0 +1,407 @@
+#ifndef occlusion_h_INCLUDED
+#define occlusion_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Coarse software depth buffer for occlusion culling. Occluder triangles are
+// transformed and binned into screen tiles, the tiles are rasterized
+// independently so they can be spread across threads, and bounding boxes are
+// then tested against the result. Depth follows Vulkan's [0, 1] clip space
+// range with smaller values being closer, matrices are column major like
+// linmath's.
+
+#define OCC_TILE_WIDTH  64
+#define OCC_TILE_HEIGHT 32
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesX;
+    uint32_t tilesY;
+
+    // Nearest occluder depth of every pixel
+    float *depth;
+
+    // Screen space triangles of the frame's occluders, x, y and z for each
+    // corner, wound counter-clockwise
+    float  *tris;
+    size_t  triCount;
+    size_t  triCapacity;
+
+    // Indices of the triangles overlapping each tile
+    uint32_t **bins;
+    size_t    *binCounts;
+    size_t    *binCapacities;
+} OccBuffer;
+
+#ifdef OCCLUSION_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The width and height are rounded up to whole tiles
+void occInit(OccBuffer *buffer, uint32_t width, uint32_t height)
+{
+    buffer->tilesX = (width + OCC_TILE_WIDTH - 1) / OCC_TILE_WIDTH;
+    buffer->tilesY = (height + OCC_TILE_HEIGHT - 1) / OCC_TILE_HEIGHT;
+    buffer->width  = buffer->tilesX * OCC_TILE_WIDTH;
+    buffer->height = buffer->tilesY * OCC_TILE_HEIGHT;
+
+    buffer->depth = malloc((size_t) buffer->width * buffer->height * sizeof(float));
+
+    buffer->tris        = NULL;
+    buffer->triCount    = 0;
+    buffer->triCapacity = 0;
+
+    size_t tileCount = buffer->tilesX * buffer->tilesY;
+    buffer->bins          = calloc(tileCount, sizeof(uint32_t *));
+    buffer->binCounts     = calloc(tileCount, sizeof(size_t));
+    buffer->binCapacities = calloc(tileCount, sizeof(size_t));
+}
+
+void occFree(OccBuffer *buffer)
+{
+    for (size_t i = 0; i < buffer->tilesX * buffer->tilesY; i++)
+        free(buffer->bins[i]);
+
+    free(buffer->bins);
+    free(buffer->binCounts);
+    free(buffer->binCapacities);
+    free(buffer->tris);
+    free(buffer->depth);
+}
+
+// Drops the previous frame's occluders
+void occBegin(OccBuffer *buffer)
+{
+    buffer->triCount = 0;
+
+    for (size_t i = 0; i < buffer->tilesX * buffer->tilesY; i++)
+        buffer->binCounts[i] = 0;
+}
+
+static void occTransform(const float m[16], const float *p, float out[4])
+{
+#ifdef __SSE2__
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m + 0), _mm_set1_ps(p[0])),
+                                     _mm_mul_ps(_mm_loadu_ps(m + 4), _mm_set1_ps(p[1]))),
+                          _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m + 8), _mm_set1_ps(p[2])),
+                                     _mm_loadu_ps(m + 12)));
+    _mm_storeu_ps(out, r);
+#else
+    for (int i = 0; i < 4; i++)
+        out[i] = m[i] * p[0] + m[4 + i] * p[1] + m[8 + i] * p[2] + m[12 + i];
+#endif
+}
+
+static void occBinAdd(OccBuffer *buffer, size_t tile, uint32_t tri)
+{
+    if (buffer->binCounts[tile] == buffer->binCapacities[tile]) {
+        buffer->binCapacities[tile] = buffer->binCapacities[tile] ? 2 * buffer->binCapacities[tile] : 64;
+        buffer->bins[tile] = realloc(buffer->bins[tile], buffer->binCapacities[tile] * sizeof(uint32_t));
+    }
+
+    buffer->bins[tile][buffer->binCounts[tile]++] = tri;
+}
+
+// Transforms an occluder mesh and bins its triangles. Triangles touching the
+// near plane are dropped, which only ever makes the buffer less occluding.
+void occAddOccluder(OccBuffer *buffer, const float mvp[16], const float *positions, size_t vertexCount,
+                    const uint32_t *indices, size_t indexCount)
+{
+    float (*screen)[4] = malloc(vertexCount * sizeof(float[4]));
+
+    for (size_t i = 0; i < vertexCount; i++) {
+        float clip[4];
+        occTransform(mvp, positions + 3 * i, clip);
+
+        // w is left negative to mark vertices in front of the near plane
+        if (clip[2] < 0.0f || clip[3] <= 0.0f) {
+            screen[i][3] = -1.0f;
+            continue;
+        }
+
+        float invW = 1.0f / clip[3];
+        screen[i][0] = (clip[0] * invW * 0.5f + 0.5f) * buffer->width;
+        screen[i][1] = (clip[1] * invW * 0.5f + 0.5f) * buffer->height;
+        screen[i][2] = clip[2] * invW;
+        screen[i][3] = 1.0f;
+    }
+
+    for (size_t i = 0; i + 2 < indexCount; i += 3) {
+        const float *v0 = screen[indices[i]], *v1 = screen[indices[i + 1]], *v2 = screen[indices[i + 2]];
+
+        if (v0[3] < 0.0f || v1[3] < 0.0f || v2[3] < 0.0f)
+            continue;
+
+        float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v1[1] - v0[1]) * (v2[0] - v0[0]);
+        if (area == 0.0f)
+            continue;
+
+        // Both windings are rasterized, simplified occluders aren't always closed
+        if (area < 0.0f) {
+            const float *t = v1;
+            v1 = v2;
+            v2 = t;
+        }
+
+        float minX = fminf(v0[0], fminf(v1[0], v2[0])), maxX = fmaxf(v0[0], fmaxf(v1[0], v2[0]));
+        float minY = fminf(v0[1], fminf(v1[1], v2[1])), maxY = fmaxf(v0[1], fmaxf(v1[1], v2[1]));
+
+        if (maxX < 0.0f || maxY < 0.0f || minX >= buffer->width || minY >= buffer->height)
+            continue;
+
+        if (buffer->triCount == buffer->triCapacity) {
+            buffer->triCapacity = buffer->triCapacity ? 2 * buffer->triCapacity : 1024;
+            buffer->tris = realloc(buffer->tris, buffer->triCapacity * 9 * sizeof(float));
+        }
+
+        float *tri = buffer->tris + 9 * buffer->triCount;
+        memcpy(tri + 0, v0, 3 * sizeof(float));
+        memcpy(tri + 3, v1, 3 * sizeof(float));
+        memcpy(tri + 6, v2, 3 * sizeof(float));
+
+        int tx0 = fmaxf(minX, 0.0f) / OCC_TILE_WIDTH, tx1 = fminf(maxX, buffer->width - 1) / OCC_TILE_WIDTH;
+        int ty0 = fmaxf(minY, 0.0f) / OCC_TILE_HEIGHT, ty1 = fminf(maxY, buffer->height - 1) / OCC_TILE_HEIGHT;
+
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++)
+                occBinAdd(buffer, ty * buffer->tilesX + tx, buffer->triCount);
+
+        buffer->triCount++;
+    }
+
+    free(screen);
+}
+
+// Clears a tile and rasterizes its binned triangles, tiles don't share any
+// state so they can be rasterized from different threads
+void occRasterizeTile(OccBuffer *buffer, size_t tile)
+{
+    int tileX = (tile % buffer->tilesX) * OCC_TILE_WIDTH;
+    int tileY = (tile / buffer->tilesX) * OCC_TILE_HEIGHT;
+
+    for (int y = tileY; y < tileY + OCC_TILE_HEIGHT; y++)
+        for (int x = tileX; x < tileX + OCC_TILE_WIDTH; x++)
+            buffer->depth[y * buffer->width + x] = 1.0f;
+
+    for (size_t i = 0; i < buffer->binCounts[tile]; i++) {
+        const float *t = buffer->tris + 9 * buffer->bins[tile][i];
+
+        // Edge functions and the depth plane, evaluated at pixel centers
+        float a0 = t[1] - t[4], b0 = t[3] - t[0], c0 = t[0] * t[4] - t[1] * t[3];
+        float a1 = t[4] - t[7], b1 = t[6] - t[3], c1 = t[3] * t[7] - t[4] * t[6];
+        float a2 = t[7] - t[1], b2 = t[0] - t[6], c2 = t[6] * t[1] - t[7] * t[0];
+
+        float area = c0 + c1 + c2;
+        float dzdx = (a1 * t[2] + a2 * t[5] + a0 * t[8]) / area;
+        float dzdy = (b1 * t[2] + b2 * t[5] + b0 * t[8]) / area;
+        float z0   = (c1 * t[2] + c2 * t[5] + c0 * t[8]) / area;
+
+        int x0 = fmaxf(fminf(t[0], fminf(t[3], t[6])), tileX);
+        int x1 = fminf(ceilf(fmaxf(t[0], fmaxf(t[3], t[6]))), tileX + OCC_TILE_WIDTH);
+        int y0 = fmaxf(fminf(t[1], fminf(t[4], t[7])), tileY);
+        int y1 = fminf(ceilf(fmaxf(t[1], fmaxf(t[4], t[7]))), tileY + OCC_TILE_HEIGHT);
+
+        // Rows are processed four aligned pixels at a time
+        x0 &= ~3;
+
+        for (int y = y0; y < y1; y++) {
+            float py = y + 0.5f;
+            float *row = buffer->depth + y * buffer->width;
+
+#ifdef __SSE2__
+            __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            __m128 zero = _mm_setzero_ps();
+
+            for (int x = x0; x < x1; x += 4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps(x), offsets);
+
+                __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a0), px), _mm_set1_ps(b0 * py + c0));
+                __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a1), px), _mm_set1_ps(b1 * py + c1));
+                __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a2), px), _mm_set1_ps(b2 * py + c2));
+
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+                                           _mm_cmpge_ps(e2, zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), px), _mm_set1_ps(dzdy * py + z0));
+                __m128 old = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_min_ps(old, z);
+
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+            }
+#else
+            for (int x = x0; x < x1; x++) {
+                float px = x + 0.5f;
+
+                if (a0 * px + b0 * py + c0 < 0.0f || a1 * px + b1 * py + c1 < 0.0f
+                  || a2 * px + b2 * py + c2 < 0.0f)
+                    continue;
+
+                float z = dzdx * px + dzdy * py + z0;
+                if (z < row[x])
+                    row[x] = z;
+            }
+#endif
+        }
+    }
+}
+
+// Returns false when the box is outside the view or behind the occluders.
+// Boxes crossing the near plane always count as visible.
+bool occTestBox(const OccBuffer *buffer, const float mvp[16], const float boxMin[3], const float boxMax[3])
+{
+    float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY, minZ = INFINITY;
+    int behind = 0;
+
+    for (int i = 0; i < 8; i++) {
+        float corner[3] = {
+            i & 1 ? boxMax[0] : boxMin[0],
+            i & 2 ? boxMax[1] : boxMin[1],
+            i & 4 ? boxMax[2] : boxMin[2]
+        };
+
+        float clip[4];
+        occTransform(mvp, corner, clip);
+
+        if (clip[2] < 0.0f || clip[3] <= 0.0f) {
+            behind++;
+            continue;
+        }
+
+        float invW = 1.0f / clip[3];
+        float x = (clip[0] * invW * 0.5f + 0.5f) * buffer->width;
+        float y = (clip[1] * invW * 0.5f + 0.5f) * buffer->height;
+
+        minX = fminf(minX, x);
+        maxX = fmaxf(maxX, x);
+        minY = fminf(minY, y);
+        maxY = fmaxf(maxY, y);
+        minZ = fminf(minZ, clip[2] * invW);
+    }
+
+    if (behind == 8)
+        return false;
+    if (behind > 0)
+        return true;
+
+    if (maxX < 0.0f || maxY < 0.0f || minX >= buffer->width || minY >= buffer->height || minZ > 1.0f)
+        return false;
+
+    int x0 = fmaxf(minX, 0.0f), x1 = fminf(ceilf(maxX), buffer->width);
+    int y0 = fmaxf(minY, 0.0f), y1 = fminf(ceilf(maxY), buffer->height);
+
+    for (int y = y0; y < y1; y++) {
+        const float *row = buffer->depth + y * buffer->width;
+        int x = x0;
+
+#ifdef __SSE2__
+        __m128 z = _mm_set1_ps(minZ);
+        for (; x + 4 <= x1; x += 4)
+            if (_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row + x), z)))
+                return true;
+#endif
+
+        for (; x < x1; x++)
+            if (row[x] >= minZ)
+                return true;
+    }
+
+    return false;
+}
+
+typedef struct {
+    float    area;
+    uint32_t tri;
+} OccTriangle;
+
+static int occCompareTriangles(const void *a, const void *b)
+{
+    const OccTriangle *ta = a, *tb = b;
+    if (ta->area != tb->area)
+        return ta->area > tb->area ? -1 : 1;
+    return ta->tri < tb->tri ? -1 : ta->tri > tb->tri;
+}
+
+// Builds a coarse occluder out of the maxTriangles largest triangles of the
+// mesh. Only original triangles are kept, so the occluder never covers more
+// of the screen than the mesh does or sits in front of it, merging vertices
+// would grow silhouettes and fill concavities. Positions are read with the
+// given stride in bytes, the output is tightly packed xyz.
+void occSimplify(const void *positions, size_t stride, size_t vertexCount, const uint32_t *indices,
+                 size_t indexCount, size_t maxTriangles, float **outPositions, size_t *outVertexCount,
+                 uint32_t **outIndices, size_t *outIndexCount)
+{
+    size_t triCount = indexCount / 3;
+    OccTriangle *tris = malloc((triCount ? triCount : 1) * sizeof(OccTriangle));
+
+    for (size_t i = 0; i < triCount; i++) {
+        const float *p0 = (const float *) ((const char *) positions + indices[3 * i] * stride);
+        const float *p1 = (const float *) ((const char *) positions + indices[3 * i + 1] * stride);
+        const float *p2 = (const float *) ((const char *) positions + indices[3 * i + 2] * stride);
+
+        float e0[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+        float e1[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+        float n[3] = {
+            e0[1] * e1[2] - e0[2] * e1[1],
+            e0[2] * e1[0] - e0[0] * e1[2],
+            e0[0] * e1[1] - e0[1] * e1[0]
+        };
+
+        tris[i].area = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+        tris[i].tri  = i;
+    }
+
+    qsort(tris, triCount, sizeof(OccTriangle), occCompareTriangles);
+
+    // The kept triangles stay in mesh order, degenerate ones are dropped
+    bool *kept = calloc(triCount ? triCount : 1, sizeof(bool));
+    for (size_t i = 0; i < triCount && i < maxTriangles && tris[i].area > 0.0f; i++)
+        kept[tris[i].tri] = true;
+
+    uint32_t *remap = malloc((vertexCount ? vertexCount : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < vertexCount; i++)
+        remap[i] = UINT32_MAX;
+
+    float *outPos = malloc((vertexCount ? vertexCount : 1) * 3 * sizeof(float));
+    uint32_t *outIdx = malloc((indexCount ? indexCount : 1) * sizeof(uint32_t));
+    size_t outVerts = 0, indexTotal = 0;
+
+    for (size_t i = 0; i < triCount; i++) {
+        if (!kept[i])
+            continue;
+
+        for (size_t j = 3 * i; j < 3 * i + 3; j++) {
+            uint32_t index = indices[j];
+
+            if (remap[index] == UINT32_MAX) {
+                memcpy(outPos + 3 * outVerts, (const char *) positions + index * stride, 3 * sizeof(float));
+                remap[index] = outVerts++;
+            }
+
+            outIdx[indexTotal++] = remap[index];
+        }
+    }
+
+    free(remap);
+    free(kept);
+    free(tris);
+
+    *outPositions   = realloc(outPos, (outVerts ? outVerts : 1) * 3 * sizeof(float));
+    *outVertexCount = outVerts;
+    *outIndices     = realloc(outIdx, (indexTotal ? indexTotal : 1) * sizeof(uint32_t));
+    *outIndexCount  = indexTotal;
+}
+
+#endif // OCCLUSION_IMPLEMENTATION
+
+#endif // occlusion_h_INCLUDED
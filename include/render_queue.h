@@ -0,0 +1,174 @@
+#ifndef render_queue_h_INCLUDED
+#define render_queue_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <thread_pool.h>
+
+// A list of draws, each a 64 bit sort key and a caller defined value, that
+// is ordered by key with an LSD radix sort. Queues large enough to be worth
+// it are histogrammed and scattered on a thread pool.
+
+typedef struct {
+    uint64_t *keys;
+    uint32_t *values;
+    size_t    count;
+    size_t    capacity;
+
+    // Ping-pong buffers for the sort
+    uint64_t *scratchKeys;
+    uint32_t *scratchValues;
+} RenderQueue;
+
+#ifdef RENDER_QUEUE_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RENDER_QUEUE_RADIX_BITS   8
+#define RENDER_QUEUE_RADIX_SIZE   (1 << RENDER_QUEUE_RADIX_BITS)
+#define RENDER_QUEUE_MAX_CHUNKS   32
+#define RENDER_QUEUE_PARALLEL_MIN 16384
+
+typedef struct {
+    const uint64_t *srcKeys;
+    const uint32_t *srcValues;
+    uint64_t       *dstKeys;
+    uint32_t       *dstValues;
+
+    size_t   count;
+    size_t   chunkSize;
+    uint32_t shift;
+
+    // One histogram per chunk, turned into scatter offsets in place
+    size_t histograms[RENDER_QUEUE_MAX_CHUNKS][RENDER_QUEUE_RADIX_SIZE];
+} RenderQueueSortPass;
+
+static void renderQueueHistogram(void *data, size_t chunk)
+{
+    RenderQueueSortPass *pass = data;
+    size_t begin = chunk * pass->chunkSize;
+    size_t end   = begin + pass->chunkSize < pass->count ? begin + pass->chunkSize : pass->count;
+    size_t *histogram = pass->histograms[chunk];
+
+    memset(histogram, 0, RENDER_QUEUE_RADIX_SIZE * sizeof(size_t));
+    for (size_t i = begin; i < end; i++)
+        histogram[(pass->srcKeys[i] >> pass->shift) & (RENDER_QUEUE_RADIX_SIZE - 1)]++;
+}
+
+static void renderQueueScatter(void *data, size_t chunk)
+{
+    RenderQueueSortPass *pass = data;
+    size_t begin = chunk * pass->chunkSize;
+    size_t end   = begin + pass->chunkSize < pass->count ? begin + pass->chunkSize : pass->count;
+    size_t *offsets = pass->histograms[chunk];
+
+    for (size_t i = begin; i < end; i++) {
+        size_t dst = offsets[(pass->srcKeys[i] >> pass->shift) & (RENDER_QUEUE_RADIX_SIZE - 1)]++;
+        pass->dstKeys[dst]   = pass->srcKeys[i];
+        pass->dstValues[dst] = pass->srcValues[i];
+    }
+}
+
+void renderQueueInit(RenderQueue *queue)
+{
+    memset(queue, 0, sizeof(RenderQueue));
+}
+
+void renderQueueClear(RenderQueue *queue)
+{
+    queue->count = 0;
+}
+
+void renderQueuePush(RenderQueue *queue, uint64_t key, uint32_t value)
+{
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? 2 * queue->capacity : 256;
+
+        queue->keys          = realloc(queue->keys, queue->capacity * sizeof(uint64_t));
+        queue->values        = realloc(queue->values, queue->capacity * sizeof(uint32_t));
+        queue->scratchKeys   = realloc(queue->scratchKeys, queue->capacity * sizeof(uint64_t));
+        queue->scratchValues = realloc(queue->scratchValues, queue->capacity * sizeof(uint32_t));
+    }
+
+    queue->keys[queue->count]   = key;
+    queue->values[queue->count] = value;
+    queue->count++;
+}
+
+// Stable sort by key. Digits that every key shares are skipped, so unused
+// key fields cost nothing. The pool may be NULL.
+void renderQueueSort(RenderQueue *queue, ThreadPool *pool)
+{
+    if (queue->count < 2)
+        return;
+
+    RenderQueueSortPass *pass = malloc(sizeof(RenderQueueSortPass));
+    pass->count = queue->count;
+
+    size_t chunkCount = 1;
+    if (pool && pool->threadCount > 0 && queue->count >= RENDER_QUEUE_PARALLEL_MIN)
+        chunkCount = pool->threadCount + 1 < RENDER_QUEUE_MAX_CHUNKS ? pool->threadCount + 1
+                                                                     : RENDER_QUEUE_MAX_CHUNKS;
+    pass->chunkSize = (queue->count + chunkCount - 1) / chunkCount;
+
+    for (uint32_t shift = 0; shift < 64; shift += RENDER_QUEUE_RADIX_BITS) {
+        pass->srcKeys   = queue->keys;
+        pass->srcValues = queue->values;
+        pass->dstKeys   = queue->scratchKeys;
+        pass->dstValues = queue->scratchValues;
+        pass->shift     = shift;
+
+        if (chunkCount > 1)
+            threadPoolFor(pool, chunkCount, renderQueueHistogram, pass);
+        else
+            renderQueueHistogram(pass, 0);
+
+        // Exclusive prefix sum over digits, then over chunks within a digit
+        size_t total = 0;
+        bool skip = false;
+
+        for (size_t digit = 0; digit < RENDER_QUEUE_RADIX_SIZE && !skip; digit++) {
+            size_t digitTotal = 0;
+            for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+                size_t count = pass->histograms[chunk][digit];
+                pass->histograms[chunk][digit] = total + digitTotal;
+                digitTotal += count;
+            }
+
+            skip = digitTotal == queue->count;
+            total += digitTotal;
+        }
+
+        if (skip)
+            continue;
+
+        if (chunkCount > 1)
+            threadPoolFor(pool, chunkCount, renderQueueScatter, pass);
+        else
+            renderQueueScatter(pass, 0);
+
+        uint64_t *keys   = queue->keys;
+        uint32_t *values = queue->values;
+        queue->keys          = queue->scratchKeys;
+        queue->values        = queue->scratchValues;
+        queue->scratchKeys   = keys;
+        queue->scratchValues = values;
+    }
+
+    free(pass);
+}
+
+void renderQueueFree(RenderQueue *queue)
+{
+    free(queue->keys);
+    free(queue->values);
+    free(queue->scratchKeys);
+    free(queue->scratchValues);
+}
+
+#endif // RENDER_QUEUE_IMPLEMENTATION
+
+#endif // render_queue_h_INCLUDED
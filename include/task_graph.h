@@ -0,0 +1,218 @@
+#ifndef task_graph_h_INCLUDED
+#define task_graph_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <thread_pool.h>
+
+// Up to 64 tasks that each run once every task they depend on has finished,
+// on the thread pool workers and the thread calling taskGraphRun(). A task
+// may only depend on tasks before it in the array, which keeps the graph
+// free of cycles. Tasks marked mainThread only run on the calling thread,
+// for APIs that care which thread they're called from. A task with several
+// instances is run that many times at once, for work it splits between the
+// calls itself, and finishes when all of them have.
+
+#define TASK_GRAPH_MAX_TASKS 64
+#define TASK_BIT(task)       (UINT64_C(1) << (task))
+
+typedef void (*TaskGraphRun)(void);
+
+typedef struct {
+    const char  *name;
+    TaskGraphRun run;
+    uint64_t     deps; // TASK_BIT() of every task that has to finish first
+    bool         mainThread;
+    uint32_t     instances; // 0 runs the task once
+
+    // Filled in by taskGraphRun(), in seconds since it started
+    double start;
+    double end;
+} TaskGraphTask;
+
+#ifdef TASK_GRAPH_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+    TaskGraphTask *tasks;
+    size_t         count;
+    uint64_t       all;
+    uint64_t       mainTasks;
+
+    // The calling thread leaves the other tasks to the workers while it
+    // still has its own to run, unless there are no workers
+    bool workers;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  changed;
+    uint64_t        started;
+    uint64_t        finished;
+    struct timespec begin;
+
+    // Instances of each task started and finished so far
+    uint32_t startedInstances[TASK_GRAPH_MAX_TASKS];
+    uint32_t finishedInstances[TASK_GRAPH_MAX_TASKS];
+} TaskGraphState;
+
+static uint32_t taskGraphInstances(const TaskGraphTask *task)
+{
+    return task->instances > 0 ? task->instances : 1;
+}
+
+static double taskGraphTime(TaskGraphState *graph)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - graph->begin.tv_sec) + (now.tv_nsec - graph->begin.tv_nsec) * 1e-9;
+}
+
+// Called with the mutex held, waits until a task is ready. Returns false once
+// no task is left for this thread to start.
+static bool taskGraphNext(TaskGraphState *graph, bool mainThread, size_t *task)
+{
+    for (;;) {
+        uint64_t left = graph->all & ~graph->started;
+        if (!mainThread)
+            left &= ~graph->mainTasks;
+        else if (graph->workers && (left & graph->mainTasks))
+            left &= graph->mainTasks;
+
+        if (left == 0)
+            return false;
+
+        for (size_t i = 0; i < graph->count; i++) {
+            if ((left & TASK_BIT(i)) && (graph->tasks[i].deps & ~graph->finished) == 0) {
+                if (graph->startedInstances[i]++ == 0)
+                    graph->tasks[i].start = taskGraphTime(graph);
+                if (graph->startedInstances[i] == taskGraphInstances(&graph->tasks[i]))
+                    graph->started |= TASK_BIT(i);
+
+                *task = i;
+                return true;
+            }
+        }
+
+        pthread_cond_wait(&graph->changed, &graph->mutex);
+    }
+}
+
+static void taskGraphWork(TaskGraphState *graph, bool mainThread)
+{
+    size_t i;
+
+    pthread_mutex_lock(&graph->mutex);
+
+    while (taskGraphNext(graph, mainThread, &i)) {
+        pthread_mutex_unlock(&graph->mutex);
+
+        graph->tasks[i].run();
+
+        pthread_mutex_lock(&graph->mutex);
+
+        if (++graph->finishedInstances[i] == taskGraphInstances(&graph->tasks[i])) {
+            graph->tasks[i].end = taskGraphTime(graph);
+            graph->finished |= TASK_BIT(i);
+            pthread_cond_broadcast(&graph->changed);
+        }
+    }
+
+    pthread_mutex_unlock(&graph->mutex);
+}
+
+static void taskGraphWorker(void *data, size_t index)
+{
+    (void) index;
+
+    taskGraphWork(data, false);
+}
+
+// Runs every task and returns once all of them have finished. The pool must
+// be idle and stays busy until then.
+void taskGraphRun(TaskGraphTask *tasks, size_t count, ThreadPool *pool)
+{
+    if (count > TASK_GRAPH_MAX_TASKS) {
+        fprintf(stderr, "Task graph has %zu tasks, the limit is %d\n", count, TASK_GRAPH_MAX_TASKS);
+        exit(EXIT_FAILURE);
+    }
+
+    TaskGraphState graph = {
+        .tasks     = tasks,
+        .count     = count,
+        .all       = count == TASK_GRAPH_MAX_TASKS ? ~UINT64_C(0) : TASK_BIT(count) - 1,
+        .mainTasks = 0,
+        .workers   = pool->threadCount > 0,
+        .started   = 0,
+        .finished  = 0,
+        .startedInstances  = {0},
+        .finishedInstances = {0}
+    };
+
+    for (size_t i = 0; i < count; i++) {
+        if (tasks[i].deps & ~(TASK_BIT(i) - 1)) {
+            fprintf(stderr, "Task %s depends on a later task\n", tasks[i].name);
+            exit(EXIT_FAILURE);
+        }
+
+        if (tasks[i].mainThread)
+            graph.mainTasks |= TASK_BIT(i);
+    }
+
+    pthread_mutex_init(&graph.mutex, NULL);
+    pthread_cond_init(&graph.changed, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &graph.begin);
+
+    threadPoolForAsync(pool, pool->threadCount, taskGraphWorker, &graph);
+    taskGraphWork(&graph, true);
+
+    // The workers may still be running the last tasks
+    pthread_mutex_lock(&graph.mutex);
+    while (graph.finished != graph.all)
+        pthread_cond_wait(&graph.changed, &graph.mutex);
+    pthread_mutex_unlock(&graph.mutex);
+
+    threadPoolWait(pool);
+
+    pthread_cond_destroy(&graph.changed);
+    pthread_mutex_destroy(&graph.mutex);
+}
+
+// Prints when each task ran, the ones on the critical path to the last task
+// to finish are marked with a *
+void taskGraphPrintTimes(const TaskGraphTask *tasks, size_t count)
+{
+    uint64_t critical = 0;
+    size_t last = 0;
+
+    for (size_t i = 1; i < count; i++)
+        if (tasks[i].end > tasks[last].end)
+            last = i;
+
+    // Walk back through the dependency that finished last
+    for (size_t i = last; count > 0;) {
+        critical |= TASK_BIT(i);
+
+        size_t next = count;
+        for (size_t j = 0; j < i; j++)
+            if ((tasks[i].deps & TASK_BIT(j)) && (next == count || tasks[j].end > tasks[next].end))
+                next = j;
+
+        if (next == count)
+            break;
+        i = next;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        printf("%c %-28s%-12f%f\n", critical & TASK_BIT(i) ? '*' : ' ', tasks[i].name, tasks[i].start,
+               tasks[i].end - tasks[i].start);
+}
+
+#endif // TASK_GRAPH_IMPLEMENTATION
+
+#endif // task_graph_h_INCLUDED
@@ -0,0 +1,180 @@
+#ifndef thread_pool_h_INCLUDED
+#define thread_pool_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A fixed set of worker threads that run parallel for loops. The calling
+// thread works on the loop too and threadPoolFor() returns once every index
+// has been processed. threadPoolForAsync() leaves the loop to the workers
+// until threadPoolWait(), so the caller can do something else meanwhile.
+
+typedef void (*ThreadPoolTask)(void *data, size_t index);
+
+typedef struct {
+    pthread_t *threads;
+    size_t     threadCount;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  wake;
+    pthread_cond_t  done;
+
+    // The current loop, replaced only while no worker is busy
+    ThreadPoolTask task;
+    void          *data;
+    size_t         count;
+    atomic_size_t  next;
+
+    uint64_t generation;
+    size_t   busy;
+    bool     quit;
+} ThreadPool;
+
+#ifdef THREAD_POOL_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static void threadPoolWork(ThreadPool *pool, ThreadPoolTask task, void *data, size_t count)
+{
+    size_t index;
+    while ((index = atomic_fetch_add(&pool->next, 1)) < count)
+        task(data, index);
+}
+
+static void *threadPoolWorker(void *arg)
+{
+    ThreadPool *pool = arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+
+        if (pool->quit)
+            break;
+
+        seen = pool->generation;
+        pool->busy++;
+
+        ThreadPoolTask task = pool->task;
+        void *data = pool->data;
+        size_t count = pool->count;
+
+        pthread_mutex_unlock(&pool->mutex);
+        threadPoolWork(pool, task, data, count);
+        pthread_mutex_lock(&pool->mutex);
+
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// A threadCount of 0 starts one worker for every other online CPU
+void threadPoolInit(ThreadPool *pool, size_t threadCount)
+{
+    if (threadCount == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = cpus > 1 ? cpus - 1 : 0;
+    }
+
+    pool->threads     = malloc(threadCount * sizeof(pthread_t));
+    pool->threadCount = 0;
+    pool->task        = NULL;
+    pool->data        = NULL;
+    pool->count       = 0;
+    pool->generation  = 0;
+    pool->busy        = 0;
+    pool->quit        = false;
+    atomic_init(&pool->next, 0);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (size_t i = 0; i < threadCount; i++)
+        if (pthread_create(&pool->threads[pool->threadCount], NULL, threadPoolWorker, pool) == 0)
+            pool->threadCount++;
+}
+
+// Starts a loop on the workers and returns right away. No other loop may be
+// started before threadPoolWait(). Without workers the loop runs here.
+void threadPoolForAsync(ThreadPool *pool, size_t count, ThreadPoolTask task, void *data)
+{
+    if (pool->threadCount == 0) {
+        for (size_t i = 0; i < count; i++)
+            task(data, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    // A worker that woke up late for the previous loop may still hold it
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+
+    pool->task  = task;
+    pool->data  = data;
+    pool->count = count;
+    atomic_store(&pool->next, 0);
+    pool->generation++;
+
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Works on the loop started by threadPoolForAsync() until every index has
+// been processed
+void threadPoolWait(ThreadPool *pool)
+{
+    if (pool->threadCount == 0)
+        return;
+
+    threadPoolWork(pool, pool->task, pool->data, pool->count);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Calls task(data, i) for every i below count, spread across the workers
+void threadPoolFor(ThreadPool *pool, size_t count, ThreadPoolTask task, void *data)
+{
+    if (pool->threadCount == 0 || count <= 1) {
+        for (size_t i = 0; i < count; i++)
+            task(data, i);
+        return;
+    }
+
+    threadPoolForAsync(pool, count, task, data);
+    threadPoolWait(pool);
+}
+
+void threadPoolFree(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+}
+
+#endif // THREAD_POOL_IMPLEMENTATION
+
+#endif // thread_pool_h_INCLUDED
@@ -0,0 +1,373 @@
+#ifndef transforms_h_INCLUDED
+#define transforms_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Transform hierarchy stored as parallel arrays. A parent always comes
+// before its children, so walking the nodes in index order visits every
+// parent first. Only nodes marked since the last update and their
+// descendants have their world and normal matrices recomputed, four nodes
+// at a time. Matrices are column major like linmath's and rotations are x,
+// y, z, w quaternions.
+
+#define TRANSFORM_NONE UINT32_MAX
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+
+    // Hot data, read by every update
+    float    (*positions)[3];
+    float    (*rotations)[4];
+    float    (*scales)[3];
+    uint32_t  *parents;
+    float    (*worlds)[16];
+
+    // Inverse transpose of each world matrix's upper 3x3, as three columns
+    // padded to four floats
+    float (*normals)[12];
+
+    // Cold data, only used to find the descendants of changed nodes
+    uint32_t *firstChildren;
+    uint32_t *nextSiblings;
+
+    // Nodes marked since the last update, the flags keep a node from being
+    // queued twice
+    bool     *dirty;
+    uint32_t *dirtyList;
+    size_t    dirtyCount;
+
+    // Nodes whose world matrix changed in the last update, in index order
+    uint32_t *changed;
+    size_t    changedCount;
+} TransformStore;
+
+#ifdef TRANSFORMS_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void transformInit(TransformStore *store)
+{
+    memset(store, 0, sizeof(TransformStore));
+}
+
+static void transformMarkDirty(TransformStore *store, uint32_t node)
+{
+    if (!store->dirty[node]) {
+        store->dirty[node] = true;
+        store->dirtyList[store->dirtyCount++] = node;
+    }
+}
+
+// The parent must already be in the store, or be TRANSFORM_NONE for a root
+uint32_t transformAdd(TransformStore *store, uint32_t parent, const float position[3],
+                      const float rotation[4], const float scale[3])
+{
+    if (store->count == store->capacity) {
+        store->capacity = store->capacity ? 2 * store->capacity : 64;
+
+        store->positions     = realloc(store->positions, store->capacity * sizeof(*store->positions));
+        store->rotations     = realloc(store->rotations, store->capacity * sizeof(*store->rotations));
+        store->scales        = realloc(store->scales, store->capacity * sizeof(*store->scales));
+        store->parents       = realloc(store->parents, store->capacity * sizeof(uint32_t));
+        store->worlds        = realloc(store->worlds, store->capacity * sizeof(*store->worlds));
+        store->normals       = realloc(store->normals, store->capacity * sizeof(*store->normals));
+        store->firstChildren = realloc(store->firstChildren, store->capacity * sizeof(uint32_t));
+        store->nextSiblings  = realloc(store->nextSiblings, store->capacity * sizeof(uint32_t));
+        store->dirty         = realloc(store->dirty, store->capacity * sizeof(bool));
+        store->dirtyList     = realloc(store->dirtyList, store->capacity * sizeof(uint32_t));
+        store->changed       = realloc(store->changed, store->capacity * sizeof(uint32_t));
+    }
+
+    uint32_t node = store->count++;
+
+    memcpy(store->positions[node], position, 3 * sizeof(float));
+    memcpy(store->rotations[node], rotation, 4 * sizeof(float));
+    memcpy(store->scales[node], scale, 3 * sizeof(float));
+
+    store->parents[node]       = parent;
+    store->firstChildren[node] = TRANSFORM_NONE;
+    store->nextSiblings[node]  = TRANSFORM_NONE;
+    store->dirty[node]         = false;
+
+    if (parent != TRANSFORM_NONE) {
+        store->nextSiblings[node]    = store->firstChildren[parent];
+        store->firstChildren[parent] = node;
+    }
+
+    transformMarkDirty(store, node);
+    return node;
+}
+
+// NULL leaves that part of the local transform as it is
+void transformSet(TransformStore *store, uint32_t node, const float position[3],
+                  const float rotation[4], const float scale[3])
+{
+    if (position)
+        memcpy(store->positions[node], position, 3 * sizeof(float));
+    if (rotation)
+        memcpy(store->rotations[node], rotation, 4 * sizeof(float));
+    if (scale)
+        memcpy(store->scales[node], scale, 3 * sizeof(float));
+
+    transformMarkDirty(store, node);
+}
+
+static int transformCompareNodes(const void *a, const void *b)
+{
+    uint32_t na = *(const uint32_t *) a, nb = *(const uint32_t *) b;
+    return (na > nb) - (na < nb);
+}
+
+// Scale * rotation * translation of up to four nodes, written like
+// mat4x4_from_quat() followed by the scale and translation
+static void transformLocalMatrices(const TransformStore *store, const uint32_t *nodes, size_t count,
+                                   float locals[4][16])
+{
+#ifdef __SSE2__
+    float lanes[10][4];
+    for (size_t k = 0; k < 4; k++) {
+        uint32_t node = nodes[k < count ? k : 0];
+        for (int i = 0; i < 4; i++)
+            lanes[i][k] = store->rotations[node][i];
+        for (int i = 0; i < 3; i++) {
+            lanes[4 + i][k] = store->scales[node][i];
+            lanes[7 + i][k] = store->positions[node][i];
+        }
+    }
+
+    __m128 b = _mm_loadu_ps(lanes[0]), c = _mm_loadu_ps(lanes[1]);
+    __m128 d = _mm_loadu_ps(lanes[2]), a = _mm_loadu_ps(lanes[3]);
+    __m128 a2 = _mm_mul_ps(a, a), b2 = _mm_mul_ps(b, b), c2 = _mm_mul_ps(c, c), d2 = _mm_mul_ps(d, d);
+    __m128 two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+
+    __m128 bc = _mm_mul_ps(b, c), ad = _mm_mul_ps(a, d), bd = _mm_mul_ps(b, d);
+    __m128 ac = _mm_mul_ps(a, c), cd = _mm_mul_ps(c, d), ab = _mm_mul_ps(a, b);
+
+    __m128 sx = _mm_loadu_ps(lanes[4]), sy = _mm_loadu_ps(lanes[5]), sz = _mm_loadu_ps(lanes[6]);
+
+    // One register per matrix element, one lane per node
+    __m128 m00 = _mm_mul_ps(sx, _mm_sub_ps(_mm_add_ps(a2, b2), _mm_add_ps(c2, d2)));
+    __m128 m01 = _mm_mul_ps(sx, _mm_mul_ps(two, _mm_add_ps(bc, ad)));
+    __m128 m02 = _mm_mul_ps(sx, _mm_mul_ps(two, _mm_sub_ps(bd, ac)));
+
+    __m128 m10 = _mm_mul_ps(sy, _mm_mul_ps(two, _mm_sub_ps(bc, ad)));
+    __m128 m11 = _mm_mul_ps(sy, _mm_sub_ps(_mm_add_ps(a2, c2), _mm_add_ps(b2, d2)));
+    __m128 m12 = _mm_mul_ps(sy, _mm_mul_ps(two, _mm_add_ps(cd, ab)));
+
+    __m128 m20 = _mm_mul_ps(sz, _mm_mul_ps(two, _mm_add_ps(bd, ac)));
+    __m128 m21 = _mm_mul_ps(sz, _mm_mul_ps(two, _mm_sub_ps(cd, ab)));
+    __m128 m22 = _mm_mul_ps(sz, _mm_sub_ps(_mm_add_ps(a2, d2), _mm_add_ps(b2, c2)));
+
+    __m128 m30 = _mm_loadu_ps(lanes[7]), m31 = _mm_loadu_ps(lanes[8]), m32 = _mm_loadu_ps(lanes[9]);
+    __m128 m33 = _mm_set1_ps(1.0f);
+
+    // Transposing each column's four elements gives that column of every node
+    __m128 col0w = zero, col1w = zero, col2w = zero;
+    _MM_TRANSPOSE4_PS(m00, m01, m02, col0w);
+    _MM_TRANSPOSE4_PS(m10, m11, m12, col1w);
+    _MM_TRANSPOSE4_PS(m20, m21, m22, col2w);
+    _MM_TRANSPOSE4_PS(m30, m31, m32, m33);
+
+    __m128 columns[4][4] = {
+        {m00, m01, m02, col0w},
+        {m10, m11, m12, col1w},
+        {m20, m21, m22, col2w},
+        {m30, m31, m32, m33}
+    };
+
+    for (size_t k = 0; k < count; k++)
+        for (int col = 0; col < 4; col++)
+            _mm_storeu_ps(&locals[k][4 * col], columns[col][k]);
+#else
+    for (size_t k = 0; k < count; k++) {
+        uint32_t node = nodes[k];
+        const float *q = store->rotations[node], *s = store->scales[node], *p = store->positions[node];
+        float a = q[3], b = q[0], c = q[1], d = q[2];
+        float a2 = a * a, b2 = b * b, c2 = c * c, d2 = d * d;
+        float *m = locals[k];
+
+        m[0]  = s[0] * (a2 + b2 - c2 - d2);
+        m[1]  = s[0] * 2.0f * (b * c + a * d);
+        m[2]  = s[0] * 2.0f * (b * d - a * c);
+        m[3]  = 0.0f;
+        m[4]  = s[1] * 2.0f * (b * c - a * d);
+        m[5]  = s[1] * (a2 - b2 + c2 - d2);
+        m[6]  = s[1] * 2.0f * (c * d + a * b);
+        m[7]  = 0.0f;
+        m[8]  = s[2] * 2.0f * (b * d + a * c);
+        m[9]  = s[2] * 2.0f * (c * d - a * b);
+        m[10] = s[2] * (a2 - b2 - c2 + d2);
+        m[11] = 0.0f;
+        m[12] = p[0];
+        m[13] = p[1];
+        m[14] = p[2];
+        m[15] = 1.0f;
+    }
+#endif
+}
+
+static void transformMultiply(float out[16], const float parent[16], const float local[16])
+{
+#ifdef __SSE2__
+    __m128 p0 = _mm_loadu_ps(parent), p1 = _mm_loadu_ps(parent + 4);
+    __m128 p2 = _mm_loadu_ps(parent + 8), p3 = _mm_loadu_ps(parent + 12);
+
+    for (int col = 0; col < 4; col++) {
+        const float *l = local + 4 * col;
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p0, _mm_set1_ps(l[0])), _mm_mul_ps(p1, _mm_set1_ps(l[1]))),
+                              _mm_add_ps(_mm_mul_ps(p2, _mm_set1_ps(l[2])), _mm_mul_ps(p3, _mm_set1_ps(l[3]))));
+        _mm_storeu_ps(out + 4 * col, r);
+    }
+#else
+    for (int col = 0; col < 4; col++)
+        for (int row = 0; row < 4; row++)
+            out[4 * col + row] = parent[row] * local[4 * col] + parent[4 + row] * local[4 * col + 1]
+                               + parent[8 + row] * local[4 * col + 2] + parent[12 + row] * local[4 * col + 3];
+#endif
+}
+
+// Columns a, b and c invert transposed to b x c, c x a and a x b over the
+// determinant. A singular matrix keeps the unscaled cross products.
+static void transformNormalMatrices(TransformStore *store, const uint32_t *nodes, size_t count)
+{
+#ifdef __SSE2__
+    float lanes[9][4];
+    for (size_t k = 0; k < 4; k++) {
+        const float *world = store->worlds[nodes[k < count ? k : 0]];
+        for (int col = 0; col < 3; col++)
+            for (int row = 0; row < 3; row++)
+                lanes[3 * col + row][k] = world[4 * col + row];
+    }
+
+    __m128 ax = _mm_loadu_ps(lanes[0]), ay = _mm_loadu_ps(lanes[1]), az = _mm_loadu_ps(lanes[2]);
+    __m128 bx = _mm_loadu_ps(lanes[3]), by = _mm_loadu_ps(lanes[4]), bz = _mm_loadu_ps(lanes[5]);
+    __m128 cx = _mm_loadu_ps(lanes[6]), cy = _mm_loadu_ps(lanes[7]), cz = _mm_loadu_ps(lanes[8]);
+
+    // b x c, c x a and a x b
+    __m128 n00 = _mm_sub_ps(_mm_mul_ps(by, cz), _mm_mul_ps(bz, cy));
+    __m128 n01 = _mm_sub_ps(_mm_mul_ps(bz, cx), _mm_mul_ps(bx, cz));
+    __m128 n02 = _mm_sub_ps(_mm_mul_ps(bx, cy), _mm_mul_ps(by, cx));
+    __m128 n10 = _mm_sub_ps(_mm_mul_ps(cy, az), _mm_mul_ps(cz, ay));
+    __m128 n11 = _mm_sub_ps(_mm_mul_ps(cz, ax), _mm_mul_ps(cx, az));
+    __m128 n12 = _mm_sub_ps(_mm_mul_ps(cx, ay), _mm_mul_ps(cy, ax));
+    __m128 n20 = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+    __m128 n21 = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+    __m128 n22 = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, n00), _mm_mul_ps(ay, n01)), _mm_mul_ps(az, n02));
+    __m128 singular = _mm_cmpeq_ps(det, _mm_setzero_ps());
+    __m128 scale = _mm_or_ps(_mm_and_ps(singular, _mm_set1_ps(1.0f)),
+                             _mm_andnot_ps(singular, _mm_div_ps(_mm_set1_ps(1.0f), det)));
+
+    __m128 columns[3][4] = {
+        {_mm_mul_ps(n00, scale), _mm_mul_ps(n01, scale), _mm_mul_ps(n02, scale), _mm_setzero_ps()},
+        {_mm_mul_ps(n10, scale), _mm_mul_ps(n11, scale), _mm_mul_ps(n12, scale), _mm_setzero_ps()},
+        {_mm_mul_ps(n20, scale), _mm_mul_ps(n21, scale), _mm_mul_ps(n22, scale), _mm_setzero_ps()}
+    };
+
+    for (int col = 0; col < 3; col++) {
+        _MM_TRANSPOSE4_PS(columns[col][0], columns[col][1], columns[col][2], columns[col][3]);
+        for (size_t k = 0; k < count; k++)
+            _mm_storeu_ps(&store->normals[nodes[k]][4 * col], columns[col][k]);
+    }
+#else
+    for (size_t k = 0; k < count; k++) {
+        const float *w = store->worlds[nodes[k]];
+        const float *a = w, *b = w + 4, *c = w + 8;
+        float *n = store->normals[nodes[k]];
+
+        n[0]  = b[1] * c[2] - b[2] * c[1];
+        n[1]  = b[2] * c[0] - b[0] * c[2];
+        n[2]  = b[0] * c[1] - b[1] * c[0];
+        n[4]  = c[1] * a[2] - c[2] * a[1];
+        n[5]  = c[2] * a[0] - c[0] * a[2];
+        n[6]  = c[0] * a[1] - c[1] * a[0];
+        n[8]  = a[1] * b[2] - a[2] * b[1];
+        n[9]  = a[2] * b[0] - a[0] * b[2];
+        n[10] = a[0] * b[1] - a[1] * b[0];
+        n[3]  = n[7] = n[11] = 0.0f;
+
+        float det = a[0] * n[0] + a[1] * n[1] + a[2] * n[2];
+        if (det != 0.0f)
+            for (int i = 0; i < 12; i++)
+                n[i] /= det;
+    }
+#endif
+}
+
+// Recomputes the world and normal matrices of the marked nodes and their
+// descendants and lists them in changed
+void transformUpdate(TransformStore *store)
+{
+    store->changedCount = 0;
+
+    if (store->dirtyCount == 0)
+        return;
+
+    // The changed list doubles as the work list for finding descendants
+    memcpy(store->changed, store->dirtyList, store->dirtyCount * sizeof(uint32_t));
+    store->changedCount = store->dirtyCount;
+
+    for (size_t i = 0; i < store->changedCount; i++) {
+        for (uint32_t child = store->firstChildren[store->changed[i]]; child != TRANSFORM_NONE;
+             child = store->nextSiblings[child]) {
+            if (!store->dirty[child]) {
+                store->dirty[child] = true;
+                store->changed[store->changedCount++] = child;
+            }
+        }
+    }
+
+    qsort(store->changed, store->changedCount, sizeof(uint32_t), transformCompareNodes);
+
+    float locals[4][16];
+
+    for (size_t i = 0; i < store->changedCount; i += 4) {
+        size_t count = store->changedCount - i < 4 ? store->changedCount - i : 4;
+        transformLocalMatrices(store, &store->changed[i], count, locals);
+
+        // In index order, so a parent in the same group is finished first
+        for (size_t k = 0; k < count; k++) {
+            uint32_t node = store->changed[i + k];
+            uint32_t parent = store->parents[node];
+
+            if (parent == TRANSFORM_NONE)
+                memcpy(store->worlds[node], locals[k], 16 * sizeof(float));
+            else
+                transformMultiply(store->worlds[node], store->worlds[parent], locals[k]);
+
+            store->dirty[node] = false;
+        }
+
+        transformNormalMatrices(store, &store->changed[i], count);
+    }
+
+    store->dirtyCount = 0;
+}
+
+void transformFree(TransformStore *store)
+{
+    free(store->positions);
+    free(store->rotations);
+    free(store->scales);
+    free(store->parents);
+    free(store->worlds);
+    free(store->normals);
+    free(store->firstChildren);
+    free(store->nextSiblings);
+    free(store->dirty);
+    free(store->dirtyList);
+    free(store->changed);
+}
+
+#endif // TRANSFORMS_IMPLEMENTATION
+
+#endif // transforms_h_INCLUDED
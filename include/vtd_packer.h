@@ -0,0 +1,251 @@
+#ifndef vtd_packer_h_INCLUDED
+#define vtd_packer_h_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Groups VTD images into 2D texture arrays. Images that share a size and
+// channel count become layers of the same array, small images are instead
+// shelf packed into atlas layers and addressed through a uv transform.
+
+typedef struct {
+    uint32_t array;
+    uint32_t layer;
+    float    uvScale[2];
+    float    uvOffset[2];
+} VtdPackEntry;
+
+typedef struct {
+    uint8_t  channels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t layerCount;
+    bool     atlas;
+
+    uint8_t *pixels;
+} VtdPackArray;
+
+typedef struct {
+    size_t        arrayCount;
+    VtdPackArray *arrays;
+
+    // One entry for each input image, in input order
+    VtdPackEntry *entries;
+} VtdPack;
+
+#ifdef VTD_PACKER_IMPLEMENTATION
+
+typedef struct {
+    size_t   index;
+    uint32_t height;
+    uint32_t x, y;
+} VtdPackItem;
+
+static int vtdPackCompareHeight(const void *a, const void *b)
+{
+    const VtdPackItem *ia = a, *ib = b;
+    if (ia->height != ib->height)
+        return ia->height < ib->height ? 1 : -1;
+    return ia->index < ib->index ? -1 : ia->index > ib->index;
+}
+
+static VtdPackArray *vtdPackAddArray(VtdPack *pack, uint8_t channels, uint32_t width, uint32_t height, bool atlas)
+{
+    pack->arrays = realloc(pack->arrays, (pack->arrayCount + 1) * sizeof(VtdPackArray));
+
+    VtdPackArray *array = &pack->arrays[pack->arrayCount++];
+    array->channels   = channels;
+    array->width      = width;
+    array->height     = height;
+    array->layerCount = 0;
+    array->atlas      = atlas;
+    array->pixels     = NULL;
+
+    return array;
+}
+
+// Copies an image into a layer, surrounding it with padding texels that wrap
+// around like VK_SAMPLER_ADDRESS_MODE_REPEAT so filtering doesn't bleed
+static void vtdPackBlit(VtdPackArray *array, uint32_t layer, uint32_t x, uint32_t y,
+                        const VtdData *image, uint32_t padding)
+{
+    size_t layerSize = (size_t) array->width * array->height * array->channels;
+    uint8_t *dst = array->pixels + layer * layerSize;
+
+    for (int64_t j = -(int64_t) padding; j < (int64_t) (image->height + padding); j++) {
+        uint32_t srcY = (j % image->height + image->height) % image->height;
+
+        for (int64_t i = -(int64_t) padding; i < (int64_t) (image->width + padding); i++) {
+            uint32_t srcX = (i % image->width + image->width) % image->width;
+
+            size_t dstOffset = ((y + j) * array->width + (x + i)) * array->channels;
+            size_t srcOffset = ((size_t) srcY * image->width + srcX) * image->channels;
+            memcpy(dst + dstOffset, image->pixels + srcOffset, array->channels);
+        }
+    }
+}
+
+// Rounds an atlas side up to a power of two, so every mip level halves
+// exactly, without going over atlasDim
+static uint32_t vtdPackAtlasSide(uint32_t used, uint32_t atlasDim)
+{
+    uint32_t side = 1;
+    while (side < used && side < atlasDim)
+        side *= 2;
+
+    return side < atlasDim ? side : atlasDim;
+}
+
+// Images at most atlasMaxDim on each side go into atlas layers of at most
+// atlasDim when at least two of them share a channel count, everything else
+// is grouped into arrays by exact size. An atlas is only as large as the
+// layers need. Fails when atlasDim leaves no room inside the padding.
+bool vtdPack(VtdData *images, size_t imageCount, uint32_t atlasDim, uint32_t atlasMaxDim,
+             uint32_t padding, VtdPack *pack)
+{
+    pack->arrayCount = 0;
+    pack->arrays     = NULL;
+    pack->entries    = NULL;
+
+    if (atlasDim <= 2 * padding) {
+        fprintf(stderr, "Error packing textures: atlas size %u leaves no room inside padding %u\n",
+                atlasDim, padding);
+        return false;
+    }
+
+    pack->entries = malloc(imageCount * sizeof(VtdPackEntry));
+
+    bool *placed = calloc(imageCount, sizeof(bool));
+    VtdPackItem *items = malloc(imageCount * sizeof(VtdPackItem));
+
+    if (atlasMaxDim + 2 * padding > atlasDim)
+        atlasMaxDim = atlasDim - 2 * padding;
+
+    // Atlas layers, one atlas per channel count
+    for (size_t i = 0; i < imageCount; i++) {
+        if (placed[i] || images[i].width > atlasMaxDim || images[i].height > atlasMaxDim)
+            continue;
+
+        size_t itemCount = 0;
+        for (size_t j = i; j < imageCount; j++) {
+            if (!placed[j] && images[j].channels == images[i].channels
+              && images[j].width <= atlasMaxDim && images[j].height <= atlasMaxDim) {
+                items[itemCount].index  = j;
+                items[itemCount].height = images[j].height;
+                itemCount++;
+            }
+        }
+
+        if (itemCount < 2)
+            continue;
+
+        qsort(items, itemCount, sizeof(VtdPackItem), vtdPackCompareHeight);
+
+        // Shelf packing, tallest images first
+        uint32_t x = 0, y = 0, shelfHeight = 0, layer = 0, usedWidth = 0, usedHeight = 0;
+        for (size_t j = 0; j < itemCount; j++) {
+            VtdData *image = &images[items[j].index];
+            uint32_t w = image->width + 2 * padding;
+            uint32_t h = image->height + 2 * padding;
+
+            if (x + w > atlasDim) {
+                x = 0;
+                y += shelfHeight;
+                shelfHeight = 0;
+            }
+
+            if (y + h > atlasDim) {
+                layer++;
+                x = y = shelfHeight = 0;
+            }
+
+            pack->entries[items[j].index].layer = layer;
+
+            items[j].x = x + padding;
+            items[j].y = y + padding;
+
+            x += w;
+            if (h > shelfHeight)
+                shelfHeight = h;
+
+            if (x > usedWidth)
+                usedWidth = x;
+            if (y + h > usedHeight)
+                usedHeight = y + h;
+
+            placed[items[j].index] = true;
+        }
+
+        uint32_t arrayIndex = pack->arrayCount;
+        uint32_t width = vtdPackAtlasSide(usedWidth, atlasDim), height = vtdPackAtlasSide(usedHeight, atlasDim);
+        VtdPackArray *array = vtdPackAddArray(pack, images[i].channels, width, height, true);
+
+        array->layerCount = layer + 1;
+        array->pixels = calloc((size_t) array->layerCount * width * height, array->channels);
+
+        for (size_t j = 0; j < itemCount; j++) {
+            VtdData *image = &images[items[j].index];
+            VtdPackEntry *entry = &pack->entries[items[j].index];
+
+            entry->array       = arrayIndex;
+            entry->uvScale[0]  = image->width / (float) width;
+            entry->uvScale[1]  = image->height / (float) height;
+            entry->uvOffset[0] = items[j].x / (float) width;
+            entry->uvOffset[1] = items[j].y / (float) height;
+
+            vtdPackBlit(array, entry->layer, items[j].x, items[j].y, image, padding);
+        }
+    }
+
+    // Texture arrays of identically sized images
+    for (size_t i = 0; i < imageCount; i++) {
+        if (placed[i])
+            continue;
+
+        uint32_t arrayIndex = pack->arrayCount;
+        VtdPackArray *array = vtdPackAddArray(pack, images[i].channels, images[i].width, images[i].height, false);
+
+        uint32_t layerCount = 0;
+        for (size_t j = i; j < imageCount; j++)
+            if (!placed[j] && images[j].channels == array->channels
+              && images[j].width == array->width && images[j].height == array->height)
+                layerCount++;
+
+        size_t layerSize = (size_t) array->width * array->height * array->channels;
+        array->pixels = malloc(layerCount * layerSize);
+
+        for (size_t j = i; j < imageCount; j++) {
+            if (!placed[j] && images[j].channels == array->channels
+              && images[j].width == array->width && images[j].height == array->height) {
+                VtdPackEntry *entry = &pack->entries[j];
+                entry->array       = arrayIndex;
+                entry->layer       = array->layerCount++;
+                entry->uvScale[0]  = 1.0f;
+                entry->uvScale[1]  = 1.0f;
+                entry->uvOffset[0] = 0.0f;
+                entry->uvOffset[1] = 0.0f;
+
+                memcpy(array->pixels + entry->layer * layerSize, images[j].pixels, layerSize);
+                placed[j] = true;
+            }
+        }
+    }
+
+    free(items);
+    free(placed);
+
+    return true;
+}
+
+void vtdPackFree(VtdPack *pack)
+{
+    for (size_t i = 0; i < pack->arrayCount; i++)
+        free(pack->arrays[i].pixels);
+
+    free(pack->arrays);
+    free(pack->entries);
+}
+
+#endif // VTD_PACKER_IMPLEMENTATION
+
+#endif // vtd_packer_h_INCLUDED
@@ -1,14 +1,18 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
 #define LINMATH_VULKAN_PROJECTIONS
 #include <linmath.h>
+#include <linmath_batch.h>
 
 #define VTD_LOADER_IMPLEMENTATION
 #include <vtd_loader.h>
@@ -16,19 +20,136 @@
 #define VMD_LOADER_IMPLEMENTATION
 #include <vmd_loader.h>
 
+#define VTD_PACKER_IMPLEMENTATION
+#include <vtd_packer.h>
+
+#define OCCLUSION_IMPLEMENTATION
+#include <occlusion.h>
+
+#define THREAD_POOL_IMPLEMENTATION
+#include <thread_pool.h>
+
+#define RENDER_QUEUE_IMPLEMENTATION
+#include <render_queue.h>
+
+#define TRANSFORMS_IMPLEMENTATION
+#include <transforms.h>
+
+#define TASK_GRAPH_IMPLEMENTATION
+#include <task_graph.h>
+
+#define ASSET_LOADER_IMPLEMENTATION
+#include <asset_loader.h>
+
+#define FILE_BATCH_IMPLEMENTATION
+#include <file_batch.h>
+
+#define ASSET_PACK_IMPLEMENTATION
+#include <asset_pack.h>
+
+#define DERIVED_CACHE_IMPLEMENTATION
+#include <derived_cache.h>
+
 #include "vktools.h"
 
+// SPIR-V compiled and embedded by the build, see add_shader() in CMakeLists.txt
+#include <shaders/shader_vert.h>
+#include <shaders/shader_frag.h>
+#include <shaders/shader_bindless_frag.h>
+#include <shaders/depth_vert.h>
+#include <shaders/depth_frag.h>
+#include <shaders/mipgen_comp.h>
+#include <shaders/cull_comp.h>
+#include <shaders/cull_occlusion_comp.h>
+#include <shaders/depthreduce_comp.h>
+#include <shaders/depthreduce_ms_comp.h>
+#include <shaders/scatter_comp.h>
+
 
 
 // Changeable options
 #define MAX_FRAMERATE   400
 //#define MIN_FRAME_DELTA (0.975 / MAX_FRAMERATE)
 #define MIN_FRAME_DELTA 0
+#define NEAR_PLANE      0.1f
+#define FAR_PLANE       1000.0f
 #define MIP_LEVELS      0
 #define MIP_BIAS        -0.5f
 #define ANISOTROPY      16
 #define MULTISAMPLES    8
 
+// Generate mip chains with a compute shader instead of a chain of blits
+#define MIP_GEN_COMPUTE 1
+// Time the compute mip generator against the blit chain at startup
+//#define MIP_BENCHMARK
+#define MIP_BENCHMARK_DIM 4096
+// Time the SIMD linmath kernels against their scalar versions at startup
+//#define LINMATH_BENCHMARK
+#define LINMATH_BENCHMARK_COUNT  4096
+#define LINMATH_BENCHMARK_ROUNDS 256
+
+// Textures no larger than ATLAS_MAX_DIM share atlas layers of at most
+// ATLAS_DIM, the padding around each entry limits how many mip levels stay
+// clean
+#define ATLAS_DIM        2048
+#define ATLAS_MAX_DIM    256
+#define ATLAS_PADDING    8
+#define ATLAS_MIP_LEVELS 4
+
+// Put every texture in the same descriptor set as the instance data when
+// VK_EXT_descriptor_indexing is available
+#define BINDLESS              1
+#define BINDLESS_MAX_TEXTURES 1024
+
+// Size of the per-instance data buffer
+#define MAX_INSTANCES 16384
+// Frustum cull instances with compute and draw the survivors indirectly
+#define GPU_CULLING   1
+// Also cull against a depth pyramid, drawing in two phases
+#define OCCLUSION_CULLING 1
+// Without GPU culling, rasterize the largest occluders on the CPU and only
+// draw the instances they don't hide
+#define CPU_OCCLUSION_CULLING 1
+#define OCCLUSION_WIDTH       256
+#define OCCLUSION_HEIGHT      128
+#define OCCLUDER_TRIANGLES    1024
+#define MAX_OCCLUDERS         32
+// Without GPU culling, record the draws into cached secondary command buffers
+// of RECORD_SEGMENT_DRAWS draws each. Only segments whose draws changed are
+// recorded again, spread over up to RECORD_MAX_THREADS threads.
+#define SEGMENT_RECORDING    1
+#define RECORD_SEGMENT_DRAWS 64
+#define RECORD_MAX_THREADS   16
+// The dragon is instanced DRAGON_GRID x DRAGON_GRID times
+#define DRAGON_GRID   1
+// Load the dragon in the background on ASSET_LOADER_THREADS threads, drawing
+// a placeholder until it's ready
+#define ASYNC_LOADING        1
+#define ASSET_LOADER_THREADS 2
+// Read the startup meshes and textures with O_DIRECT, skipping the page
+// cache. Helps cold loads of large scenes, hurts when the files are cached.
+#define DIRECT_IO 0
+// Meshes and textures are looked up in this pack before their own files. It
+// is built by the asset-pack tool and mapped once at startup, if it exists.
+#define ASSET_PACK_PATH "assets.pack"
+// Keep converted meshes and textures in DERIVED_CACHE_DIR, keyed by the hash
+// of their source, so later runs skip the conversion. The least recently used
+// are deleted once they take up more than DERIVED_CACHE_MAX_SIZE bytes.
+#define DERIVED_CACHE          1
+#define DERIVED_CACHE_DIR      "derived_cache"
+#define DERIVED_CACHE_MAX_SIZE (512 << 20)
+
+#define DEPTH_PYRAMID_MAX_LEVELS 16
+
+// Every pipeline is created through a cache that is loaded from and saved to
+// this file, keeping warm starts and resizes from compiling shaders again
+#define PIPELINE_CACHE_PATH "pipeline_cache.bin"
+
+// Lighting terms baked into the scene pipelines as specialization constants
+#define AMBIENT_LIGHT     0.2f
+#define SPECULAR_LIGHTING 1
+#define SPECULAR_POWER    25.0f
+
 #define SHADOW_DIM    2048
 #define SHADOW_FORMAT VK_FORMAT_D16_UNORM
 #define SHADOW_FILTER VK_FILTER_LINEAR
@@ -63,6 +184,10 @@ struct ShaderCache {
     VkShaderModule frag;
     VkShaderModule depthVert;
     VkShaderModule depthFrag;
+    VkShaderModule mipGen;
+    VkShaderModule cull;
+    VkShaderModule depthReduce;
+    VkShaderModule scatter;
 } shaders;
 
 struct VulkanData {
@@ -96,16 +221,29 @@ struct VulkanData {
 
     // Graphics pipline data
     VkRenderPass     renderPass;
+    VkRenderPass     lateRenderPass;
     VkPipelineLayout pipelineLayout;
-    VkPipeline       graphicsPipeline;
 
     VkDescriptorSetLayout descriptorSetLayout;
+    VkDescriptorSetLayout textureSetLayout;
+    VkDescriptorSet       descriptorSet;
 
-    VkCommandPool commandPool;
+    VkCommandPool   commandPool;
+    VkPipelineCache pipelineCache;
+
+    // Pools of the draw segments, segment i is allocated from pool
+    // i % recordPoolCount and only ever recorded by that pool's thread
+    uint32_t       recordPoolCount;
+    VkCommandPool *recordCommandPools;
 
     VkSemaphore imageAvailableSemaphore;
     VkSemaphore renderFinishedSemaphore;
 
+    // Signaled when the last submitted frame has finished on the GPU
+    VkFence  frameFence;
+    uint64_t submittedFrames;
+    uint64_t completedFrames;
+
     // Depth buffer data
     VkFormat       depthFormat;
     VkImage        depthImage;
@@ -119,6 +257,76 @@ struct VulkanData {
     VkImageView        msImageView;
 
     VkDescriptorPool descriptorPool;
+    VkDescriptorPool textureDescriptorPool;
+
+    // Scene and per-instance data
+    VkBuffer       sceneBuffer;
+    VkDeviceMemory sceneBufferMemory;
+    VkBuffer       objectBuffer;
+    VkDeviceMemory objectBufferMemory;
+    VkBuffer       visibleBuffer;
+    VkDeviceMemory visibleBufferMemory;
+
+    // Vertices and indices of every mesh, the counts are how much is used
+    VkBuffer       vertexBuffer;
+    VkDeviceMemory vertexBufferMemory;
+    VkBuffer       indexBuffer;
+    VkDeviceMemory indexBufferMemory;
+    uint32_t       vertexCount;
+    uint32_t       indexCount;
+
+    // Changed object entries, scattered into the object buffer at the start
+    // of every frame
+    VkBuffer              objectUpdateBuffer;
+    VkDeviceMemory        objectUpdateBufferMemory;
+    void                 *objectUpdateData;
+    VkDescriptorSetLayout scatterSetLayout;
+    VkPipelineLayout      scatterPipelineLayout;
+    VkPipeline            scatterPipeline;
+    VkDescriptorPool      scatterDescriptorPool;
+    VkDescriptorSet       scatterDescriptorSet;
+
+    // GPU culling and indirect draws
+    bool                  gpuCullSupported;
+    bool                  multiDrawIndirectSupported;
+    bool                  drawIndirectCountSupported;
+    VkDescriptorSetLayout cullSetLayout;
+    VkPipelineLayout      cullPipelineLayout;
+    VkPipeline            cullPipeline;
+    VkPipeline            cullCompactPipeline;
+    VkDescriptorPool      cullDescriptorPool;
+    VkDescriptorSet       cullDescriptorSets[2];
+    uint32_t              cullDescriptorSet;
+    VkBuffer              batchBuffer;
+    VkDeviceMemory        batchBufferMemory;
+    VkBuffer              drawCommandBuffer;
+    VkDeviceMemory        drawCommandBufferMemory;
+    VkBuffer              drawCountBuffer;
+    VkDeviceMemory        drawCountBufferMemory;
+
+    PFN_vkCmdDrawIndexedIndirectCountKHR fpCmdDrawIndexedIndirectCountKHR;
+
+    // CPU occlusion culling, used when culling on the GPU isn't
+    bool cpuCullEnabled;
+
+    // Hi-Z occlusion culling
+    bool                  hiZSupported;
+    VkBuffer              visibilityBuffer;
+    VkDeviceMemory        visibilityBufferMemory;
+    VkDescriptorSetLayout depthReduceSetLayout;
+    VkPipelineLayout      depthReducePipelineLayout;
+    VkPipeline            depthReducePipeline;
+    VkSampler             depthPyramidSampler;
+    VkImage               depthPyramid;
+    VkDeviceMemory        depthPyramidMemory;
+    VkImageView           depthPyramidView;
+    VkImageView           depthPyramidLevelViews[DEPTH_PYRAMID_MAX_LEVELS];
+    VkDescriptorPool      depthPyramidDescriptorPool;
+    VkDescriptorSet       depthPyramidSets[DEPTH_PYRAMID_MAX_LEVELS];
+    uint32_t              depthPyramidWidth;
+    uint32_t              depthPyramidHeight;
+    uint32_t              depthPyramidLevels;
+    VkCommandBuffer       depthPyramidInitCommands;
 
     // Shadow data
     VkImage          shadowImage;
@@ -132,6 +340,21 @@ struct VulkanData {
     VkCommandBuffer  shadowCommandBuffer;
     VkSemaphore      shadowCompleteSemaphore;
 
+    // Compute mip generation
+    bool                  mipGenSupported;
+    VkDescriptorSetLayout mipGenSetLayout;
+    VkPipelineLayout      mipGenPipelineLayout;
+    VkPipeline            mipGenPipeline;
+    VkDescriptorPool      mipGenDescriptorPool;
+
+    // Bindless descriptors
+    bool     physicalDeviceProps2Supported;
+    bool     bindlessSupported;
+    uint32_t bindlessMaxTextures;
+
+    PFN_vkGetPhysicalDeviceFeatures2KHR   fpGetPhysicalDeviceFeatures2KHR;
+    PFN_vkGetPhysicalDeviceProperties2KHR fpGetPhysicalDeviceProperties2KHR;
+
 #ifdef VALIDATION_LAYERS
     VkDebugReportCallbackEXT callback;
 
@@ -150,9 +373,7 @@ typedef struct {
 } Vertex;
 
 typedef struct {
-    vec3 scale;
-    vec3 pos;
-    quat rot;
+    const char *path;
 
     size_t vertexCount;
     size_t indexCount;
@@ -160,28 +381,176 @@ typedef struct {
     Vertex   *vertices;
     uint32_t *indices;
 
-    // Vulkan model buffers
-    VkBuffer       vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
-    VkBuffer       indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    // Model space center and radius
+    vec4 boundingSphere;
+    vec3 boundsMin;
+    vec3 boundsMax;
+
+    // Coarse copy of the mesh for the CPU occlusion rasterizer
+    float    *occluderPositions;
+    uint32_t *occluderIndices;
+    size_t    occluderVertexCount;
+    size_t    occluderIndexCount;
+
+    // Location of the mesh in the shared vertex and index buffers
+    int32_t  vertexOffset;
+    uint32_t firstIndex;
+
+    // VARIANT_* bits of the pipeline that draws the mesh
+    uint32_t variant;
 
-    // Vulkan texture stuff
-    uint32_t       textureMipLevels;
-    VkImage        textureImage;
-    VkDeviceMemory textureImageMemory;
-    VkImageView    textureImageView;
-    VkSampler      textureSampler;
+    // Drawn as the placeholder cube until the background load finishes
+    bool loading;
+} Mesh;
 
-    // Vulkan uniform buffer things
-    VkBuffer       uniformBuffer;
-    VkDeviceMemory uniformBufferMemory;
+typedef struct {
+    // Placement of the texture in the packed texture arrays
+    const char *texturePath;
+    uint32_t    textureArray;
+    uint32_t    textureLayer;
+    vec4        uvTransform;
+
+    // Samples the white placeholder texture until the background load finishes
+    bool loading;
+} Material;
+
+typedef struct {
+    uint32_t mesh;
+    uint32_t material;
+    uint32_t batch;
+
+    // Node in the transform store
+    uint32_t transform;
+} Instance;
+
+// A run of instances sharing a mesh and material, drawn with a single
+// instanced draw. The instances are contiguous in the object buffer starting
+// at firstInstance.
+typedef struct {
+    uint32_t mesh;
+    uint32_t material;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+} Batch;
+
+// Consecutive batches drawn by a single indirect draw call. All meshes share
+// the geometry buffers, so only the pipeline variant and, without bindless,
+// the texture array split groups.
+typedef struct {
+    uint32_t variant;
+    uint32_t textureArray;
+    uint32_t firstBatch;
+    uint32_t batchCount;
+} DrawGroup;
+
+Mesh      *meshes;
+size_t     meshCount;
+Material  *materials;
+size_t     materialCount;
+Instance  *instances;
+size_t     instanceCount;
+Batch     *batches;
+size_t     batchCount;
+DrawGroup *drawGroups;
+size_t     drawGroupCount;
+
+ThreadPool threadPool;
+
+// Object buffer updates waiting for the next submitted frame, slots maps an
+// instance to its pending update so repeated changes overwrite each other
+struct {
+    struct ObjectUpdate *entries;
+    uint32_t            *slots;
+    uint32_t             count;
+} objectUpdates;
+
+// Transforms of every instance, and the instance owning each transform
+TransformStore transforms;
+uint32_t      *transformInstances;
+
+// Batches to draw this frame without GPU culling, in sort key order
+RenderQueue renderQueue;
+
+// Cached draw segments of one swapchain image. Segment i records the draws
+// from i * RECORD_SEGMENT_DRAWS on and is only recorded again when the hash
+// of what it draws changes.
+typedef struct {
+    VkCommandBuffer *commandBuffers;
+    uint64_t        *hashes;
+    uint32_t        *dirty;
+    uint32_t         count;
+    uint32_t         capacity;
+
+    // Whether the primary command buffer executes the current segments
+    bool primaryValid;
+} SegmentCache;
+
+SegmentCache *segmentCaches;
+
+// Scene pipeline variants, keyed by VARIANT_* bits. The attribute bits match
+// the VMD vertex mask so a mesh's variant comes straight from its file.
+#define VARIANT_NORMAL_BIT   VMD_VERTEX_NORMAL_BIT
+#define VARIANT_COLOR_BIT    VMD_VERTEX_COLOR_BIT
+#define VARIANT_TEXCOORD_BIT VMD_VERTEX_TEXCOORD_BIT
+#define VARIANT_SPECULAR_BIT (1 << 3)
+#define VARIANT_EMPTY        UINT32_MAX
+
+// Open addressing hash map, the capacity is a power of two and at most half
+// of it is used
+typedef struct {
+    uint32_t   *keys;
+    VkPipeline *pipelines;
+    uint32_t    capacity;
+    uint32_t    count;
+} PipelineVariants;
+
+PipelineVariants pipelineVariants;
+
+typedef void (*DeferredDestroy)(void *data);
+
+// Objects retired while a frame that uses them may still be in flight. Each
+// is destroyed once every frame submitted before it was retired has finished.
+typedef struct {
+    uint64_t        frame;
+    DeferredDestroy destroy;
+    void           *data;
+} DeferredDeletion;
+
+struct {
+    DeferredDeletion *entries;
+    size_t            count;
+    size_t            capacity;
+} deletionQueue;
+
+// CPU occlusion culling state, visibleCounts holds each batch's visible
+// instance count for the next recorded draws
+struct {
+    OccBuffer occBuffer;
+    mat4x4    viewProj;
+    bool     *visible;
+    uint32_t *visibleCounts;
+
+    double   time;
+    uint32_t frames;
+    size_t   visibleTotal;
+} cpuCull;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t layerCount;
+    uint32_t mipLevels;
+
+    VkImage        image;
+    VkDeviceMemory imageMemory;
+    VkImageView    imageView;
+    VkSampler      sampler;
 
     VkDescriptorSet descriptorSet;
-} Model;
+} TextureArray;
 
-Model models[2];
-const size_t modelCount = sizeof(models) / sizeof(models[0]);
+TextureArray *textureArrays;
+size_t        textureArrayCount;
 
 
 
@@ -190,17 +559,108 @@ struct Positions {
     vec2  direction;
 } positions;
 
-struct UniformBufferData {
-    mat4x4 model;
+// Shared by every instance, ObjectData holds the per-instance data and is
+// indexed with the instance index
+struct SceneData {
     mat4x4 view;
     mat4x4 proj;
-} ubo;
+    mat4x4 viewProj;
+    vec4   frustum[6];
+} scene;
+
+// The normal matrix is a mat3, each column padded to a vec4
+struct ObjectData {
+    mat4x4   model;
+    vec4     normalMatrix[3];
+    vec4     uvTransform;
+    uint32_t textureIndex;
+    uint32_t textureLayer;
+    uint32_t batch;
+    uint32_t padding;
+};
+
+// Layout of the update buffer read by scatter.comp
+struct ObjectUpdate {
+    mat4x4   model;
+    vec4     normalMatrix[3];
+    uint32_t index;
+    uint32_t padding[3];
+};
+
+struct ObjectUpdateHeader {
+    VkDispatchIndirectCommand dispatch;
+    uint32_t                  updateCount;
+};
+
+// Read by the cull shader, one per batch
+struct BatchData {
+    vec4     boundingSphere;
+    uint32_t firstInstance;
+    uint32_t indexCount;
+    uint32_t group;
+    uint32_t groupFirstBatch;
+    uint32_t firstIndex;
+    int32_t  vertexOffset;
+    uint32_t padding[2];
+};
+
+struct CullPushConstantData {
+    uint32_t instanceCount;
+    uint32_t batchCount;
+    uint32_t groupCount;
+    uint32_t compact;
+    uint32_t phase;
+    uint32_t visibleOffset;
+};
+
+// Matches PHASE_* in cull.comp
+enum {
+    CULL_PHASE_SINGLE,
+    CULL_PHASE_EARLY,
+    CULL_PHASE_LATE
+};
+
+// Render queue sort keys, from the most significant field down:
+// pass (4 bits), pipeline variant (8), texture array (16), mesh (12), depth (24)
+#define SORT_KEY_PASS_SHIFT     60
+#define SORT_KEY_PIPELINE_SHIFT 52
+#define SORT_KEY_MATERIAL_SHIFT 36
+#define SORT_KEY_MESH_SHIFT     24
+#define SORT_KEY_DEPTH_MAX      0xffffff
+
+enum {
+    RENDER_PASS_OPAQUE
+};
+
+struct DepthReducePushConstantData {
+    int32_t srcSize[2];
+    int32_t dstSize[2];
+    int32_t level;
+};
 
 struct PushConstantData {
     vec4 dirLight;
     vec4 dirLightColor;
 } pushConsts;
 
+// Must match MIPS_PER_PASS in mipgen.comp
+#define MIP_GEN_LEVELS_PER_PASS 6
+#define MIP_GEN_MAX_PASSES      3
+#define MIP_GEN_MAX_LEVELS      (MIP_GEN_LEVELS_PER_PASS * MIP_GEN_MAX_PASSES + 1)
+
+struct MipGenPushConstantData {
+    int32_t srcSize[2];
+    int32_t levelCount;
+    int32_t srgb;
+};
+
+// Transient objects used while a mip chain is generated, these can be
+// released once the command buffer that used them has finished executing
+typedef struct {
+    uint32_t    viewCount;
+    VkImageView views[MIP_GEN_MAX_LEVELS];
+} MipGenResources;
+
 
 
 struct InputInfo {
@@ -241,6 +701,26 @@ bool checkValidationLayerSupport()
 }
 #endif // VALIDATION_LAYERS
 
+bool instanceExtensionSupported(const char *name)
+{
+    uint32_t extensionCount;
+    vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, NULL);
+
+    VkExtensionProperties *extensions = malloc(extensionCount * sizeof(VkExtensionProperties));
+    vkEnumerateInstanceExtensionProperties(NULL, &extensionCount, extensions);
+
+    bool found = false;
+    for (size_t i = 0; i < extensionCount; ++i) {
+        if (strcmp(name, extensions[i].extensionName) == 0) {
+            found = true;
+            break;
+        }
+    }
+
+    free(extensions);
+    return found;
+}
+
 void createInstance()
 {
     VkApplicationInfo appInfo = {
@@ -261,19 +741,22 @@ void createInstance()
     unsigned int extensionCount = glfwExtensionCount;
     const char **extensions;
 
-#ifdef VALIDATION_LAYERS
-    extensionCount += 1;
-#endif // VALIDATION_LAYERS
-
-    extensions = malloc(extensionCount * sizeof(char*));
+    extensions = malloc((glfwExtensionCount + 2) * sizeof(char*));
 
     for (size_t i = 0; i < glfwExtensionCount; ++i)
         extensions[i] = glfwExtensions[i];
 
 #ifdef VALIDATION_LAYERS
-    extensions[glfwExtensionCount] = VK_EXT_DEBUG_REPORT_EXTENSION_NAME;
+    extensions[extensionCount++] = VK_EXT_DEBUG_REPORT_EXTENSION_NAME;
 #endif // VALIDATION_LAYERS
 
+    // Needed to query for descriptor indexing support on a 1.0 instance
+    vkData.physicalDeviceProps2Supported = BINDLESS
+        && instanceExtensionSupported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+
+    if (vkData.physicalDeviceProps2Supported)
+        extensions[extensionCount++] = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+
     VkInstanceCreateInfo createInfo = {
         .sType                   = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
         .pApplicationInfo        = &appInfo,
@@ -298,6 +781,13 @@ void createInstance()
 
 void loadInstanceFunctions()
 {
+    if (vkData.physicalDeviceProps2Supported) {
+        GET_INSTANCE_PROC_ADDR(vkData.instance, vkData.fpGetPhysicalDeviceFeatures2KHR,
+                               vkGetPhysicalDeviceFeatures2KHR);
+        GET_INSTANCE_PROC_ADDR(vkData.instance, vkData.fpGetPhysicalDeviceProperties2KHR,
+                               vkGetPhysicalDeviceProperties2KHR);
+    }
+
 #ifdef VALIDATION_LAYERS
     GET_INSTANCE_PROC_ADDR(vkData.instance, vkData.fpCreateDebugReportCallbackEXT,
                            vkCreateDebugReportCallbackEXT);
@@ -457,6 +947,132 @@ void pickPhysicalDevice()
         ERR_EXIT("Failed to find a suitable GPU\n");
 }
 
+bool deviceExtensionSupported(VkPhysicalDevice physicalDevice, const char *name)
+{
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, NULL);
+
+    VkExtensionProperties *extensions = malloc(extensionCount * sizeof(VkExtensionProperties));
+    vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, extensions);
+
+    bool found = false;
+    for (size_t i = 0; i < extensionCount; ++i) {
+        if (strcmp(name, extensions[i].extensionName) == 0) {
+            found = true;
+            break;
+        }
+    }
+
+    free(extensions);
+    return found;
+}
+
+void checkBindlessSupport()
+{
+    vkData.bindlessSupported = false;
+
+    if (!vkData.physicalDeviceProps2Supported
+      || !deviceExtensionSupported(vkData.physicalDevice, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)
+      || !deviceExtensionSupported(vkData.physicalDevice, VK_KHR_MAINTENANCE3_EXTENSION_NAME))
+        return;
+
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT
+    };
+
+    VkPhysicalDeviceFeatures2KHR features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR,
+        .pNext = &indexingFeatures
+    };
+
+    vkData.fpGetPhysicalDeviceFeatures2KHR(vkData.physicalDevice, &features);
+
+    if (!indexingFeatures.runtimeDescriptorArray
+      || !indexingFeatures.descriptorBindingPartiallyBound
+      || !indexingFeatures.descriptorBindingVariableDescriptorCount
+      || !indexingFeatures.descriptorBindingSampledImageUpdateAfterBind
+      || !indexingFeatures.shaderSampledImageArrayNonUniformIndexing)
+        return;
+
+    VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexingProps = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT
+    };
+
+    VkPhysicalDeviceProperties2KHR props = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR,
+        .pNext = &indexingProps
+    };
+
+    vkData.fpGetPhysicalDeviceProperties2KHR(vkData.physicalDevice, &props);
+
+    // Combined image samplers count against both the sampler and the sampled
+    // image limits, and the layout is created with UPDATE_AFTER_BIND
+    VkPhysicalDeviceLimits *limits = &props.properties.limits;
+    uint32_t textureLimits[] = {
+        limits->maxPerStageDescriptorSamplers,
+        limits->maxPerStageDescriptorSampledImages,
+        limits->maxDescriptorSetSamplers,
+        limits->maxDescriptorSetSampledImages,
+        indexingProps.maxPerStageDescriptorUpdateAfterBindSamplers,
+        indexingProps.maxPerStageDescriptorUpdateAfterBindSampledImages,
+        indexingProps.maxDescriptorSetUpdateAfterBindSamplers,
+        indexingProps.maxDescriptorSetUpdateAfterBindSampledImages
+    };
+
+    uint32_t maxTextures = BINDLESS_MAX_TEXTURES;
+    for (size_t i = 0; i < sizeof(textureLimits) / sizeof(textureLimits[0]); ++i)
+        if (textureLimits[i] < maxTextures)
+            maxTextures = textureLimits[i];
+
+    vkData.bindlessMaxTextures = maxTextures;
+    vkData.bindlessSupported   = true;
+}
+
+void getMultisampleCount()
+{
+    VkSampleCountFlags colorSamples = vkData.physicalDeviceProps.limits.framebufferColorSampleCounts;
+    VkSampleCountFlags depthSamples = vkData.physicalDeviceProps.limits.framebufferDepthSampleCounts;
+
+    VkSampleCountFlags samples = colorSamples > depthSamples ? depthSamples : colorSamples;
+
+    if (samples & VK_SAMPLE_COUNT_16_BIT) samples = VK_SAMPLE_COUNT_16_BIT;
+    else if (samples & VK_SAMPLE_COUNT_8_BIT) samples = VK_SAMPLE_COUNT_8_BIT;
+    else if (samples & VK_SAMPLE_COUNT_4_BIT) samples = VK_SAMPLE_COUNT_4_BIT;
+    else if (samples & VK_SAMPLE_COUNT_2_BIT) samples = VK_SAMPLE_COUNT_2_BIT;
+    else samples = VK_SAMPLE_COUNT_1_BIT;
+
+    vkData.samples = samples > MULTISAMPLES ? MULTISAMPLES : samples;
+}
+
+void checkGpuCullSupport()
+{
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(vkData.physicalDevice, &supportedFeatures);
+
+    // Batches start at their first instance in the visible list, so the
+    // indirect draws need a non-zero firstInstance
+    vkData.gpuCullSupported = GPU_CULLING && supportedFeatures.drawIndirectFirstInstance;
+
+    vkData.multiDrawIndirectSupported = vkData.gpuCullSupported && supportedFeatures.multiDrawIndirect;
+    vkData.drawIndirectCountSupported = vkData.multiDrawIndirectSupported
+        && deviceExtensionSupported(vkData.physicalDevice, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+
+    // The depth pyramid is reduced from the (possibly multisampled) depth
+    // buffer into a R32_SFLOAT storage image
+    VkFormatProperties depthProps, pyramidProps;
+    vkGetPhysicalDeviceFormatProperties(vkData.physicalDevice, findDepthFormat(vkData.physicalDevice), &depthProps);
+    vkGetPhysicalDeviceFormatProperties(vkData.physicalDevice, VK_FORMAT_R32_SFLOAT, &pyramidProps);
+
+    getMultisampleCount();
+
+    vkData.cpuCullEnabled = CPU_OCCLUSION_CULLING && !vkData.gpuCullSupported;
+
+    vkData.hiZSupported = OCCLUSION_CULLING && vkData.gpuCullSupported
+                       && (depthProps.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)
+                       && (pyramidProps.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)
+                       && (vkData.physicalDeviceProps.limits.sampledImageDepthSampleCounts & vkData.samples);
+}
+
 void createLogicalDevice()
 {
     float queuePriority = 1.0f;
@@ -479,16 +1095,43 @@ void createLogicalDevice()
         queueCreateInfoCount = 1;
 
     VkPhysicalDeviceFeatures deviceFeatures = {
-        .samplerAnisotropy = ANISOTROPY > 1 ? VK_TRUE : VK_FALSE
+        .samplerAnisotropy         = ANISOTROPY > 1 ? VK_TRUE : VK_FALSE,
+        .multiDrawIndirect         = vkData.multiDrawIndirectSupported,
+        .drawIndirectFirstInstance = vkData.gpuCullSupported
+    };
+
+    const char **extensions = malloc((deviceExtensionCount + 3) * sizeof(char *));
+    uint32_t extensionCount = deviceExtensionCount;
+
+    for (size_t i = 0; i < deviceExtensionCount; ++i)
+        extensions[i] = deviceExtensions[i];
+
+    // Only the features the bindless path relies on are enabled
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures = {
+        .sType                                        = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+        .runtimeDescriptorArray                       = VK_TRUE,
+        .descriptorBindingPartiallyBound              = VK_TRUE,
+        .descriptorBindingVariableDescriptorCount     = VK_TRUE,
+        .descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+        .shaderSampledImageArrayNonUniformIndexing    = VK_TRUE
     };
 
+    if (vkData.bindlessSupported) {
+        extensions[extensionCount++] = VK_KHR_MAINTENANCE3_EXTENSION_NAME;
+        extensions[extensionCount++] = VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME;
+    }
+
+    if (vkData.drawIndirectCountSupported)
+        extensions[extensionCount++] = VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME;
+
     VkDeviceCreateInfo createInfo = {
         .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext                   = vkData.bindlessSupported ? &indexingFeatures : NULL,
         .pQueueCreateInfos       = queueCreateInfos,
         .queueCreateInfoCount    = queueCreateInfoCount,
         .pEnabledFeatures        = &deviceFeatures,
-        .enabledExtensionCount   = deviceExtensionCount,
-        .ppEnabledExtensionNames = deviceExtensions,
+        .enabledExtensionCount   = extensionCount,
+        .ppEnabledExtensionNames = extensions,
 #ifdef VALIDATION_LAYERS
         .enabledLayerCount       = layerCount,
         .ppEnabledLayerNames     = validationLayers
@@ -498,25 +1141,186 @@ void createLogicalDevice()
     };
 
     VK_CHECK(vkCreateDevice(vkData.physicalDevice, &createInfo, NULL, &vkData.device));
+    free(extensions);
 
     vkGetDeviceQueue(vkData.device, vkData.graphicsFamily, 0, &vkData.graphicsQueue);
     vkGetDeviceQueue(vkData.device, vkData.presentFamily, 0, &vkData.presentQueue);
+
+    if (vkData.drawIndirectCountSupported)
+        GET_DEVICE_PROC_ADDR(vkData.device, vkData.fpCmdDrawIndexedIndirectCountKHR,
+                             vkCmdDrawIndexedIndirectCountKHR);
 }
 
-void getMultisampleCount()
+// Written in front of the driver's cache data. The driver checks the device
+// and cache UUID in its own header, but not the driver version, and has no
+// way of telling a truncated file from a valid one.
+struct PipelineCacheHeader {
+    uint32_t magic;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t  pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+    uint64_t dataHash;
+};
+
+#define PIPELINE_CACHE_MAGIC 0x43504b56 // "VKPC"
+
+uint64_t hashPipelineCacheData(const uint8_t *data, size_t size)
 {
-    VkSampleCountFlags colorSamples = vkData.physicalDeviceProps.limits.framebufferColorSampleCounts;
-    VkSampleCountFlags depthSamples = vkData.physicalDeviceProps.limits.framebufferDepthSampleCounts;
+    uint64_t hash = 0xcbf29ce484222325ull;
 
-    VkSampleCountFlags samples = colorSamples > depthSamples ? depthSamples : colorSamples;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
 
-    if (samples & VK_SAMPLE_COUNT_16_BIT) samples = VK_SAMPLE_COUNT_16_BIT;
-    else if (samples & VK_SAMPLE_COUNT_8_BIT) samples = VK_SAMPLE_COUNT_8_BIT;
-    else if (samples & VK_SAMPLE_COUNT_4_BIT) samples = VK_SAMPLE_COUNT_4_BIT;
-    else if (samples & VK_SAMPLE_COUNT_2_BIT) samples = VK_SAMPLE_COUNT_2_BIT;
-    else samples = VK_SAMPLE_COUNT_1_BIT;
+    return hash;
+}
 
-    vkData.samples = samples > MULTISAMPLES ? MULTISAMPLES : samples;
+void fillPipelineCacheHeader(struct PipelineCacheHeader *header)
+{
+    VkPhysicalDeviceProperties *props = &vkData.physicalDeviceProps;
+
+    memset(header, 0, sizeof(struct PipelineCacheHeader));
+    header->magic         = PIPELINE_CACHE_MAGIC;
+    header->vendorID      = props->vendorID;
+    header->deviceID      = props->deviceID;
+    header->driverVersion = props->driverVersion;
+    memcpy(header->pipelineCacheUUID, props->pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// Returns the cache data of PIPELINE_CACHE_PATH if it was written for this
+// device and driver and is intact, NULL otherwise
+void *loadPipelineCacheData(size_t *size)
+{
+    FILE *fp = fopen(PIPELINE_CACHE_PATH, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    struct PipelineCacheHeader header, expected;
+    fillPipelineCacheHeader(&expected);
+
+    void *data = NULL;
+
+    long fileSize = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        fileSize = ftell(fp);
+
+    if (fileSize == -1 || fseek(fp, 0, SEEK_SET) != 0) {
+        printf("Failed to get the size of pipeline cache %s, ignoring it\n", PIPELINE_CACHE_PATH);
+        goto done;
+    }
+
+    if ((uint64_t) fileSize < sizeof(header)) {
+        printf("Pipeline cache %s is truncated, ignoring it\n", PIPELINE_CACHE_PATH);
+        goto done;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != expected.magic ||
+        header.vendorID != expected.vendorID || header.deviceID != expected.deviceID ||
+        header.driverVersion != expected.driverVersion ||
+        memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        printf("Pipeline cache %s is from another device or driver, ignoring it\n", PIPELINE_CACHE_PATH);
+        goto done;
+    }
+
+    if (header.dataSize != (uint64_t) fileSize - sizeof(header)) {
+        printf("Pipeline cache %s is truncated, ignoring it\n", PIPELINE_CACHE_PATH);
+        goto done;
+    }
+
+    data = malloc(header.dataSize);
+
+    if (fread(data, 1, header.dataSize, fp) != header.dataSize ||
+        hashPipelineCacheData(data, header.dataSize) != header.dataHash) {
+        printf("Pipeline cache %s is corrupt, ignoring it\n", PIPELINE_CACHE_PATH);
+        free(data);
+        data = NULL;
+        goto done;
+    }
+
+    *size = header.dataSize;
+
+done:
+    fclose(fp);
+    return data;
+}
+
+void createPipelineCache()
+{
+    size_t dataSize = 0;
+    void *data = loadPipelineCacheData(&dataSize);
+
+    VkPipelineCacheCreateInfo cacheInfo = {
+        .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = dataSize,
+        .pInitialData    = data
+    };
+
+    // Drivers are allowed to reject data they don't like, start empty then
+    if (vkCreatePipelineCache(vkData.device, &cacheInfo, NULL, &vkData.pipelineCache) != VK_SUCCESS) {
+        cacheInfo.initialDataSize = 0;
+        cacheInfo.pInitialData    = NULL;
+        VK_CHECK(vkCreatePipelineCache(vkData.device, &cacheInfo, NULL, &vkData.pipelineCache));
+    }
+
+    free(data);
+}
+
+// Flushes the directory entry of path, which a rename only changes in memory
+bool syncParentDirectory(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+
+    if (fd == -1)
+        return false;
+
+    bool synced = fsync(fd) == 0;
+    close(fd);
+
+    return synced;
+}
+
+// Written to a temporary file that then replaces the old one, so a crash
+// while saving never leaves a half written cache behind
+void savePipelineCache()
+{
+    size_t dataSize;
+    VK_CHECK(vkGetPipelineCacheData(vkData.device, vkData.pipelineCache, &dataSize, NULL));
+
+    void *data = malloc(dataSize);
+    VK_CHECK(vkGetPipelineCacheData(vkData.device, vkData.pipelineCache, &dataSize, data));
+
+    struct PipelineCacheHeader header;
+    fillPipelineCacheHeader(&header);
+    header.dataSize = dataSize;
+    header.dataHash = hashPipelineCacheData(data, dataSize);
+
+    const char *tempPath = PIPELINE_CACHE_PATH ".tmp";
+    FILE *fp = fopen(tempPath, "wb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", tempPath, strerror(errno));
+        free(data);
+        return;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(data, 1, dataSize, fp) == dataSize &&
+                   fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    written = fclose(fp) == 0 && written;
+
+    if (!written || rename(tempPath, PIPELINE_CACHE_PATH) != 0) {
+        fprintf(stderr, "Error saving the pipeline cache to %s: %s\n", PIPELINE_CACHE_PATH, strerror(errno));
+        remove(tempPath);
+    } else if (!syncParentDirectory(PIPELINE_CACHE_PATH))
+        fprintf(stderr, "Error syncing the directory of %s: %s\n", PIPELINE_CACHE_PATH, strerror(errno));
+
+    free(data);
 }
 
 VkExtent2D selectExtent(VkSurfaceCapabilitiesKHR capabilities)
@@ -666,9 +1470,12 @@ void createImageViews()
     }
 }
 
-void createRenderPass()
+// Without Hi-Z there is a single pass that clears and presents. With it the
+// early pass clears and keeps everything for the late pass, which loads the
+// attachments back and presents. The resolve is part of both so the passes
+// stay compatible and share framebuffers.
+void createSceneRenderPass(VkRenderPass *renderPass, bool early, bool late)
 {
-    getMultisampleCount();
     bool multisampled = vkData.samples > VK_SAMPLE_COUNT_1_BIT;
 
     VkFormat depthFormat = findDepthFormat(vkData.physicalDevice);
@@ -679,32 +1486,33 @@ void createRenderPass()
     // Image for presenting
     attachments[0].format         = vkData.swapchainImageFormat.format;
     attachments[0].samples        = VK_SAMPLE_COUNT_1_BIT;
-    attachments[0].loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[0].loadOp         = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
     attachments[0].storeOp        = VK_ATTACHMENT_STORE_OP_STORE;
     attachments[0].stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[0].initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachments[0].finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    attachments[0].initialLayout  = late ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+    attachments[0].finalLayout    = early ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
-    // Depth buffer
+    // Depth buffer, read by the depth pyramid between the passes
     attachments[1].format         = depthFormat;
     attachments[1].samples        = vkData.samples;
-    attachments[1].loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    attachments[1].storeOp        = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].loadOp         = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[1].storeOp        = early ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
     attachments[1].stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[1].initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachments[1].finalLayout    = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[1].initialLayout  = late ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+    attachments[1].finalLayout    = early ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+                                          : VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     if (multisampled) {
         // Multisampled render target
         attachments[2].format         = vkData.swapchainImageFormat.format;
         attachments[2].samples        = vkData.samples;
-        attachments[2].loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        attachments[2].loadOp         = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
         attachments[2].storeOp        = VK_ATTACHMENT_STORE_OP_STORE;
         attachments[2].stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         attachments[2].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        attachments[2].initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED;
+        attachments[2].initialLayout  = late ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
         attachments[2].finalLayout    = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
         attachmentCount = 3;
@@ -734,7 +1542,7 @@ void createRenderPass()
         .pDepthStencilAttachment = &depthAttachmentRef
     };
 
-    VkSubpassDependency dependencies[2] = {};
+    VkSubpassDependency dependencies[3] = {};
     size_t dependencyCount = 0;
 
     if (multisampled) {
@@ -766,6 +1574,30 @@ void createRenderPass()
         dependencyCount = 1;
     }
 
+    if (early) {
+        // Depth writes before the pyramid reduction reads them
+        dependencies[dependencyCount].srcSubpass    = 0;
+        dependencies[dependencyCount].dstSubpass    = VK_SUBPASS_EXTERNAL;
+        dependencies[dependencyCount].srcStageMask  = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[dependencyCount].dstStageMask  = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dependencies[dependencyCount].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[dependencyCount].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        dependencyCount++;
+    } else if (late) {
+        // The reduction's reads and the early pass's writes before depth
+        // testing resumes
+        dependencies[dependencyCount].srcSubpass    = VK_SUBPASS_EXTERNAL;
+        dependencies[dependencyCount].dstSubpass    = 0;
+        dependencies[dependencyCount].srcStageMask  = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                                    | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[dependencyCount].dstStageMask  = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                                                    | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[dependencyCount].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[dependencyCount].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+                                                    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencyCount++;
+    }
+
     VkRenderPassCreateInfo renderPassInfo = {
         .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
         .attachmentCount = attachmentCount,
@@ -776,15 +1608,25 @@ void createRenderPass()
         .pDependencies   = dependencies
     };
 
-    VK_CHECK(vkCreateRenderPass(vkData.device, &renderPassInfo, NULL, &vkData.renderPass));
+    VK_CHECK(vkCreateRenderPass(vkData.device, &renderPassInfo, NULL, renderPass));
+}
+
+void createRenderPass()
+{
+    getMultisampleCount();
+
+    createSceneRenderPass(&vkData.renderPass, vkData.hiZSupported, false);
+
+    if (vkData.hiZSupported)
+        createSceneRenderPass(&vkData.lateRenderPass, false, true);
 }
 
-VkShaderModule createShaderModule(char * code, size_t codeLen)
+VkShaderModule createShaderModule(const uint32_t *code, size_t codeSize)
 {
     VkShaderModuleCreateInfo createInfo = {
         .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .codeSize = codeLen,
-        .pCode    = (const uint32_t *) code
+        .codeSize = codeSize,
+        .pCode    = code
     };
 
     VkShaderModule shaderModule;
@@ -793,72 +1635,234 @@ VkShaderModule createShaderModule(char * code, size_t codeLen)
     return shaderModule;
 }
 
+#define CREATE_SHADER_MODULE(spv) createShaderModule(spv, sizeof(spv))
+
 void loadShaders()
 {
-    size_t vertCodeLen, fragCodeLen;
-    char *vertShaderCode = getFileData("shaders/shader.vert.spv", &vertCodeLen);
-    char *fragShaderCode = getFileData("shaders/shader.frag.spv", &fragCodeLen);
+    shaders.vert = CREATE_SHADER_MODULE(shader_vert_spv);
 
-    shaders.vert = createShaderModule(vertShaderCode, vertCodeLen);
-    shaders.frag = createShaderModule(fragShaderCode, fragCodeLen);
+    if (vkData.bindlessSupported)
+        shaders.frag = CREATE_SHADER_MODULE(shader_bindless_frag_spv);
+    else
+        shaders.frag = CREATE_SHADER_MODULE(shader_frag_spv);
 
-    free(vertShaderCode);
-    free(fragShaderCode);
+    shaders.depthVert = CREATE_SHADER_MODULE(depth_vert_spv);
+    shaders.depthFrag = CREATE_SHADER_MODULE(depth_frag_spv);
 
-    vertShaderCode = getFileData("shaders/depth.vert.spv", &vertCodeLen);
-    fragShaderCode = getFileData("shaders/depth.frag.spv", &fragCodeLen);
+    shaders.mipGen = CREATE_SHADER_MODULE(mipgen_comp_spv);
 
-    shaders.depthVert = createShaderModule(vertShaderCode, vertCodeLen);
-    shaders.depthFrag = createShaderModule(fragShaderCode, fragCodeLen);
+    if (vkData.hiZSupported)
+        shaders.cull = CREATE_SHADER_MODULE(cull_occlusion_comp_spv);
+    else
+        shaders.cull = CREATE_SHADER_MODULE(cull_comp_spv);
 
-    free(vertShaderCode);
-    free(fragShaderCode);
+    shaders.scatter = CREATE_SHADER_MODULE(scatter_comp_spv);
+
+    if (vkData.hiZSupported) {
+        if (vkData.samples > VK_SAMPLE_COUNT_1_BIT)
+            shaders.depthReduce = CREATE_SHADER_MODULE(depthreduce_ms_comp_spv);
+        else
+            shaders.depthReduce = CREATE_SHADER_MODULE(depthreduce_comp_spv);
+    }
 }
 
 void createDescriptorSetLayout()
 {
-    VkDescriptorSetLayoutBinding transformsLayoutBinding = {
-        .binding            = 0,
-        .descriptorCount    = 1,
-        .descriptorType     = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .pImmutableSamplers = NULL, // Optional
-        .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT
+    // Scene data, every instance's data and the visible instance list, with
+    // the bindless path this set also holds every texture array, sized at
+    // allocation and filled in as textures are loaded
+    VkDescriptorSetLayoutBinding bindings[] = {
+        {
+            .binding            = 0,
+            .descriptorCount    = 1,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .pImmutableSamplers = NULL, // Optional
+            .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT
+        }, {
+            .binding            = 1,
+            .descriptorCount    = 1,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pImmutableSamplers = NULL, // Optional
+            .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT
+        }, {
+            .binding            = 2,
+            .descriptorCount    = 1,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pImmutableSamplers = NULL, // Optional
+            .stageFlags         = VK_SHADER_STAGE_VERTEX_BIT
+        }, {
+            .binding            = 3,
+            .descriptorCount    = vkData.bindlessMaxTextures,
+            .descriptorType     = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImmutableSamplers = NULL, // Optional
+            .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT
+        }
     };
 
-    VkDescriptorSetLayoutBinding samplerLayoutBinding = {
-        .binding            = 1,
-        .descriptorCount    = 1,
-        .descriptorType     = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .pImmutableSamplers = NULL, // Optional
-        .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT
+    VkDescriptorBindingFlagsEXT bindingFlags[] = {
+        0,
+        0,
+        0,
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT
+      | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT
     };
 
-    VkDescriptorSetLayoutBinding bindings[] = {transformsLayoutBinding, samplerLayoutBinding};
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,
+        .bindingCount  = sizeof(bindingFlags) / sizeof(bindingFlags[0]),
+        .pBindingFlags = bindingFlags
+    };
 
     VkDescriptorSetLayoutCreateInfo layoutInfo = {
         .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = sizeof(bindings) / sizeof(bindings[0]),
+        .bindingCount = 3,
         .pBindings    = bindings
     };
 
+    if (vkData.bindlessSupported) {
+        layoutInfo.pNext        = &bindingFlagsInfo;
+        layoutInfo.flags        = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+        layoutInfo.bindingCount = 4;
+    }
+
     VK_CHECK(vkCreateDescriptorSetLayout(vkData.device, &layoutInfo, NULL, &vkData.descriptorSetLayout));
-}
 
-void createGraphicsPipeline()
-{
-    // Shader stuff
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {
-        .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage  = VK_SHADER_STAGE_VERTEX_BIT,
-        .module = shaders.vert,
-        .pName  = "main"
-    };
+    if (vkData.bindlessSupported)
+        return;
+
+    // Texture arrays live in their own set so draws sharing one don't rebind it
+    VkDescriptorSetLayoutBinding samplerLayoutBinding = {
+        .binding            = 0,
+        .descriptorCount    = 1,
+        .descriptorType     = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImmutableSamplers = NULL, // Optional
+        .stageFlags         = VK_SHADER_STAGE_FRAGMENT_BIT
+    };
+
+    VkDescriptorSetLayoutCreateInfo textureLayoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings    = &samplerLayoutBinding
+    };
+
+    VK_CHECK(vkCreateDescriptorSetLayout(vkData.device, &textureLayoutInfo, NULL, &vkData.textureSetLayout));
+}
+
+typedef void (*PipelineJobCreate)(uint32_t arg);
+
+// Pipeline creation spread over the thread pool. Every job writes only its
+// own handles and Vulkan synchronizes the shared pipeline cache internally.
+struct {
+    struct PipelineJob {
+        PipelineJobCreate create;
+        uint32_t          arg;
+    } *jobs;
+    size_t count;
+    size_t capacity;
+
+    // The next job for runPipelineJobs()
+    _Atomic size_t next;
+} pipelineJobs;
+
+void queuePipelineJob(PipelineJobCreate create, uint32_t arg)
+{
+    if (pipelineJobs.count == pipelineJobs.capacity) {
+        pipelineJobs.capacity = pipelineJobs.capacity ? 2 * pipelineJobs.capacity : 16;
+        pipelineJobs.jobs = realloc(pipelineJobs.jobs, pipelineJobs.capacity * sizeof(struct PipelineJob));
+    }
+
+    pipelineJobs.jobs[pipelineJobs.count++] = (struct PipelineJob) {create, arg};
+}
+
+static void runPipelineJob(void *data, size_t index)
+{
+    (void) data;
+
+    pipelineJobs.jobs[index].create(pipelineJobs.jobs[index].arg);
+}
+
+// Runs the queued jobs on the workers while the caller carries on. Nothing
+// else may use the thread pool or queue jobs until finishPipelineJobs().
+void startPipelineJobs()
+{
+    threadPoolForAsync(&threadPool, pipelineJobs.count, runPipelineJob, NULL);
+}
+
+// Runs queued jobs until none are left, for tasks of the startup graph that
+// can't use the thread pool it runs on. Calling it from several threads at
+// once spreads the jobs over them.
+void runPipelineJobs()
+{
+    for (size_t i; (i = atomic_fetch_add(&pipelineJobs.next, 1)) < pipelineJobs.count;)
+        pipelineJobs.jobs[i].create(pipelineJobs.jobs[i].arg);
+}
+
+void clearPipelineJobs()
+{
+    free(pipelineJobs.jobs);
+    memset(&pipelineJobs, 0, sizeof(pipelineJobs));
+}
+
+void finishPipelineJobs()
+{
+    threadPoolWait(&threadPool);
+    clearPipelineJobs();
+}
+
+// Matches the constant_ids in shader.vert and shader.frag
+struct VariantConstants {
+    VkBool32 hasNormal;
+    VkBool32 hasColor;
+    VkBool32 hasTexCoord;
+    VkBool32 specular;
+    float    ambient;
+    float    specularPower;
+};
+
+// The scene pipeline with the attributes and lighting terms of the VARIANT_*
+// bits specialized into the shaders
+VkPipeline createScenePipeline(uint32_t variant)
+{
+    // Shader stuff
+    struct VariantConstants constants = {
+        .hasNormal     = (variant & VARIANT_NORMAL_BIT) != 0,
+        .hasColor      = (variant & VARIANT_COLOR_BIT) != 0,
+        .hasTexCoord   = (variant & VARIANT_TEXCOORD_BIT) != 0,
+        .specular      = (variant & VARIANT_SPECULAR_BIT) != 0,
+        .ambient       = AMBIENT_LIGHT,
+        .specularPower = SPECULAR_POWER
+    };
+
+    VkSpecializationMapEntry constantEntries[] = {
+        {0, offsetof(struct VariantConstants, hasNormal),     sizeof(VkBool32)},
+        {1, offsetof(struct VariantConstants, hasColor),      sizeof(VkBool32)},
+        {2, offsetof(struct VariantConstants, hasTexCoord),   sizeof(VkBool32)},
+        {3, offsetof(struct VariantConstants, specular),      sizeof(VkBool32)},
+        {4, offsetof(struct VariantConstants, ambient),       sizeof(float)},
+        {5, offsetof(struct VariantConstants, specularPower), sizeof(float)}
+    };
+
+    VkSpecializationInfo specializationInfo = {
+        .mapEntryCount = sizeof(constantEntries) / sizeof(constantEntries[0]),
+        .pMapEntries   = constantEntries,
+        .dataSize      = sizeof(constants),
+        .pData         = &constants
+    };
+
+    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {
+        .sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage               = VK_SHADER_STAGE_VERTEX_BIT,
+        .module              = shaders.vert,
+        .pName               = "main",
+        .pSpecializationInfo = &specializationInfo
+    };
 
     VkPipelineShaderStageCreateInfo fragShaderStageInfo = {
-        .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage  = VK_SHADER_STAGE_FRAGMENT_BIT,
-        .module = shaders.frag,
-        .pName  = "main"
+        .sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage               = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .module              = shaders.frag,
+        .pName               = "main",
+        .pSpecializationInfo = &specializationInfo
     };
 
     VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
@@ -908,27 +1912,22 @@ void createGraphicsPipeline()
         .primitiveRestartEnable = VK_FALSE
     };
 
-    // Viewport stuff
-    VkViewport viewport = {
-        .x        = 0.0f,
-        .y        = 0.0f,
-        .width    = (float) vkData.swapchainImageExtent.width,
-        .height   = (float) vkData.swapchainImageExtent.height,
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f
+    // Viewport stuff, set while recording so the pipeline survives resizes
+    VkPipelineViewportStateCreateInfo viewportState = {
+        .sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        .viewportCount = 1,
+        .scissorCount  = 1
     };
 
-    VkRect2D scissor = {
-        .offset = {0, 0},
-        .extent = vkData.swapchainImageExtent
+    VkDynamicState dynamicStates[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
     };
 
-    VkPipelineViewportStateCreateInfo viewportState = {
-        .sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-        .viewportCount = 1,
-        .pViewports    = &viewport,
-        .scissorCount  = 1,
-        .pScissors     = &scissor
+    VkPipelineDynamicStateCreateInfo dynamicState = {
+        .sType             = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .dynamicStateCount = sizeof(dynamicStates) / sizeof(dynamicStates[0]),
+        .pDynamicStates    = dynamicStates
     };
 
     // Rasterizer stuff
@@ -993,26 +1992,6 @@ void createGraphicsPipeline()
         .blendConstants  = { 0.0f, 0.0f, 0.0f, 0.0f } // Optional
     };
 
-    // Dynamic state stuff would go here if we had any
-
-    // Pipeline layout for uniforms and push constants
-    VkPushConstantRange pushConstantRange = {
-        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-        .offset     = 0,
-        .size       = sizeof(struct PushConstantData)
-    };
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
-        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount         = 1,
-        .pSetLayouts            = &vkData.descriptorSetLayout,
-        .pushConstantRangeCount = 1,
-        .pPushConstantRanges    = &pushConstantRange
-    };
-
-    // Create pipeline layout
-    VK_CHECK(vkCreatePipelineLayout(vkData.device, &pipelineLayoutInfo, NULL, &vkData.pipelineLayout));
-
     // Graphics pipeline creation info
     VkGraphicsPipelineCreateInfo pipelineInfo = {
         .sType               = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
@@ -1025,7 +2004,7 @@ void createGraphicsPipeline()
         .pMultisampleState   = &multisampling,
         .pDepthStencilState  = &depthStencil,
         .pColorBlendState    = &colorBlending,
-        .pDynamicState       = NULL,
+        .pDynamicState       = &dynamicState,
         .layout              = vkData.pipelineLayout,
         .renderPass          = vkData.renderPass,
         .subpass             = 0,
@@ -1033,8 +2012,127 @@ void createGraphicsPipeline()
         .basePipelineIndex   = -1 // Optional
     };
 
-    VK_CHECK(vkCreateGraphicsPipelines(vkData.device, VK_NULL_HANDLE, 1, &pipelineInfo, NULL,
-                                      &vkData.graphicsPipeline));
+    VkPipeline pipeline;
+    VK_CHECK(vkCreateGraphicsPipelines(vkData.device, vkData.pipelineCache, 1, &pipelineInfo, NULL, &pipeline));
+
+    return pipeline;
+}
+
+static uint32_t pipelineVariantSlot(PipelineVariants *map, uint32_t variant)
+{
+    uint32_t hash = variant * 0x9e3779b1u;
+    uint32_t slot = (hash ^ (hash >> 16)) & (map->capacity - 1);
+
+    while (map->keys[slot] != VARIANT_EMPTY && map->keys[slot] != variant)
+        slot = (slot + 1) & (map->capacity - 1);
+
+    return slot;
+}
+
+// Only reads the map, so it's safe to call from the recording threads
+VkPipeline findPipelineVariant(uint32_t variant)
+{
+    if (pipelineVariants.capacity == 0)
+        return VK_NULL_HANDLE;
+
+    uint32_t slot = pipelineVariantSlot(&pipelineVariants, variant);
+    return pipelineVariants.keys[slot] == variant ? pipelineVariants.pipelines[slot] : VK_NULL_HANDLE;
+}
+
+// Adds the variant to the map without a pipeline, queuePipelineVariants()
+// creates it. Must not be called while pipeline jobs are running.
+void requestPipelineVariant(uint32_t variant)
+{
+    PipelineVariants *map = &pipelineVariants;
+
+    if (map->capacity > 0 && map->keys[pipelineVariantSlot(map, variant)] == variant)
+        return;
+
+    if (2 * (map->count + 1) > map->capacity) {
+        PipelineVariants old = *map;
+
+        map->capacity  = old.capacity ? 2 * old.capacity : 16;
+        map->keys      = malloc(map->capacity * sizeof(uint32_t));
+        map->pipelines = malloc(map->capacity * sizeof(VkPipeline));
+
+        for (uint32_t i = 0; i < map->capacity; i++)
+            map->keys[i] = VARIANT_EMPTY;
+
+        for (uint32_t i = 0; i < old.capacity; i++) {
+            if (old.keys[i] == VARIANT_EMPTY)
+                continue;
+
+            uint32_t slot = pipelineVariantSlot(map, old.keys[i]);
+            map->keys[slot]      = old.keys[i];
+            map->pipelines[slot] = old.pipelines[i];
+        }
+
+        free(old.keys);
+        free(old.pipelines);
+    }
+
+    uint32_t slot = pipelineVariantSlot(map, variant);
+    map->keys[slot]      = variant;
+    map->pipelines[slot] = VK_NULL_HANDLE;
+    map->count++;
+}
+
+static void createPipelineVariantJob(uint32_t slot)
+{
+    pipelineVariants.pipelines[slot] = createScenePipeline(pipelineVariants.keys[slot]);
+}
+
+// Queues a pipeline job for every requested variant without a pipeline
+void queuePipelineVariants()
+{
+    for (uint32_t i = 0; i < pipelineVariants.capacity; i++)
+        if (pipelineVariants.keys[i] != VARIANT_EMPTY && pipelineVariants.pipelines[i] == VK_NULL_HANDLE)
+            queuePipelineJob(createPipelineVariantJob, i);
+}
+
+void destroyPipelineVariants(PipelineVariants *map)
+{
+    for (uint32_t i = 0; i < map->capacity; i++)
+        if (map->keys[i] != VARIANT_EMPTY && map->pipelines[i] != VK_NULL_HANDLE)
+            vkDestroyPipeline(vkData.device, map->pipelines[i], NULL);
+
+    free(map->keys);
+    free(map->pipelines);
+    memset(map, 0, sizeof(PipelineVariants));
+}
+
+// Only the layout, the variants are created by createPipelineVariants()
+void createGraphicsPipeline()
+{
+    // Pipeline layout for uniforms and push constants
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .offset     = 0,
+        .size       = sizeof(struct PushConstantData)
+    };
+
+    VkDescriptorSetLayout setLayouts[] = {vkData.descriptorSetLayout, vkData.textureSetLayout};
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount         = vkData.bindlessSupported ? 1 : sizeof(setLayouts) / sizeof(setLayouts[0]),
+        .pSetLayouts            = setLayouts,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges    = &pushConstantRange
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(vkData.device, &pipelineLayoutInfo, NULL, &vkData.pipelineLayout));
+}
+
+// Creates the variants of every loaded mesh on the thread pool
+void createPipelineVariants()
+{
+    for (size_t i = 0; i < meshCount; ++i)
+        requestPipelineVariant(meshes[i].variant);
+
+    queuePipelineVariants();
+    startPipelineJobs();
+    finishPipelineJobs();
 }
 
 void createShadowRenderPass()
@@ -1291,7 +2389,7 @@ void createShadowPipeline()
         .basePipelineIndex   = -1 // Optional
     };
 
-    VK_CHECK(vkCreateGraphicsPipelines(vkData.device, VK_NULL_HANDLE, 1, &pipelineInfo, NULL,
+    VK_CHECK(vkCreateGraphicsPipelines(vkData.device, vkData.pipelineCache, 1, &pipelineInfo, NULL,
                                       &vkData.shadowPipeline));
 }
 
@@ -1349,10 +2447,22 @@ void createCommandPool()
     VkCommandPoolCreateInfo poolInfo = {
         .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
         .queueFamilyIndex = vkData.graphicsFamily,
-        .flags            = 0 // Optional
+        .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
     };
 
     VK_CHECK(vkCreateCommandPool(vkData.device, &poolInfo, NULL, &vkData.commandPool));
+
+    // The draws are only recorded every frame without GPU culling
+    vkData.recordPoolCount = 0;
+    if (!SEGMENT_RECORDING || vkData.gpuCullSupported)
+        return;
+
+    vkData.recordPoolCount = threadPool.threadCount + 1 < RECORD_MAX_THREADS ? threadPool.threadCount + 1
+                                                                              : RECORD_MAX_THREADS;
+    vkData.recordCommandPools = malloc(vkData.recordPoolCount * sizeof(VkCommandPool));
+
+    for (uint32_t i = 0; i < vkData.recordPoolCount; i++)
+        VK_CHECK(vkCreateCommandPool(vkData.device, &poolInfo, NULL, &vkData.recordCommandPools[i]));
 }
 
 void createDepthResources()
@@ -1361,29 +2471,15 @@ void createDepthResources()
 
     createImage(vkData.physicalDevice, vkData.device,
                 vkData.swapchainImageExtent.width, vkData.swapchainImageExtent.height, vkData.depthFormat,
-                VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, vkData.samples,
-                1, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vkData.depthImage, &vkData.depthImageMemory);
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (vkData.hiZSupported ? VK_IMAGE_USAGE_SAMPLED_BIT : 0),
+                vkData.samples, 1, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vkData.depthImage, &vkData.depthImageMemory);
 
     vkData.depthImageView = createImageView(vkData.device, vkData.depthImage, vkData.depthFormat,
                                             VK_IMAGE_ASPECT_DEPTH_BIT, 1);
 
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
-
-    VkImageSubresourceRange subresourceRange = {
-        .aspectMask     = VK_IMAGE_ASPECT_DEPTH_BIT,
-        .baseMipLevel   = 0,
-        .levelCount     = 1,
-        .baseArrayLayer = 0,
-        .layerCount     = 1,
-    };
-
-    if (hasStencilComponent(vkData.depthFormat))
-        subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-
-    cmdTransitionImageLayout(commandBuffer, vkData.depthImage, VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, subresourceRange);
-
-    endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, commandBuffer);
+    // No layout transition, the scene render pass starts from UNDEFINED and
+    // a transition here would have to wait for the queue on every resize
 }
 
 void createMultisampleTarget()
@@ -1431,139 +2527,1166 @@ void createFramebuffers()
     }
 }
 
-uint32_t createTextureImage(VkImage *vkImage, VkDeviceMemory *vkImageMemory,
-                            const char *texturePath, uint32_t reqMipLevels)
+void createMipGenPipeline()
 {
-    size_t imgDataLen;
-    char *imgData = getFileData(texturePath, &imgDataLen);
+    VkFormatProperties formatProps;
+    vkGetPhysicalDeviceFormatProperties(vkData.physicalDevice, VK_FORMAT_R8G8B8A8_UNORM, &formatProps);
 
-    VtdData image;
-    loadVtd(imgData, imgDataLen, &image);
+    vkData.mipGenSupported = MIP_GEN_COMPUTE
+                          && (formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
 
-    vtdConvert(&image, VTD_rgb_alpha);
+    if (!vkData.mipGenSupported)
+        return;
 
-    VkDeviceSize imageSize = image.width * image.height * 4;
+    VkDescriptorSetLayoutBinding bindings[] = {
+        {
+            .binding         = 0,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        }, {
+            .binding         = 1,
+            .descriptorCount = MIP_GEN_LEVELS_PER_PASS,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        }
+    };
 
-    VkBuffer       stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(vkData.physicalDevice, vkData.device, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 &stagingBuffer, &stagingBufferMemory);
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = sizeof(bindings) / sizeof(bindings[0]),
+        .pBindings    = bindings
+    };
 
-    void *data;
-    vkMapMemory(vkData.device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, image.pixels, imageSize);
-    vkUnmapMemory(vkData.device, stagingBufferMemory);
+    VK_CHECK(vkCreateDescriptorSetLayout(vkData.device, &layoutInfo, NULL, &vkData.mipGenSetLayout));
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset     = 0,
+        .size       = sizeof(struct MipGenPushConstantData)
+    };
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount         = 1,
+        .pSetLayouts            = &vkData.mipGenSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges    = &pushConstantRange
+    };
 
-    vtdFree(&image);
+    VK_CHECK(vkCreatePipelineLayout(vkData.device, &pipelineLayoutInfo, NULL, &vkData.mipGenPipelineLayout));
 
-    uint32_t mipLevels = floor(log2(image.width > image.height ? image.width : image.height)) + 1;
+    VkComputePipelineCreateInfo pipelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {
+            .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = shaders.mipGen,
+            .pName  = "main"
+        },
+        .layout             = vkData.mipGenPipelineLayout,
+        .basePipelineHandle = VK_NULL_HANDLE, // Optional
+        .basePipelineIndex  = -1 // Optional
+    };
 
-    if (reqMipLevels > 0 && reqMipLevels < mipLevels)
-        mipLevels = reqMipLevels;
+    VK_CHECK(vkCreateComputePipelines(vkData.device, vkData.pipelineCache, 1, &pipelineInfo, NULL,
+                                      &vkData.mipGenPipeline));
 
-    VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-    VkImageLayout     finalLayout;
-    if (mipLevels == 1) {
-        finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    } else {
-        usageFlags |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-        finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    }
+    // One set per pass, generation is serialized so the pool is reset after every image
+    VkDescriptorPoolSize poolSize = {
+        .type            = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .descriptorCount = MIP_GEN_MAX_PASSES * (MIP_GEN_LEVELS_PER_PASS + 1)
+    };
 
-    createImage(vkData.physicalDevice, vkData.device, image.width, image.height, VK_FORMAT_R8G8B8A8_UNORM,
-                VK_IMAGE_TILING_OPTIMAL, usageFlags,
-                VK_SAMPLE_COUNT_1_BIT, mipLevels, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                vkImage, vkImageMemory);
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .poolSizeCount = 1,
+        .pPoolSizes    = &poolSize,
+        .maxSets       = MIP_GEN_MAX_PASSES
+    };
 
-    VkCommandBuffer copyCommandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+    VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.mipGenDescriptorPool));
+}
 
-    VkImageSubresourceRange subresourceRange = {
-        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-        .baseMipLevel   = 0,
-        .levelCount     = 1,
-        .baseArrayLayer = 0,
-        .layerCount     = 1,
+void createCullPipeline()
+{
+    if (!vkData.gpuCullSupported)
+        return;
+
+    VkDescriptorSetLayoutBinding bindings[8] = {
+        {
+            .binding         = 0,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        }
     };
 
-    cmdTransitionImageLayout(copyCommandBuffer, *vkImage, VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresourceRange);
+    // Objects, batches, visible instances, draw commands, draw counts and,
+    // with Hi-Z, last frame's visibility
+    for (uint32_t i = 1; i < 7; ++i) {
+        bindings[i] = (VkDescriptorSetLayoutBinding) {
+            .binding         = i,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        };
+    }
 
-    cmdCopyBufferToImage(copyCommandBuffer, stagingBuffer, *vkImage, image.width, image.height);
+    bindings[7] = (VkDescriptorSetLayoutBinding) {
+        .binding         = 7,
+        .descriptorCount = 1,
+        .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+    };
 
-    cmdTransitionImageLayout(copyCommandBuffer, *vkImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                             finalLayout, subresourceRange);
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = vkData.hiZSupported ? 8 : 6,
+        .pBindings    = bindings
+    };
 
-    endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, copyCommandBuffer);
+    VK_CHECK(vkCreateDescriptorSetLayout(vkData.device, &layoutInfo, NULL, &vkData.cullSetLayout));
 
-    vkDestroyBuffer(vkData.device, stagingBuffer, NULL);
-    vkFreeMemory(vkData.device, stagingBufferMemory, NULL);
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset     = 0,
+        .size       = sizeof(struct CullPushConstantData)
+    };
 
-    if (mipLevels > 1) {
-        // Generate the mip chain
-        VkCommandBuffer blitCommandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
-
-        for (int32_t i = 1; i < mipLevels; ++i) {
-            VkImageBlit imageBlit = {
-                .srcSubresource = {
-                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                    .layerCount = 1,
-                    .mipLevel   = i - 1
-                },
-                .srcOffsets[1] = {
-                    .x = image.width >> (i - 1),
-                    .y = image.height >> (i - 1),
-                    .z = 1
-                },
-                .dstSubresource = {
-                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                    .layerCount = 1,
-                    .mipLevel   = i
-                },
-                .dstOffsets[1] = {
-                    .x = image.width >> i,
-                    .y = image.height >> i,
-                    .z = 1
-                }
-            };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount         = 1,
+        .pSetLayouts            = &vkData.cullSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges    = &pushConstantRange
+    };
 
-            VkImageSubresourceRange mipSubRange = {
-                .aspectMask   = VK_IMAGE_ASPECT_COLOR_BIT,
-                .baseMipLevel = i,
-                .levelCount   = 1,
-                .layerCount   = 1
-            };
+    VK_CHECK(vkCreatePipelineLayout(vkData.device, &pipelineLayoutInfo, NULL, &vkData.cullPipelineLayout));
 
-            cmdTransitionImageLayout(blitCommandBuffer, *vkImage, VK_IMAGE_LAYOUT_UNDEFINED,
-                                  VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipSubRange);
+    // Both passes live in the same shader, selected with a specialization constant
+    uint32_t passes[] = {0, 1};
 
-            vkCmdBlitImage(blitCommandBuffer, *vkImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                           *vkImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                           1, &imageBlit, VK_FILTER_LINEAR);
+    VkSpecializationMapEntry specEntry = {
+        .constantID = 0,
+        .offset     = 0,
+        .size       = sizeof(uint32_t)
+    };
 
-            cmdTransitionImageLayout(blitCommandBuffer, *vkImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                  VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, mipSubRange);
-        }
+    VkSpecializationInfo specInfos[2];
+    VkComputePipelineCreateInfo pipelineInfos[2];
 
-        subresourceRange.levelCount = mipLevels;
-        cmdTransitionImageLayout(blitCommandBuffer, *vkImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange);
+    for (size_t i = 0; i < 2; ++i) {
+        specInfos[i] = (VkSpecializationInfo) {
+            .mapEntryCount = 1,
+            .pMapEntries   = &specEntry,
+            .dataSize      = sizeof(uint32_t),
+            .pData         = &passes[i]
+        };
 
-        endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, blitCommandBuffer);
+        pipelineInfos[i] = (VkComputePipelineCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage = {
+                .sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage               = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module              = shaders.cull,
+                .pName               = "main",
+                .pSpecializationInfo = &specInfos[i]
+            },
+            .layout             = vkData.cullPipelineLayout,
+            .basePipelineHandle = VK_NULL_HANDLE, // Optional
+            .basePipelineIndex  = -1 // Optional
+        };
     }
 
-    return mipLevels;
-}
+    VkPipeline pipelines[2];
+    VK_CHECK(vkCreateComputePipelines(vkData.device, vkData.pipelineCache, 2, pipelineInfos, NULL, pipelines));
 
-void createTextureImageView(VkImageView *imageView, VkImage image, uint32_t mipLevels)
-{
-    *imageView = createImageView(vkData.device, image, VK_FORMAT_R8G8B8A8_UNORM,
-                                 VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
-}
+    vkData.cullPipeline        = pipelines[0];
+    vkData.cullCompactPipeline = pipelines[1];
 
-void createTextureSampler(VkSampler *sampler, uint32_t mipLevels)
-{
-    VkSamplerCreateInfo samplerInfo = {
+    // Two sets, so a resize can point one at the new depth pyramid while the
+    // frame in flight still reads the other
+    VkDescriptorPoolSize poolSizes[] = {
+        {
+            .type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorCount = 2
+        }, {
+            .type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 2 * 6
+        }, {
+            .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 2
+        }
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .poolSizeCount = 3,
+        .pPoolSizes    = poolSizes,
+        .maxSets       = 2
+    };
+
+    VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.cullDescriptorPool));
+}
+
+void createScatterPipeline()
+{
+    // The object buffer and the update buffer
+    VkDescriptorSetLayoutBinding bindings[2];
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        bindings[i] = (VkDescriptorSetLayoutBinding) {
+            .binding         = i,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        };
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 2,
+        .pBindings    = bindings
+    };
+
+    VK_CHECK(vkCreateDescriptorSetLayout(vkData.device, &layoutInfo, NULL, &vkData.scatterSetLayout));
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts    = &vkData.scatterSetLayout
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(vkData.device, &pipelineLayoutInfo, NULL, &vkData.scatterPipelineLayout));
+
+    VkComputePipelineCreateInfo pipelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {
+            .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = shaders.scatter,
+            .pName  = "main"
+        },
+        .layout             = vkData.scatterPipelineLayout,
+        .basePipelineHandle = VK_NULL_HANDLE, // Optional
+        .basePipelineIndex  = -1 // Optional
+    };
+
+    VK_CHECK(vkCreateComputePipelines(vkData.device, vkData.pipelineCache, 1, &pipelineInfo, NULL,
+                                      &vkData.scatterPipeline));
+
+    VkDescriptorPoolSize poolSize = {
+        .type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 2
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .poolSizeCount = 1,
+        .pPoolSizes    = &poolSize,
+        .maxSets       = 1
+    };
+
+    VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.scatterDescriptorPool));
+}
+
+void createDepthReducePipeline()
+{
+    if (!vkData.hiZSupported)
+        return;
+
+    VkDescriptorSetLayoutBinding bindings[] = {
+        {
+            .binding         = 0,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        }, {
+            .binding         = 1,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        }, {
+            .binding         = 2,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT
+        }
+    };
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = sizeof(bindings) / sizeof(bindings[0]),
+        .pBindings    = bindings
+    };
+
+    VK_CHECK(vkCreateDescriptorSetLayout(vkData.device, &layoutInfo, NULL, &vkData.depthReduceSetLayout));
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset     = 0,
+        .size       = sizeof(struct DepthReducePushConstantData)
+    };
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount         = 1,
+        .pSetLayouts            = &vkData.depthReduceSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges    = &pushConstantRange
+    };
+
+    VK_CHECK(vkCreatePipelineLayout(vkData.device, &pipelineLayoutInfo, NULL, &vkData.depthReducePipelineLayout));
+
+    VkComputePipelineCreateInfo pipelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {
+            .sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = shaders.depthReduce,
+            .pName  = "main"
+        },
+        .layout             = vkData.depthReducePipelineLayout,
+        .basePipelineHandle = VK_NULL_HANDLE, // Optional
+        .basePipelineIndex  = -1 // Optional
+    };
+
+    VK_CHECK(vkCreateComputePipelines(vkData.device, vkData.pipelineCache, 1, &pipelineInfo, NULL,
+                                      &vkData.depthReducePipeline));
+
+    // Only ever read with texelFetch
+    VkSamplerCreateInfo samplerInfo = {
+        .sType        = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter    = VK_FILTER_NEAREST,
+        .minFilter    = VK_FILTER_NEAREST,
+        .mipmapMode   = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .minLod       = 0.0f,
+        .maxLod       = DEPTH_PYRAMID_MAX_LEVELS
+    };
+
+    VK_CHECK(vkCreateSampler(vkData.device, &samplerInfo, NULL, &vkData.depthPyramidSampler));
+}
+
+uint32_t previousPowerOfTwo(uint32_t v)
+{
+    uint32_t p = 1;
+    while (p * 2 <= v)
+        p *= 2;
+    return p;
+}
+
+// Sized to the largest power of two that fits in the swapchain, so every
+// level after the first halves exactly. Recreated with the swapchain.
+void createDepthPyramid()
+{
+    if (!vkData.hiZSupported)
+        return;
+
+    vkData.depthPyramidWidth  = previousPowerOfTwo(vkData.swapchainImageExtent.width);
+    vkData.depthPyramidHeight = previousPowerOfTwo(vkData.swapchainImageExtent.height);
+
+    uint32_t maxDim = vkData.depthPyramidWidth > vkData.depthPyramidHeight ? vkData.depthPyramidWidth
+                                                                             : vkData.depthPyramidHeight;
+    vkData.depthPyramidLevels = 1;
+    while ((1u << vkData.depthPyramidLevels) <= maxDim && vkData.depthPyramidLevels < DEPTH_PYRAMID_MAX_LEVELS)
+        vkData.depthPyramidLevels++;
+
+    createImage(vkData.physicalDevice, vkData.device, vkData.depthPyramidWidth, vkData.depthPyramidHeight,
+                VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_SAMPLE_COUNT_1_BIT,
+                vkData.depthPyramidLevels, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                &vkData.depthPyramid, &vkData.depthPyramidMemory);
+
+    vkData.depthPyramidView = createImageView(vkData.device, vkData.depthPyramid, VK_FORMAT_R32_SFLOAT,
+                                              VK_IMAGE_ASPECT_COLOR_BIT, vkData.depthPyramidLevels);
+
+    for (uint32_t i = 0; i < vkData.depthPyramidLevels; ++i) {
+        VkImageSubresourceRange subresourceRange = {
+            .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel   = i,
+            .levelCount     = 1,
+            .baseArrayLayer = 0,
+            .layerCount     = 1
+        };
+
+        vkData.depthPyramidLevelViews[i] = createImageSubresourceView(vkData.device, vkData.depthPyramid,
+                                                                      VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R32_SFLOAT,
+                                                                      subresourceRange);
+    }
+
+    // The pyramid stays in the general layout, it is only ever touched by
+    // compute. The transition is submitted with the next frame instead of
+    // waiting for the queue, one that never got submitted is dropped.
+    if (vkData.depthPyramidInitCommands != VK_NULL_HANDLE)
+        vkFreeCommandBuffers(vkData.device, vkData.commandPool, 1, &vkData.depthPyramidInitCommands);
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel   = 0,
+        .levelCount     = vkData.depthPyramidLevels,
+        .baseArrayLayer = 0,
+        .layerCount     = 1
+    };
+
+    cmdTransitionImageLayout(commandBuffer, vkData.depthPyramid, VK_IMAGE_LAYOUT_UNDEFINED,
+                             VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
+
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+    vkData.depthPyramidInitCommands = commandBuffer;
+
+    // One set per level, each reading the level above it
+    VkDescriptorPoolSize poolSizes[] = {
+        {
+            .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = vkData.depthPyramidLevels
+        }, {
+            .type            = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 2 * vkData.depthPyramidLevels
+        }
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .poolSizeCount = 2,
+        .pPoolSizes    = poolSizes,
+        .maxSets       = vkData.depthPyramidLevels
+    };
+
+    VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.depthPyramidDescriptorPool));
+
+    VkDescriptorSetLayout setLayouts[DEPTH_PYRAMID_MAX_LEVELS];
+    for (uint32_t i = 0; i < vkData.depthPyramidLevels; ++i)
+        setLayouts[i] = vkData.depthReduceSetLayout;
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = vkData.depthPyramidDescriptorPool,
+        .descriptorSetCount = vkData.depthPyramidLevels,
+        .pSetLayouts        = setLayouts
+    };
+
+    VK_CHECK(vkAllocateDescriptorSets(vkData.device, &allocInfo, vkData.depthPyramidSets));
+
+    VkDescriptorImageInfo depthInfo = {
+        .sampler     = vkData.depthPyramidSampler,
+        .imageView   = vkData.depthImageView,
+        .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+    };
+
+    for (uint32_t i = 0; i < vkData.depthPyramidLevels; ++i) {
+        // The first level reads the depth buffer, its source image is unused
+        VkDescriptorImageInfo srcInfo = {
+            .imageView   = vkData.depthPyramidLevelViews[i > 0 ? i - 1 : 0],
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+
+        VkDescriptorImageInfo dstInfo = {
+            .imageView   = vkData.depthPyramidLevelViews[i],
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+
+        VkWriteDescriptorSet descriptorWrites[] = {
+            {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = vkData.depthPyramidSets[i],
+                .dstBinding      = 0,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .descriptorCount = 1,
+                .pImageInfo      = &depthInfo
+            }, {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = vkData.depthPyramidSets[i],
+                .dstBinding      = 1,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .descriptorCount = 1,
+                .pImageInfo      = &srcInfo
+            }, {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = vkData.depthPyramidSets[i],
+                .dstBinding      = 2,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .descriptorCount = 1,
+                .pImageInfo      = &dstInfo
+            }
+        };
+
+        vkUpdateDescriptorSets(vkData.device, 3, descriptorWrites, 0, NULL);
+    }
+
+    VkDescriptorImageInfo pyramidInfo = {
+        .sampler     = vkData.depthPyramidSampler,
+        .imageView   = vkData.depthPyramidView,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+    };
+
+    VkWriteDescriptorSet cullWrite = {
+        .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet          = vkData.cullDescriptorSets[vkData.cullDescriptorSet],
+        .dstBinding      = 7,
+        .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .pImageInfo      = &pyramidInfo
+    };
+
+    vkUpdateDescriptorSets(vkData.device, 1, &cullWrite, 0, NULL);
+}
+
+void cleanupDepthPyramid()
+{
+    if (!vkData.hiZSupported)
+        return;
+
+    if (vkData.depthPyramidInitCommands != VK_NULL_HANDLE)
+        vkFreeCommandBuffers(vkData.device, vkData.commandPool, 1, &vkData.depthPyramidInitCommands);
+
+    vkDestroyDescriptorPool(vkData.device, vkData.depthPyramidDescriptorPool, NULL);
+
+    for (uint32_t i = 0; i < vkData.depthPyramidLevels; ++i)
+        vkDestroyImageView(vkData.device, vkData.depthPyramidLevelViews[i], NULL);
+
+    vkDestroyImageView(vkData.device, vkData.depthPyramidView, NULL);
+    vkDestroyImage(vkData.device, vkData.depthPyramid, NULL);
+    vkFreeMemory(vkData.device, vkData.depthPyramidMemory, NULL);
+}
+
+// Reduces the depth buffer into the pyramid one level per dispatch. The early
+// render pass's dependency makes the depth writes visible, and the pyramid is
+// ready for the late cull pass when this returns.
+void cmdBuildDepthPyramid(VkCommandBuffer commandBuffer)
+{
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.depthReducePipeline);
+
+    VkMemoryBarrier barrier = {
+        .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+    };
+
+    int32_t srcWidth  = vkData.swapchainImageExtent.width;
+    int32_t srcHeight = vkData.swapchainImageExtent.height;
+
+    for (uint32_t i = 0; i < vkData.depthPyramidLevels; ++i) {
+        int32_t dstWidth  = vkData.depthPyramidWidth >> i;
+        int32_t dstHeight = vkData.depthPyramidHeight >> i;
+
+        struct DepthReducePushConstantData reduceConsts = {
+            .srcSize = {srcWidth, srcHeight},
+            .dstSize = {dstWidth > 1 ? dstWidth : 1, dstHeight > 1 ? dstHeight : 1},
+            .level   = i
+        };
+
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.depthReducePipelineLayout,
+                                0, 1, &vkData.depthPyramidSets[i], 0, NULL);
+        vkCmdPushConstants(commandBuffer, vkData.depthReducePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                           0, sizeof(struct DepthReducePushConstantData), &reduceConsts);
+
+        vkCmdDispatch(commandBuffer, (reduceConsts.dstSize[0] + 7) / 8, (reduceConsts.dstSize[1] + 7) / 8, 1);
+
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+
+        srcWidth  = reduceConsts.dstSize[0];
+        srcHeight = reduceConsts.dstSize[1];
+    }
+}
+
+// Builds the mip chain of a VK_FORMAT_R8G8B8A8_UNORM image with compute, up to
+// MIP_GEN_LEVELS_PER_PASS levels per dispatch. Level 0 is expected in baseLayout,
+// the other levels may hold anything. The image must have been created with
+// VK_IMAGE_USAGE_STORAGE_BIT, and every level ends up shader read only. Each
+// texel averages a 2x2 footprint, so the sides must be powers of two.
+void cmdGenerateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout baseLayout,
+                        uint32_t width, uint32_t height, uint32_t layers, uint32_t mipLevels,
+                        bool srgb, MipGenResources *resources)
+{
+    assert(mipLevels <= MIP_GEN_MAX_LEVELS);
+
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel   = 0,
+        .levelCount     = 1,
+        .baseArrayLayer = 0,
+        .layerCount     = layers,
+    };
+
+    cmdTransitionImageLayout(commandBuffer, image, baseLayout, VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
+
+    subresourceRange.baseMipLevel = 1;
+    subresourceRange.levelCount   = mipLevels - 1;
+    cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+                             subresourceRange);
+
+    resources->viewCount = mipLevels;
+    subresourceRange.levelCount = 1;
+    for (uint32_t i = 0; i < mipLevels; ++i) {
+        subresourceRange.baseMipLevel = i;
+        resources->views[i] = createImageSubresourceView(vkData.device, image, VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+                                                         VK_FORMAT_R8G8B8A8_UNORM, subresourceRange);
+    }
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.mipGenPipeline);
+
+    for (uint32_t base = 0; base + 1 < mipLevels; base += MIP_GEN_LEVELS_PER_PASS) {
+        uint32_t levels = mipLevels - 1 - base;
+        if (levels > MIP_GEN_LEVELS_PER_PASS)
+            levels = MIP_GEN_LEVELS_PER_PASS;
+
+        VkDescriptorSetAllocateInfo allocInfo = {
+            .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool     = vkData.mipGenDescriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts        = &vkData.mipGenSetLayout
+        };
+
+        VkDescriptorSet descriptorSet;
+        VK_CHECK(vkAllocateDescriptorSets(vkData.device, &allocInfo, &descriptorSet));
+
+        VkDescriptorImageInfo srcInfo = {
+            .imageView   = resources->views[base],
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+
+        // Unused slots still need valid descriptors, so they repeat the last level
+        VkDescriptorImageInfo dstInfos[MIP_GEN_LEVELS_PER_PASS];
+        for (uint32_t i = 0; i < MIP_GEN_LEVELS_PER_PASS; ++i) {
+            dstInfos[i].sampler     = VK_NULL_HANDLE;
+            dstInfos[i].imageView   = resources->views[base + 1 + (i < levels ? i : levels - 1)];
+            dstInfos[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+
+        VkWriteDescriptorSet descriptorWrites[] = {
+            {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = descriptorSet,
+                .dstBinding      = 0,
+                .dstArrayElement = 0,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .descriptorCount = 1,
+                .pImageInfo      = &srcInfo
+            }, {
+                .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = descriptorSet,
+                .dstBinding      = 1,
+                .dstArrayElement = 0,
+                .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .descriptorCount = MIP_GEN_LEVELS_PER_PASS,
+                .pImageInfo      = dstInfos
+            }
+        };
+
+        vkUpdateDescriptorSets(vkData.device, sizeof(descriptorWrites) / sizeof(descriptorWrites[0]),
+                               descriptorWrites, 0, NULL);
+
+        uint32_t srcWidth  = width >> base > 0 ? width >> base : 1;
+        uint32_t srcHeight = height >> base > 0 ? height >> base : 1;
+
+        struct MipGenPushConstantData pushData = {
+            .srcSize    = {srcWidth, srcHeight},
+            .levelCount = levels,
+            .srgb       = srgb
+        };
+
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.mipGenPipelineLayout,
+                                0, 1, &descriptorSet, 0, NULL);
+        vkCmdPushConstants(commandBuffer, vkData.mipGenPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                           0, sizeof(struct MipGenPushConstantData), &pushData);
+        vkCmdDispatch(commandBuffer, (srcWidth + 63) / 64, (srcHeight + 63) / 64, layers);
+
+        // The last level of this pass is the source of the next one
+        if (base + 1 + levels < mipLevels) {
+            subresourceRange.baseMipLevel = base + levels;
+            cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+                                     subresourceRange);
+        }
+    }
+
+    subresourceRange.baseMipLevel = 0;
+    subresourceRange.levelCount   = mipLevels;
+    cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_GENERAL,
+                             VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange);
+}
+
+void cleanupMipGenResources(MipGenResources *resources)
+{
+    for (uint32_t i = 0; i < resources->viewCount; ++i)
+        vkDestroyImageView(vkData.device, resources->views[i], NULL);
+
+    resources->viewCount = 0;
+
+    vkResetDescriptorPool(vkData.device, vkData.mipGenDescriptorPool, 0);
+}
+
+// Fallback mip chain generation with one blit per level. Level 0 is expected
+// in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL and every level ends up shader read only.
+void cmdGenerateMipmapsBlit(VkCommandBuffer commandBuffer, VkImage image,
+                            uint32_t width, uint32_t height, uint32_t layers, uint32_t mipLevels)
+{
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel   = 0,
+        .levelCount     = 1,
+        .baseArrayLayer = 0,
+        .layerCount     = layers,
+    };
+
+    cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresourceRange);
+
+    for (int32_t i = 1; i < mipLevels; ++i) {
+        VkImageBlit imageBlit = {
+            .srcSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .layerCount = layers,
+                .mipLevel   = i - 1
+            },
+            .srcOffsets[1] = {
+                .x = width >> (i - 1),
+                .y = height >> (i - 1),
+                .z = 1
+            },
+            .dstSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .layerCount = layers,
+                .mipLevel   = i
+            },
+            .dstOffsets[1] = {
+                .x = width >> i,
+                .y = height >> i,
+                .z = 1
+            }
+        };
+
+        VkImageSubresourceRange mipSubRange = {
+            .aspectMask   = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = i,
+            .levelCount   = 1,
+            .layerCount   = layers
+        };
+
+        cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_UNDEFINED,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipSubRange);
+
+        vkCmdBlitImage(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1, &imageBlit, VK_FILTER_LINEAR);
+
+        cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, mipSubRange);
+    }
+
+    subresourceRange.levelCount = mipLevels;
+    cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange);
+}
+
+#ifdef MIP_BENCHMARK
+void benchmarkMipGeneration()
+{
+    const uint32_t iterations = 8;
+    const uint32_t dim        = MIP_BENCHMARK_DIM;
+    const uint32_t mipLevels  = floor(log2(dim)) + 1;
+
+    if (!vkData.mipGenSupported || !vkData.physicalDeviceProps.limits.timestampComputeAndGraphics) {
+        printf("Mip generation benchmark unsupported on this device\n");
+        return;
+    }
+
+    VkImage        image;
+    VkDeviceMemory imageMemory;
+    createImage(vkData.physicalDevice, vkData.device, dim, dim, VK_FORMAT_R8G8B8A8_UNORM,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_SAMPLE_COUNT_1_BIT, mipLevels, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                &image, &imageMemory);
+
+    VkQueryPoolCreateInfo queryPoolInfo = {
+        .sType      = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType  = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 4
+    };
+
+    VkQueryPool queryPool;
+    VK_CHECK(vkCreateQueryPool(vkData.device, &queryPoolInfo, NULL, &queryPool));
+
+    VkImageSubresourceRange baseRange = {
+        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel   = 0,
+        .levelCount     = 1,
+        .baseArrayLayer = 0,
+        .layerCount     = 1,
+    };
+
+    double blitTime = 0.0, computeTime = 0.0;
+
+    for (uint32_t i = 0; i < iterations; ++i) {
+        MipGenResources resources;
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+
+        vkCmdResetQueryPool(commandBuffer, queryPool, 0, 4);
+
+        // The base level contents don't matter for timing, so it's simply discarded each run
+        cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_UNDEFINED,
+                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, baseRange);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 0);
+        cmdGenerateMipmapsBlit(commandBuffer, image, dim, dim, 1, mipLevels);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+
+        cmdTransitionImageLayout(commandBuffer, image, VK_IMAGE_LAYOUT_UNDEFINED,
+                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, baseRange);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 2);
+        cmdGenerateMipmaps(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           dim, dim, 1, mipLevels, false, &resources);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 3);
+
+        endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, commandBuffer);
+        cleanupMipGenResources(&resources);
+
+        uint64_t timestamps[4];
+        VK_CHECK(vkGetQueryPoolResults(vkData.device, queryPool, 0, 4, sizeof(timestamps), timestamps,
+                                       sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+        double period = vkData.physicalDeviceProps.limits.timestampPeriod * 1e-6;
+        blitTime    += (timestamps[1] - timestamps[0]) * period;
+        computeTime += (timestamps[3] - timestamps[2]) * period;
+    }
+
+    printf("Mip generation %ux%u, %u levels: blit %.3f ms, compute %.3f ms\n", dim, dim, mipLevels,
+           blitTime / iterations, computeTime / iterations);
+
+    vkDestroyQueryPool(vkData.device, queryPool, NULL);
+    vkDestroyImage(vkData.device, image, NULL);
+    vkFreeMemory(vkData.device, imageMemory, NULL);
+}
+#endif // MIP_BENCHMARK
+
+#ifdef LINMATH_BENCHMARK
+static float benchmarkRandom()
+{
+    return 2.0f * rand() / RAND_MAX - 1.0f;
+}
+
+static vec3_soa benchmarkPoints(size_t count)
+{
+    size_t size = (count * sizeof(float) + LINMATH_BATCH_ALIGN - 1) & ~(size_t)(LINMATH_BATCH_ALIGN - 1);
+    vec3_soa points = {
+        aligned_alloc(LINMATH_BATCH_ALIGN, size),
+        aligned_alloc(LINMATH_BATCH_ALIGN, size),
+        aligned_alloc(LINMATH_BATCH_ALIGN, size)
+    };
+
+    for (size_t i = 0; i < count; i++) {
+        points.x[i] = benchmarkRandom();
+        points.y[i] = benchmarkRandom();
+        points.z[i] = benchmarkRandom();
+    }
+
+    return points;
+}
+
+static void benchmarkFreePoints(vec3_soa points)
+{
+    free(points.x);
+    free(points.y);
+    free(points.z);
+}
+
+// Scalar baselines for the batch calls, written the way the AoS code would
+static void benchmarkPointsScalar(vec4 *out, mat4x4 M, vec3_soa points, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        vec4 point = {points.x[i], points.y[i], points.z[i], 1.0f};
+        mat4x4_mul_vec4_scalar(out[i], M, point);
+    }
+}
+
+static void benchmarkAabbsScalar(vec4 *out, mat4x4 M, vec3_soa boxMin, vec3_soa boxMax, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        vec4 center = {
+            0.5f * (boxMin.x[i] + boxMax.x[i]),
+            0.5f * (boxMin.y[i] + boxMax.y[i]),
+            0.5f * (boxMin.z[i] + boxMax.z[i]),
+            1.0f
+        };
+        vec4 extent = {
+            0.5f * (boxMax.x[i] - boxMin.x[i]),
+            0.5f * (boxMax.y[i] - boxMin.y[i]),
+            0.5f * (boxMax.z[i] - boxMin.z[i]),
+            0.0f
+        };
+        mat4x4 absM;
+        for (int j = 0; j < 16; j++)
+            absM[j / 4][j % 4] = fabsf(M[j / 4][j % 4]);
+
+        vec4 c, r;
+        mat4x4_mul_vec4_scalar(c, M, center);
+        mat4x4_mul_vec4_scalar(r, absM, extent);
+        vec4_sub(out[i], c, r);
+    }
+}
+
+static size_t benchmarkSpheresScalar(uint8_t *visible, vec4 planes[6], vec3_soa centers, float *radii,
+                                     size_t count)
+{
+    size_t visibleCount = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        vec4 center = {centers.x[i], centers.y[i], centers.z[i], 1.0f};
+
+        visible[i] = 1;
+        for (int p = 0; p < 6; p++) {
+            if (vec4_mul_inner(planes[p], center) + radii[i] < 0.0f) {
+                visible[i] = 0;
+                break;
+            }
+        }
+        visibleCount += visible[i];
+    }
+
+    return visibleCount;
+}
+
+// Times LINMATH_BENCHMARK_ROUNDS runs of the scalar and then the SIMD
+// statement. The checksum keeps the compiler from dropping the work.
+#define LINMATH_BENCHMARK_CASE(name, scalar, simd)                                   \
+    do {                                                                             \
+        double start = glfwGetTime();                                                \
+        for (int round = 0; round < LINMATH_BENCHMARK_ROUNDS; round++)               \
+            scalar;                                                                  \
+        double scalarTime = glfwGetTime() - start;                                   \
+        checksum += results[count - 1][0][0];                                        \
+                                                                                     \
+        start = glfwGetTime();                                                       \
+        for (int round = 0; round < LINMATH_BENCHMARK_ROUNDS; round++)               \
+            simd;                                                                    \
+        double simdTime = glfwGetTime() - start;                                     \
+        checksum += results[count - 1][0][0];                                        \
+                                                                                     \
+        printf("%-16s scalar %8.3f ms, simd %8.3f ms, %.2fx\n", name,                \
+               1000.0 * scalarTime, 1000.0 * simdTime, scalarTime / simdTime);       \
+    } while (0)
+
+void benchmarkLinmath()
+{
+    const size_t count = LINMATH_BENCHMARK_COUNT;
+
+    mat4x4  *a       = malloc(count * sizeof(mat4x4));
+    mat4x4  *b       = malloc(count * sizeof(mat4x4));
+    mat4x4  *results = malloc(count * sizeof(mat4x4));
+    vec4    *vectors = malloc(count * sizeof(vec4));
+    quat    *quats   = malloc(count * sizeof(quat));
+    uint8_t *visible = malloc(count);
+
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 0; j < 16; j++) {
+            a[i][j / 4][j % 4] = benchmarkRandom();
+            b[i][j / 4][j % 4] = benchmarkRandom();
+        }
+        // Keep the matrices well away from singular for the inverse
+        for (int j = 0; j < 4; j++)
+            a[i][j][j] += 4.0f;
+
+        for (int j = 0; j < 4; j++) {
+            vectors[i][j] = benchmarkRandom();
+            quats[i][j]   = benchmarkRandom();
+        }
+        quat_norm(quats[i], quats[i]);
+    }
+
+    vec3_soa points = benchmarkPoints(count);
+    vec3_soa boxMin = benchmarkPoints(count);
+    vec3_soa boxMax = benchmarkPoints(count);
+    vec3_soa outMin = benchmarkPoints(count);
+    vec3_soa outMax = benchmarkPoints(count);
+    vec3_soa sizes  = benchmarkPoints(count);
+
+    // Reuse the x coordinates of one set as sphere radii
+    float *radii = sizes.x;
+    for (size_t i = 0; i < count; i++) {
+        boxMax.x[i] = boxMin.x[i] + fabsf(boxMax.x[i]);
+        boxMax.y[i] = boxMin.y[i] + fabsf(boxMax.y[i]);
+        boxMax.z[i] = boxMin.z[i] + fabsf(boxMax.z[i]);
+        radii[i]    = 0.1f * fabsf(radii[i]);
+    }
+
+    vec4 planes[6];
+    for (int p = 0; p < 6; p++) {
+        vec3 normal = {benchmarkRandom(), benchmarkRandom(), benchmarkRandom()};
+        vec3_norm(planes[p], normal);
+        planes[p][3] = 0.5f;
+    }
+
+    float checksum = 0.0f;
+    printf("linmath benchmark, %zu elements x %d rounds, %d batch lanes\n", count,
+           LINMATH_BENCHMARK_ROUNDS, LINMATH_BATCH_LANES);
+
+    LINMATH_BENCHMARK_CASE("mat4x4_mul",
+        for (size_t i = 0; i < count; i++) mat4x4_mul_scalar(results[i], a[i], b[i]),
+        mat4x4_mul_batch(results, a, b, count));
+
+    LINMATH_BENCHMARK_CASE("mat4x4_mul_vec4",
+        for (size_t i = 0; i < count; i++) mat4x4_mul_vec4_scalar(results[i][0], a[i], vectors[i]),
+        for (size_t i = 0; i < count; i++) mat4x4_mul_vec4(results[i][0], a[i], vectors[i]));
+
+    LINMATH_BENCHMARK_CASE("mat4x4_invert",
+        for (size_t i = 0; i < count; i++) mat4x4_invert_scalar(results[i], a[i]),
+        for (size_t i = 0; i < count; i++) mat4x4_invert(results[i], a[i]));
+
+    LINMATH_BENCHMARK_CASE("quat_mul_vec3",
+        for (size_t i = 0; i < count; i++) quat_mul_vec3_scalar(results[i][0], quats[i], vectors[i]),
+        for (size_t i = 0; i < count; i++) quat_mul_vec3(results[i][0], quats[i], vectors[i]));
+
+    LINMATH_BENCHMARK_CASE("points",
+        benchmarkPointsScalar(results[0], a[0], points, count),
+        mat4x4_mul_points_soa(outMin, a[0], points, count));
+
+    LINMATH_BENCHMARK_CASE("aabbs",
+        benchmarkAabbsScalar(results[0], a[0], boxMin, boxMax, count),
+        mat4x4_mul_aabbs_soa(outMin, outMax, a[0], boxMin, boxMax, count));
+
+    LINMATH_BENCHMARK_CASE("spheres",
+        checksum += benchmarkSpheresScalar(visible, planes, points, radii, count),
+        checksum += frustum_test_spheres_soa(visible, planes, points, radii, count));
+
+    printf("linmath benchmark checksum %f\n", checksum + outMin.x[0] + outMax.x[0]);
+
+    benchmarkFreePoints(sizes);
+    benchmarkFreePoints(outMax);
+    benchmarkFreePoints(outMin);
+    benchmarkFreePoints(boxMax);
+    benchmarkFreePoints(boxMin);
+    benchmarkFreePoints(points);
+    free(visible);
+    free(quats);
+    free(vectors);
+    free(results);
+    free(b);
+    free(a);
+}
+#endif // LINMATH_BENCHMARK
+
+// What a texture upload uses until its command buffer has finished
+typedef struct {
+    VkBuffer        stagingBuffer;
+    VkDeviceMemory  stagingBufferMemory;
+    bool            computeMips;
+    MipGenResources mipGenResources;
+} TextureUpload;
+
+// Creates the image and view and records the upload and mip generation,
+// finishTextureUpload() frees the rest once the commands have executed
+void cmdUploadTextureArray(VkCommandBuffer commandBuffer, TextureArray *array, VtdPackArray *src,
+                           uint32_t reqMipLevels, bool srgb, TextureUpload *upload)
+{
+    array->width      = src->width;
+    array->height     = src->height;
+    array->layerCount = src->layerCount;
+
+    VkDeviceSize imageSize = (VkDeviceSize) src->width * src->height * src->layerCount * 4;
+
+    createBuffer(vkData.physicalDevice, vkData.device, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &upload->stagingBuffer, &upload->stagingBufferMemory);
+
+    void *data;
+    vkMapMemory(vkData.device, upload->stagingBufferMemory, 0, imageSize, 0, &data);
+    memcpy(data, src->pixels, imageSize);
+    vkUnmapMemory(vkData.device, upload->stagingBufferMemory);
+
+    uint32_t mipLevels = floor(log2(src->width > src->height ? src->width : src->height)) + 1;
+
+    if (reqMipLevels > 0 && reqMipLevels < mipLevels)
+        mipLevels = reqMipLevels;
+
+    if (src->atlas && mipLevels > ATLAS_MIP_LEVELS)
+        mipLevels = ATLAS_MIP_LEVELS;
+
+    array->mipLevels = mipLevels;
+
+    // Odd sized levels would need a 3 texel footprint, the blit handles those
+    bool powerOfTwo  = (src->width & (src->width - 1)) == 0 && (src->height & (src->height - 1)) == 0;
+    bool computeMips = mipLevels > 1 && vkData.mipGenSupported && powerOfTwo;
+    upload->computeMips = computeMips;
+
+    VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    if (computeMips)
+        usageFlags |= VK_IMAGE_USAGE_STORAGE_BIT;
+    else if (mipLevels > 1)
+        usageFlags |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+    createImageArray(vkData.physicalDevice, vkData.device, src->width, src->height, src->layerCount,
+                     VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, usageFlags,
+                     VK_SAMPLE_COUNT_1_BIT, mipLevels, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &array->image, &array->imageMemory);
+
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel   = 0,
+        .levelCount     = 1,
+        .baseArrayLayer = 0,
+        .layerCount     = src->layerCount,
+    };
+
+    cmdTransitionImageLayout(commandBuffer, array->image, VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresourceRange);
+
+    cmdCopyBufferToImageArray(commandBuffer, upload->stagingBuffer, array->image, src->width, src->height,
+                              src->layerCount);
+
+    upload->mipGenResources = (MipGenResources) {};
+
+    if (computeMips)
+        cmdGenerateMipmaps(commandBuffer, array->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           src->width, src->height, src->layerCount, mipLevels, srgb, &upload->mipGenResources);
+    else if (mipLevels > 1)
+        cmdGenerateMipmapsBlit(commandBuffer, array->image, src->width, src->height, src->layerCount, mipLevels);
+    else
+        cmdTransitionImageLayout(commandBuffer, array->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                 VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresourceRange);
+
+    subresourceRange.levelCount = mipLevels;
+    array->imageView = createImageSubresourceView(vkData.device, array->image, VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+                                                  VK_FORMAT_R8G8B8A8_UNORM, subresourceRange);
+}
+
+void finishTextureUpload(TextureUpload *upload)
+{
+    if (upload->computeMips)
+        cleanupMipGenResources(&upload->mipGenResources);
+
+    vkDestroyBuffer(vkData.device, upload->stagingBuffer, NULL);
+    vkFreeMemory(vkData.device, upload->stagingBufferMemory, NULL);
+}
+
+void createTextureArray(TextureArray *array, VtdPackArray *src, uint32_t reqMipLevels, bool srgb)
+{
+    TextureUpload upload;
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+
+    cmdUploadTextureArray(commandBuffer, array, src, reqMipLevels, srgb, &upload);
+
+    endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, commandBuffer);
+    finishTextureUpload(&upload);
+}
+
+void cleanupTextureArray(TextureArray *array)
+{
+    vkDestroySampler(vkData.device, array->sampler, NULL);
+    vkDestroyImageView(vkData.device, array->imageView, NULL);
+    vkDestroyImage(vkData.device, array->image, NULL);
+    vkFreeMemory(vkData.device, array->imageMemory, NULL);
+}
+
+void createTextureSampler(VkSampler *sampler, uint32_t mipLevels)
+{
+    VkSamplerCreateInfo samplerInfo = {
         .sType                   = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .magFilter               = VK_FILTER_LINEAR,
         .minFilter               = VK_FILTER_LINEAR,
@@ -1582,464 +3705,2584 @@ void createTextureSampler(VkSampler *sampler, uint32_t mipLevels)
         .maxLod                  = mipLevels
     };
 
-    VK_CHECK(vkCreateSampler(vkData.device, &samplerInfo, NULL, sampler));
+    VK_CHECK(vkCreateSampler(vkData.device, &samplerInfo, NULL, sampler));
+}
+
+AssetPack assetPack;
+
+// Returns the contents of an asset, pointing into the asset pack if it's
+// stored there. Free *owned once done with it, it's NULL for packed data.
+const char *getAssetData(const char *path, size_t *length, char **owned)
+{
+    const char *data = assetPackGet(&assetPack, path, length, owned);
+    if (data)
+        return data;
+
+    *owned = getFileData(path, length);
+
+    return *owned;
+}
+
+DerivedCache derivedCache;
+
+// Everything a conversion depends on besides the source, for the derived
+// cache key. Bump the version whenever the conversion's output changes.
+typedef struct {
+    char     type[8];
+    uint32_t version;
+    uint32_t option;
+    uint32_t elementSize; // Of what it outputs, so a layout change misses
+} ConversionParams;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+} CachedTextureHeader;
+
+void decodeTexture(VtdData *image, const char *data, size_t dataLen)
+{
+    ConversionParams params = {
+        .type        = "texture",
+        .version     = 1,
+        .option      = VTD_rgb_alpha,
+        .elementSize = sizeof(uint8_t)
+    };
+    DerivedCacheKey key;
+    size_t cachedSize;
+    char *cached = NULL;
+
+    if (derivedCacheEnabled(&derivedCache)) {
+        derivedCacheKey(&key, data, dataLen, &params, sizeof(params));
+        cached = derivedCacheGet(&derivedCache, &key, &cachedSize);
+    }
+
+    // Anything that doesn't hold exactly the pixels it claims is converted again
+    CachedTextureHeader header;
+    bool valid = false;
+
+    if (cached && cachedSize >= sizeof(header)) {
+        memcpy(&header, cached, sizeof(header));
+        valid = cachedSize - sizeof(header) == (size_t) header.width * header.height * header.channels;
+    }
+
+    if (cached && !valid) {
+        free(cached);
+        cached = NULL;
+    }
+
+    if (cached) {
+        image->width    = header.width;
+        image->height   = header.height;
+        image->channels = header.channels;
+        image->pixels   = malloc(cachedSize - sizeof(header));
+        memcpy(image->pixels, cached + sizeof(header), cachedSize - sizeof(header));
+
+        free(cached);
+        return;
+    }
+
+    loadVtd(data, dataLen, image);
+    vtdConvert(image, VTD_rgb_alpha);
+
+    if (derivedCacheEnabled(&derivedCache) && image->pixels) {
+        header = (CachedTextureHeader) {
+            .width    = image->width,
+            .height   = image->height,
+            .channels = image->channels
+        };
+        size_t pixelSize = (size_t) image->width * image->height * image->channels;
+
+        cachedSize = sizeof(header) + pixelSize;
+        cached = malloc(cachedSize);
+        memcpy(cached, &header, sizeof(header));
+        memcpy(cached + sizeof(header), image->pixels, pixelSize);
+
+        derivedCachePut(&derivedCache, &key, cached, cachedSize);
+        free(cached);
+    }
+}
+
+void loadTexture(VtdData *image, const char *texturePath)
+{
+    size_t dataLen;
+    char *owned;
+    const char *data = getAssetData(texturePath, &dataLen, &owned);
+
+    decodeTexture(image, data, dataLen);
+    free(owned);
+}
+
+void convertMeshGeometry(Mesh *mesh, const char *data, size_t dataLen)
+{
+    VmdData vmd;
+    loadVmd(&vmd, data, dataLen);
+
+    mesh->vertexCount = vmd.vertexCount;
+    mesh->indexCount  = vmd.indexCount;
+
+    mesh->vertices = malloc(vmd.vertexCount * sizeof(Vertex));
+    mesh->indices  = malloc(vmd.indexCount * sizeof(uint32_t));
+
+    size_t vertFloats = vmdVertexComponents(&vmd);
+
+    // Attributes follow the position in mask bit order, missing ones get
+    // defaults and the pipeline variant ignores them
+    size_t normalOff = 3;
+    size_t colorOff  = normalOff + (vmd.vertexMask & VMD_VERTEX_NORMAL_BIT ? 3 : 0);
+    size_t texOff    = colorOff + (vmd.vertexMask & VMD_VERTEX_COLOR_BIT ? 3 : 0);
+
+    for (size_t i = 0; i < vmd.vertexCount; ++i) {
+        const float *src = vmd.vertices + vertFloats * i;
+        Vertex v = {
+            .pos      = {src[0], src[1], src[2]},
+            .normal   = {0.0f, 0.0f, 0.0f},
+            .color    = {1.0f, 1.0f, 1.0f},
+            .texCoord = {0.0f, 0.0f}
+        };
+
+        if (vmd.vertexMask & VMD_VERTEX_NORMAL_BIT)
+            memcpy(v.normal, src + normalOff, sizeof(vec3));
+        if (vmd.vertexMask & VMD_VERTEX_COLOR_BIT)
+            memcpy(v.color, src + colorOff, sizeof(vec3));
+        if (vmd.vertexMask & VMD_VERTEX_TEXCOORD_BIT)
+            memcpy(v.texCoord, src + texOff, sizeof(vec2));
+
+        mesh->vertices[i] = v;
+    }
+
+    mesh->variant = vmd.vertexMask & (VARIANT_NORMAL_BIT | VARIANT_COLOR_BIT | VARIANT_TEXCOORD_BIT);
+    if (SPECULAR_LIGHTING)
+        mesh->variant |= VARIANT_SPECULAR_BIT;
+
+    memcpy(mesh->indices, vmd.indices, vmd.indexCount * sizeof(uint32_t));
+
+    // Bounding sphere around the center of the bounding box
+    vec3 minPos = {INFINITY, INFINITY, INFINITY}, maxPos = {-INFINITY, -INFINITY, -INFINITY};
+    for (size_t i = 0; i < mesh->vertexCount; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            minPos[j] = fminf(minPos[j], mesh->vertices[i].pos[j]);
+            maxPos[j] = fmaxf(maxPos[j], mesh->vertices[i].pos[j]);
+        }
+    }
+
+    vec3 center;
+    vec3_add(center, minPos, maxPos);
+    vec3_scale(center, center, 0.5f);
+
+    float radius = 0.0f;
+    for (size_t i = 0; i < mesh->vertexCount; ++i) {
+        vec3 d;
+        vec3_sub(d, mesh->vertices[i].pos, center);
+        radius = fmaxf(radius, vec3_len(d));
+    }
+
+    memcpy(mesh->boundingSphere, center, sizeof(vec3));
+    mesh->boundingSphere[3] = radius;
+    memcpy(mesh->boundsMin, minPos, sizeof(vec3));
+    memcpy(mesh->boundsMax, maxPos, sizeof(vec3));
+
+    vmdFree(&vmd);
+}
+
+typedef struct {
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t variant;
+    vec4     boundingSphere;
+    vec3     boundsMin;
+    vec3     boundsMax;
+} CachedMeshHeader;
+
+void decodeMeshGeometry(Mesh *mesh, const char *data, size_t dataLen)
+{
+    ConversionParams params = {
+        .type        = "mesh",
+        .version     = 1,
+        .option      = SPECULAR_LIGHTING,
+        .elementSize = sizeof(Vertex)
+    };
+    DerivedCacheKey key;
+    size_t cachedSize;
+    char *cached = NULL;
+
+    if (derivedCacheEnabled(&derivedCache)) {
+        derivedCacheKey(&key, data, dataLen, &params, sizeof(params));
+        cached = derivedCacheGet(&derivedCache, &key, &cachedSize);
+    }
+
+    // Anything that doesn't hold exactly the vertices and indices it claims is
+    // converted again
+    CachedMeshHeader header;
+    bool valid = false;
+
+    if (cached && cachedSize >= sizeof(header)) {
+        memcpy(&header, cached, sizeof(header));
+        valid = cachedSize - sizeof(header) == (size_t) header.vertexCount * sizeof(Vertex)
+                                               + (size_t) header.indexCount * sizeof(uint32_t);
+    }
+
+    if (cached && !valid) {
+        free(cached);
+        cached = NULL;
+    }
+
+    if (cached) {
+        mesh->vertexCount = header.vertexCount;
+        mesh->indexCount  = header.indexCount;
+        mesh->variant     = header.variant;
+        memcpy(mesh->boundingSphere, header.boundingSphere, sizeof(vec4));
+        memcpy(mesh->boundsMin, header.boundsMin, sizeof(vec3));
+        memcpy(mesh->boundsMax, header.boundsMax, sizeof(vec3));
+
+        mesh->vertices = malloc(mesh->vertexCount * sizeof(Vertex));
+        mesh->indices  = malloc(mesh->indexCount * sizeof(uint32_t));
+
+        const char *src = cached + sizeof(header);
+        memcpy(mesh->vertices, src, mesh->vertexCount * sizeof(Vertex));
+        memcpy(mesh->indices, src + mesh->vertexCount * sizeof(Vertex), mesh->indexCount * sizeof(uint32_t));
+
+        free(cached);
+        return;
+    }
+
+    convertMeshGeometry(mesh, data, dataLen);
+
+    if (derivedCacheEnabled(&derivedCache)) {
+        header = (CachedMeshHeader) {
+            .vertexCount = mesh->vertexCount,
+            .indexCount  = mesh->indexCount,
+            .variant     = mesh->variant
+        };
+        memcpy(header.boundingSphere, mesh->boundingSphere, sizeof(vec4));
+        memcpy(header.boundsMin, mesh->boundsMin, sizeof(vec3));
+        memcpy(header.boundsMax, mesh->boundsMax, sizeof(vec3));
+
+        size_t vertexSize = mesh->vertexCount * sizeof(Vertex);
+        size_t indexSize  = mesh->indexCount * sizeof(uint32_t);
+
+        cachedSize = sizeof(header) + vertexSize + indexSize;
+        cached = malloc(cachedSize);
+        memcpy(cached, &header, sizeof(header));
+        memcpy(cached + sizeof(header), mesh->vertices, vertexSize);
+        memcpy(cached + sizeof(header) + vertexSize, mesh->indices, indexSize);
+
+        derivedCachePut(&derivedCache, &key, cached, cachedSize);
+        free(cached);
+    }
+}
+
+void loadMeshGeometry(Mesh *mesh, const char *meshPath)
+{
+    size_t dataLen;
+    char *owned;
+    const char *data = getAssetData(meshPath, &dataLen, &owned);
+
+    decodeMeshGeometry(mesh, data, dataLen);
+    free(owned);
+}
+
+// A unit cube with normals, drawn in place of a mesh that is still loading
+void loadPlaceholderMesh(Mesh *mesh)
+{
+    static const vec3 normals[6] = {
+        { 1.0f,  0.0f,  0.0f}, {-1.0f,  0.0f,  0.0f},
+        { 0.0f,  1.0f,  0.0f}, { 0.0f, -1.0f,  0.0f},
+        { 0.0f,  0.0f,  1.0f}, { 0.0f,  0.0f, -1.0f}
+    };
+
+    mesh->vertexCount = 24;
+    mesh->indexCount  = 36;
+    mesh->vertices    = malloc(mesh->vertexCount * sizeof(Vertex));
+    mesh->indices     = malloc(mesh->indexCount * sizeof(uint32_t));
+
+    for (uint32_t face = 0; face < 6; ++face) {
+        // u x v == n, so the corners go counter clockwise seen from outside
+        vec3 n, u = {normals[face][2], normals[face][0], normals[face][1]}, v;
+        memcpy(n, normals[face], sizeof(vec3));
+        vec3_mul_cross(v, n, u);
+
+        for (uint32_t corner = 0; corner < 4; ++corner) {
+            float su = corner == 1 || corner == 2 ? 0.5f : -0.5f;
+            float sv = corner >= 2 ? 0.5f : -0.5f;
+            Vertex *vertex = &mesh->vertices[4 * face + corner];
+
+            *vertex = (Vertex) {
+                .color    = {1.0f, 1.0f, 1.0f},
+                .texCoord = {su + 0.5f, sv + 0.5f}
+            };
+
+            for (int k = 0; k < 3; ++k)
+                vertex->pos[k] = 0.5f * n[k] + su * u[k] + sv * v[k];
+            memcpy(vertex->normal, n, sizeof(vec3));
+        }
+
+        uint32_t quad[6] = {0, 1, 2, 0, 2, 3};
+        for (uint32_t i = 0; i < 6; ++i)
+            mesh->indices[6 * face + i] = 4 * face + quad[i];
+    }
+
+    mesh->variant = VARIANT_NORMAL_BIT;
+    if (SPECULAR_LIGHTING)
+        mesh->variant |= VARIANT_SPECULAR_BIT;
+
+    mesh->boundingSphere[0] = 0.0f;
+    mesh->boundingSphere[1] = 0.0f;
+    mesh->boundingSphere[2] = 0.0f;
+    mesh->boundingSphere[3] = sqrtf(0.75f);
+
+    for (int k = 0; k < 3; ++k) {
+        mesh->boundsMin[k] = -0.5f;
+        mesh->boundsMax[k] = 0.5f;
+    }
+}
+
+void cleanupMesh(Mesh *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->occluderPositions);
+    free(mesh->occluderIndices);
+}
+
+// Copies data to the start of a device local buffer through a staging buffer
+void uploadBuffer(VkBuffer buffer, const void *data, VkDeviceSize size)
+{
+    VkBuffer       stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    createBuffer(vkData.physicalDevice, vkData.device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &stagingBuffer, &stagingBufferMemory);
+
+    void *mapped;
+    vkMapMemory(vkData.device, stagingBufferMemory, 0, size, 0, &mapped);
+    memcpy(mapped, data, size);
+    vkUnmapMemory(vkData.device, stagingBufferMemory);
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+
+    cmdCopyBuffer(commandBuffer, stagingBuffer, buffer, size);
+
+    endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, commandBuffer);
+
+    vkDestroyBuffer(vkData.device, stagingBuffer, NULL);
+    vkFreeMemory(vkData.device, stagingBufferMemory, NULL);
+}
+
+// Scene buffer writes recorded between frames, submitted ahead of the next
+// frame's commands instead of waiting for the queue. The staging buffers are
+// retired once that frame is submitted.
+struct {
+    VkCommandBuffer commandBuffer;
+    VkBuffer       *stagingBuffers;
+    VkDeviceMemory *stagingMemories;
+    size_t          count;
+    size_t          capacity;
+} sceneUploads;
+
+// Copies data to the start of a device local buffer the frames read. The
+// frames submitted so far must be finished with the buffer.
+void queueSceneUpload(VkBuffer buffer, const void *data, VkDeviceSize size)
+{
+    if (sceneUploads.count == sceneUploads.capacity) {
+        sceneUploads.capacity        = sceneUploads.capacity ? 2 * sceneUploads.capacity : 4;
+        sceneUploads.stagingBuffers  = realloc(sceneUploads.stagingBuffers,
+                                               sceneUploads.capacity * sizeof(VkBuffer));
+        sceneUploads.stagingMemories = realloc(sceneUploads.stagingMemories,
+                                               sceneUploads.capacity * sizeof(VkDeviceMemory));
+    }
+
+    VkBuffer       *stagingBuffer       = &sceneUploads.stagingBuffers[sceneUploads.count];
+    VkDeviceMemory *stagingBufferMemory = &sceneUploads.stagingMemories[sceneUploads.count];
+    createBuffer(vkData.physicalDevice, vkData.device, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 stagingBuffer, stagingBufferMemory);
+    sceneUploads.count++;
+
+    void *mapped;
+    vkMapMemory(vkData.device, *stagingBufferMemory, 0, size, 0, &mapped);
+    memcpy(mapped, data, size);
+    vkUnmapMemory(vkData.device, *stagingBufferMemory);
+
+    if (sceneUploads.commandBuffer == VK_NULL_HANDLE)
+        sceneUploads.commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+
+    cmdCopyBuffer(sceneUploads.commandBuffer, *stagingBuffer, buffer, size);
+}
+
+// Creates a device local buffer holding a copy of data
+void createDeviceLocalBuffer(VkBuffer *buffer, VkDeviceMemory *memory, VkBufferUsageFlags usage,
+                             const void *data, VkDeviceSize size)
+{
+    createBuffer(vkData.physicalDevice, vkData.device, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
+
+    uploadBuffer(*buffer, data, size);
+}
+
+// Uploads the geometry of every mesh into one vertex and one index buffer.
+// Meshes loaded later are appended to copies of the buffers, which is why
+// they can be a transfer source.
+void createGeometryBuffers()
+{
+    const Mesh *last = &meshes[meshCount - 1];
+    size_t vertexCount = last->vertexOffset + last->vertexCount;
+    size_t indexCount  = last->firstIndex + last->indexCount;
+
+    Vertex   *vertices = malloc(vertexCount * sizeof(Vertex));
+    uint32_t *indices  = malloc(indexCount * sizeof(uint32_t));
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        memcpy(vertices + meshes[i].vertexOffset, meshes[i].vertices, meshes[i].vertexCount * sizeof(Vertex));
+        memcpy(indices + meshes[i].firstIndex, meshes[i].indices, meshes[i].indexCount * sizeof(uint32_t));
+    }
+
+    createDeviceLocalBuffer(&vkData.vertexBuffer, &vkData.vertexBufferMemory,
+                            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                            vertices, vertexCount * sizeof(Vertex));
+    createDeviceLocalBuffer(&vkData.indexBuffer, &vkData.indexBufferMemory,
+                            VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                            indices, indexCount * sizeof(uint32_t));
+
+    vkData.vertexCount = vertexCount;
+    vkData.indexCount  = indexCount;
+
+    free(vertices);
+    free(indices);
+}
+
+void createTextureDescriptorSet(TextureArray *array)
+{
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = vkData.textureDescriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts        = &vkData.textureSetLayout
+    };
+
+    VK_CHECK(vkAllocateDescriptorSets(vkData.device, &allocInfo, &array->descriptorSet));
+
+    VkDescriptorImageInfo imageInfo = {
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .imageView   = array->imageView,
+        .sampler     = array->sampler
+    };
+
+    VkWriteDescriptorSet descriptorWrite = {
+        .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet           = array->descriptorSet,
+        .dstBinding       = 0,
+        .dstArrayElement  = 0,
+        .descriptorType   = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount  = 1,
+        .pImageInfo       = &imageInfo
+    };
+
+    vkUpdateDescriptorSets(vkData.device, 1, &descriptorWrite, 0, NULL);
+}
+
+// Writes a single element of the bindless texture array, this is legal while
+// the set is bound in pending command buffers thanks to update-after-bind
+void writeBindlessTexture(uint32_t index, TextureArray *array)
+{
+    if (index >= vkData.bindlessMaxTextures)
+        ERR_EXIT("Bindless texture limit of %u reached\n", vkData.bindlessMaxTextures);
+
+    VkDescriptorImageInfo imageInfo = {
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .imageView   = array->imageView,
+        .sampler     = array->sampler
+    };
+
+    VkWriteDescriptorSet descriptorWrite = {
+        .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet           = vkData.descriptorSet,
+        .dstBinding       = 3,
+        .dstArrayElement  = index,
+        .descriptorType   = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount  = 1,
+        .pImageInfo       = &imageInfo
+    };
+
+    vkUpdateDescriptorSets(vkData.device, 1, &descriptorWrite, 0, NULL);
+}
+
+// The mesh is only recorded here, loadMeshes() loads every mesh at once
+uint32_t addMesh(const char *meshPath)
+{
+    meshes = realloc(meshes, (meshCount + 1) * sizeof(Mesh));
+    memset(&meshes[meshCount], 0, sizeof(Mesh));
+    meshes[meshCount].path = meshPath;
+
+    return meshCount++;
+}
+
+static void decodeMeshFile(FileBatchEntry *entry, size_t index, void *user)
+{
+    if (!entry->data)
+        ERR_EXIT("Failed to load mesh %s\n", entry->path);
+
+    size_t *meshIndices = user;
+    decodeMeshGeometry(&meshes[meshIndices[index]], entry->data, entry->size);
+    free(entry->data);
+}
+
+void loadMeshes()
+{
+    // Packed meshes need no reads. The files of the others are read at once,
+    // each decoded as soon as it arrives.
+    FileBatchEntry *entries = malloc(meshCount * sizeof(FileBatchEntry));
+    size_t *meshIndices = malloc(meshCount * sizeof(size_t));
+    size_t fileCount = 0;
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        if (meshes[i].loading) {
+            loadPlaceholderMesh(&meshes[i]);
+            continue;
+        }
+
+        if (assetPackFind(&assetPack, meshes[i].path)) {
+            loadMeshGeometry(&meshes[i], meshes[i].path);
+            continue;
+        }
+
+        entries[fileCount].path = meshes[i].path;
+        meshIndices[fileCount++] = i;
+    }
+
+    fileBatchRead(entries, fileCount, DIRECT_IO ? FILE_BATCH_DIRECT : 0, decodeMeshFile, meshIndices);
+
+    free(meshIndices);
+    free(entries);
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        Mesh *mesh = &meshes[i];
+
+        // Meshes are laid out back to back, createGeometryBuffers() uploads them
+        if (i > 0) {
+            Mesh *previous = &meshes[i - 1];
+            mesh->vertexOffset = previous->vertexOffset + previous->vertexCount;
+            mesh->firstIndex   = previous->firstIndex + previous->indexCount;
+        }
+    }
+}
+
+// The texture is only recorded here, loadTextures() packs every material's texture at once
+uint32_t addMaterial(const char *texturePath)
+{
+    materials = realloc(materials, (materialCount + 1) * sizeof(Material));
+    materials[materialCount].texturePath = texturePath;
+    materials[materialCount].loading     = false;
+
+    return materialCount++;
+}
+
+void addInstance(uint32_t mesh, uint32_t material, vec3 pos, vec3 scale)
+{
+    if (instanceCount >= MAX_INSTANCES)
+        ERR_EXIT("Instance limit of %u reached\n", MAX_INSTANCES);
+
+    instances = realloc(instances, (instanceCount + 1) * sizeof(Instance));
+    Instance *instance = &instances[instanceCount++];
+
+    quat rot;
+    quat_identity(rot);
+
+    instance->mesh      = mesh;
+    instance->material  = material;
+    instance->transform = transformAdd(&transforms, TRANSFORM_NONE, pos, rot, scale);
+}
+
+typedef enum {
+    ASSET_MESH,
+    ASSET_TEXTURE
+} AssetType;
+
+// A mesh or texture read and decoded on a loader thread, then uploaded and
+// swapped in for its placeholder by updateAssetLoads()
+typedef struct {
+    AssetType   type;
+    uint32_t    index; // Of the mesh or material
+    const char *path;
+
+    // Written by the loader thread
+    bool    decoded;
+    Mesh    mesh;
+    VtdData image;
+} AssetLoad;
+
+AssetLoader assetLoader;
+
+// Decoded loads waiting for an upload, and how many loads have been
+// requested but not swapped in yet
+struct {
+    AssetLoad **ready;
+    size_t      readyCount;
+    size_t      readyCapacity;
+    size_t      remaining;
+} assetLoads;
+
+static void runAssetLoad(void *data)
+{
+    AssetLoad *load = data;
+
+    if (load->type == ASSET_MESH) {
+        Mesh *mesh = &load->mesh;
+        loadMeshGeometry(mesh, load->path);
+
+        // The device may not be picked yet, so this can't check whether CPU
+        // culling ends up enabled
+        if (CPU_OCCLUSION_CULLING)
+            occSimplify(mesh->vertices[0].pos, sizeof(Vertex), mesh->vertexCount, mesh->indices, mesh->indexCount,
+                        OCCLUDER_TRIANGLES, &mesh->occluderPositions, &mesh->occluderVertexCount,
+                        &mesh->occluderIndices, &mesh->occluderIndexCount);
+    } else {
+        loadTexture(&load->image, load->path);
+    }
+
+    load->decoded = true;
+}
+
+static void freeAssetLoad(AssetLoad *load)
+{
+    if (load->decoded && load->type == ASSET_MESH)
+        cleanupMesh(&load->mesh);
+    else if (load->decoded)
+        vtdFree(&load->image);
+
+    free(load);
+}
+
+static void queueAssetLoad(AssetType type, uint32_t index, const char *path)
+{
+    AssetLoad *load = calloc(1, sizeof(AssetLoad));
+    load->type  = type;
+    load->index = index;
+    load->path  = path;
+
+    assetLoads.remaining++;
+    assetLoaderSubmit(&assetLoader, runAssetLoad, load);
+}
+
+// Returns right away and starts reading the mesh in the background, it's
+// drawn as a cube until then
+uint32_t addMeshAsync(const char *meshPath)
+{
+    uint32_t mesh = addMesh(meshPath);
+    meshes[mesh].loading = true;
+
+    queueAssetLoad(ASSET_MESH, mesh, meshPath);
+
+    return mesh;
+}
+
+// Returns right away and starts reading the texture in the background, it's
+// white until then. The texture gets an array of its own instead of being
+// packed with the others.
+uint32_t addMaterialAsync(const char *texturePath)
+{
+    uint32_t material = addMaterial(texturePath);
+    materials[material].loading = true;
+
+    queueAssetLoad(ASSET_TEXTURE, material, texturePath);
+
+    return material;
+}
+
+// Filled by packTextures(), uploaded and freed by loadTextures()
+VtdPack texturePack;
+
+static void decodeTextureFile(FileBatchEntry *entry, size_t index, void *user)
+{
+    if (!entry->data)
+        ERR_EXIT("Failed to load texture %s\n", entry->path);
+
+    VtdData **images = user;
+    decodeTexture(images[index], entry->data, entry->size);
+    free(entry->data);
+}
+
+// Only reads files and packs the textures, so it doesn't need the device
+void packTextures()
+{
+    // Each distinct texture is only loaded and packed once
+    const char **paths = malloc(materialCount * sizeof(char *));
+    VtdData *images = malloc(materialCount * sizeof(VtdData));
+    size_t *materialImages = malloc(materialCount * sizeof(size_t));
+    size_t imageCount = 0;
+
+    for (size_t i = 0; i < materialCount; ++i) {
+        if (materials[i].loading)
+            continue;
+
+        size_t j;
+        for (j = 0; j < imageCount; ++j)
+            if (strcmp(paths[j], materials[i].texturePath) == 0)
+                break;
+
+        if (j == imageCount)
+            paths[imageCount++] = materials[i].texturePath;
+
+        materialImages[i] = j;
+    }
+
+    // Packed textures need no reads, the others are read at once
+    FileBatchEntry *files = malloc(imageCount * sizeof(FileBatchEntry));
+    VtdData **fileImages = malloc(imageCount * sizeof(VtdData *));
+    size_t fileCount = 0;
+
+    for (size_t i = 0; i < imageCount; ++i) {
+        if (assetPackFind(&assetPack, paths[i])) {
+            loadTexture(&images[i], paths[i]);
+        } else {
+            files[fileCount].path   = paths[i];
+            fileImages[fileCount++] = &images[i];
+        }
+    }
+
+    fileBatchRead(files, fileCount, DIRECT_IO ? FILE_BATCH_DIRECT : 0, decodeTextureFile, fileImages);
+
+    free(fileImages);
+    free(files);
+
+    if (!vtdPack(images, imageCount, ATLAS_DIM, ATLAS_MAX_DIM, ATLAS_PADDING, &texturePack))
+        ERR_EXIT("Failed to pack textures\n");
+
+    for (size_t i = 0; i < imageCount; ++i)
+        vtdFree(&images[i]);
+
+    for (size_t i = 0; i < materialCount; ++i) {
+        // loadTextures() puts the placeholder right after the packed arrays
+        if (materials[i].loading) {
+            materials[i].textureArray = texturePack.arrayCount;
+            materials[i].textureLayer = 0;
+            materials[i].uvTransform[0] = 1.0f;
+            materials[i].uvTransform[1] = 1.0f;
+            materials[i].uvTransform[2] = 0.0f;
+            materials[i].uvTransform[3] = 0.0f;
+            continue;
+        }
+
+        VtdPackEntry *entry = &texturePack.entries[materialImages[i]];
+        materials[i].textureArray   = entry->array;
+        materials[i].textureLayer   = entry->layer;
+        materials[i].uvTransform[0] = entry->uvScale[0];
+        materials[i].uvTransform[1] = entry->uvScale[1];
+        materials[i].uvTransform[2] = entry->uvOffset[0];
+        materials[i].uvTransform[3] = entry->uvOffset[1];
+    }
+
+    free(materialImages);
+    free(images);
+    free(paths);
+}
+
+// Creates the sampler of an uploaded texture array and lets the shaders
+// sample it
+void addTextureDescriptor(uint32_t index)
+{
+    createTextureSampler(&textureArrays[index].sampler, textureArrays[index].mipLevels);
+
+    if (vkData.bindlessSupported)
+        writeBindlessTexture(index, &textureArrays[index]);
+    else
+        createTextureDescriptorSet(&textureArrays[index]);
+}
+
+void loadTextures()
+{
+    VtdPack *pack = &texturePack;
+
+    size_t loadingCount = 0;
+    for (size_t i = 0; i < materialCount; ++i)
+        loadingCount += materials[i].loading;
+
+    // Materials that are still loading share a white placeholder
+    textureArrayCount = pack->arrayCount + (loadingCount > 0);
+    textureArrays = malloc(textureArrayCount * sizeof(TextureArray));
+
+    // Without bindless every texture array gets its own set, including the
+    // ones loaded later
+    if (!vkData.bindlessSupported) {
+        VkDescriptorPoolSize poolSize = {
+            .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = textureArrayCount + loadingCount
+        };
+
+        VkDescriptorPoolCreateInfo poolInfo = {
+            .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .poolSizeCount = 1,
+            .pPoolSizes    = &poolSize,
+            .maxSets       = textureArrayCount + loadingCount
+        };
+
+        VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.textureDescriptorPool));
+    }
+
+    for (size_t i = 0; i < pack->arrayCount; ++i) {
+        createTextureArray(&textureArrays[i], &pack->arrays[i], MIP_LEVELS, true);
+        addTextureDescriptor(i);
+    }
+
+    if (loadingCount > 0) {
+        uint8_t white[4] = {255, 255, 255, 255};
+        VtdPackArray placeholder = {
+            .channels   = 4,
+            .width      = 1,
+            .height     = 1,
+            .layerCount = 1,
+            .atlas      = false,
+            .pixels     = white
+        };
+
+        createTextureArray(&textureArrays[pack->arrayCount], &placeholder, 1, true);
+        addTextureDescriptor(pack->arrayCount);
+    }
+
+    vtdPackFree(pack);
+}
+
+int compareInstances(const void *a, const void *b)
+{
+    const Instance *ia = a, *ib = b;
+    uint32_t variantA = meshes[ia->mesh].variant, variantB = meshes[ib->mesh].variant;
+    uint32_t arrayA = materials[ia->material].textureArray, arrayB = materials[ib->material].textureArray;
+
+    if (variantA != variantB)
+        return variantA < variantB ? -1 : 1;
+    // Bindless draws can mix texture arrays
+    if (!vkData.bindlessSupported && arrayA != arrayB)
+        return arrayA < arrayB ? -1 : 1;
+    if (ia->mesh != ib->mesh)
+        return ia->mesh < ib->mesh ? -1 : 1;
+    if (ia->material != ib->material)
+        return ia->material < ib->material ? -1 : 1;
+    return 0;
+}
+
+// Sorts the instances so each mesh and material pair is contiguous, batches
+// that can share an indirect draw call are next to each other
+void buildBatches()
+{
+    qsort(instances, instanceCount, sizeof(Instance), compareInstances);
+
+    free(batches);
+    batches = malloc(instanceCount * sizeof(Batch));
+    batchCount = 0;
+
+    for (size_t i = 0; i < instanceCount; ++i) {
+        Batch *last = batchCount > 0 ? &batches[batchCount - 1] : NULL;
+
+        if (last && last->mesh == instances[i].mesh && last->material == instances[i].material) {
+            last->instanceCount += 1;
+            instances[i].batch = batchCount - 1;
+            continue;
+        }
+
+        batches[batchCount++] = (Batch) {
+            .mesh          = instances[i].mesh,
+            .material      = instances[i].material,
+            .firstInstance = i,
+            .instanceCount = 1
+        };
+        instances[i].batch = batchCount - 1;
+    }
+
+    free(drawGroups);
+    drawGroups = malloc(batchCount * sizeof(DrawGroup));
+    drawGroupCount = 0;
+
+    for (size_t i = 0; i < batchCount; ++i) {
+        DrawGroup *last = drawGroupCount > 0 ? &drawGroups[drawGroupCount - 1] : NULL;
+        uint32_t variant = meshes[batches[i].mesh].variant;
+        uint32_t textureArray = materials[batches[i].material].textureArray;
+
+        if (last && last->variant == variant && (vkData.bindlessSupported || last->textureArray == textureArray)) {
+            last->batchCount += 1;
+            continue;
+        }
+
+        drawGroups[drawGroupCount++] = (DrawGroup) {
+            .variant      = variant,
+            .textureArray = textureArray,
+            .firstBatch   = i,
+            .batchCount   = 1
+        };
+    }
+}
+
+// Writes every instance's entry of the object buffer, later frames only
+// rewrite the model matrices of instances whose transform changed
+void writeObjectData()
+{
+    transformInstances = malloc(transforms.count * sizeof(uint32_t));
+    for (size_t i = 0; i < transforms.count; ++i)
+        transformInstances[i] = UINT32_MAX;
+
+    transformUpdate(&transforms);
+
+    struct ObjectData *objects = calloc(instanceCount, sizeof(struct ObjectData));
+
+    for (size_t i = 0; i < instanceCount; ++i) {
+        Instance *instance = &instances[i];
+        Material *material = &materials[instance->material];
+        struct ObjectData *object = &objects[i];
+
+        transformInstances[instance->transform] = i;
+
+        memcpy(object->model, transforms.worlds[instance->transform], sizeof(mat4x4));
+        memcpy(object->normalMatrix, transforms.normals[instance->transform], 3 * sizeof(vec4));
+        memcpy(object->uvTransform, material->uvTransform, sizeof(vec4));
+        object->textureIndex = material->textureArray;
+        object->textureLayer = material->textureLayer;
+        object->batch        = instance->batch;
+    }
+
+    queueSceneUpload(vkData.objectBuffer, objects, instanceCount * sizeof(struct ObjectData));
+    free(objects);
+}
+
+// Queues new model and normal matrices for an instance's entry of the object
+// buffer
+void queueObjectUpdate(uint32_t instance, const float *model, const float *normalMatrix)
+{
+    uint32_t slot = objectUpdates.slots[instance];
+
+    if (slot == UINT32_MAX) {
+        slot = objectUpdates.count++;
+        objectUpdates.slots[instance] = slot;
+        objectUpdates.entries[slot].index = instance;
+    }
+
+    memcpy(objectUpdates.entries[slot].model, model, sizeof(mat4x4));
+    memcpy(objectUpdates.entries[slot].normalMatrix, normalMatrix, 3 * sizeof(vec4));
+}
+
+// Writes the pending updates for the frame about to be submitted. The
+// previous frame must be finished with the update buffer.
+void flushObjectUpdates()
+{
+    struct ObjectUpdateHeader *header = vkData.objectUpdateData;
+    struct ObjectUpdate *entries = (struct ObjectUpdate *) (header + 1);
+
+    memcpy(entries, objectUpdates.entries, objectUpdates.count * sizeof(struct ObjectUpdate));
+
+    header->dispatch = (VkDispatchIndirectCommand) {(objectUpdates.count + 63) / 64, 1, 1};
+    header->updateCount = objectUpdates.count;
+
+    for (uint32_t i = 0; i < objectUpdates.count; ++i)
+        objectUpdates.slots[objectUpdates.entries[i].index] = UINT32_MAX;
+
+    objectUpdates.count = 0;
+}
+
+void createDescriptorPool()
+{
+    VkDescriptorPoolSize poolSizes[] = {
+        {
+            .type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorCount = 1
+        }, {
+            .type            = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 2
+        }, {
+            .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = vkData.bindlessMaxTextures
+        }
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .poolSizeCount = 2,
+        .pPoolSizes    = poolSizes,
+        .maxSets       = 1
+    };
+
+    if (vkData.bindlessSupported) {
+        poolInfo.flags         = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+        poolInfo.poolSizeCount = 3;
+    }
+
+    VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.descriptorPool));
+}
+
+void createSceneResources()
+{
+    VkDescriptorSetVariableDescriptorCountAllocateInfoEXT countInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO_EXT,
+        .descriptorSetCount = 1,
+        .pDescriptorCounts  = &vkData.bindlessMaxTextures
+    };
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .pNext              = vkData.bindlessSupported ? &countInfo : NULL,
+        .descriptorPool     = vkData.descriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts        = &vkData.descriptorSetLayout
+    };
+
+    VK_CHECK(vkAllocateDescriptorSets(vkData.device, &allocInfo, &vkData.descriptorSet));
+
+    createBuffer(vkData.physicalDevice, vkData.device, sizeof(struct SceneData),
+                 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &vkData.sceneBuffer, &vkData.sceneBufferMemory);
+
+    // Only written by the initial upload and the scatter shader
+    createBuffer(vkData.physicalDevice, vkData.device, MAX_INSTANCES * sizeof(struct ObjectData),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &vkData.objectBuffer, &vkData.objectBufferMemory);
+
+    VkDeviceSize updateSize = sizeof(struct ObjectUpdateHeader) + MAX_INSTANCES * sizeof(struct ObjectUpdate);
+
+    createBuffer(vkData.physicalDevice, vkData.device, updateSize,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &vkData.objectUpdateBuffer, &vkData.objectUpdateBufferMemory);
+
+    vkMapMemory(vkData.device, vkData.objectUpdateBufferMemory, 0, updateSize, 0, &vkData.objectUpdateData);
+    memset(vkData.objectUpdateData, 0, sizeof(struct ObjectUpdateHeader));
+
+    objectUpdates.entries = malloc(MAX_INSTANCES * sizeof(struct ObjectUpdate));
+    objectUpdates.slots   = malloc(MAX_INSTANCES * sizeof(uint32_t));
+    objectUpdates.count   = 0;
+
+    for (size_t i = 0; i < MAX_INSTANCES; ++i)
+        objectUpdates.slots[i] = UINT32_MAX;
+
+    VkDescriptorSetAllocateInfo scatterAllocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = vkData.scatterDescriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts        = &vkData.scatterSetLayout
+    };
+
+    VK_CHECK(vkAllocateDescriptorSets(vkData.device, &scatterAllocInfo, &vkData.scatterDescriptorSet));
+
+    VkDescriptorBufferInfo scatterInfos[] = {
+        {vkData.objectBuffer,       0, VK_WHOLE_SIZE},
+        {vkData.objectUpdateBuffer, 0, VK_WHOLE_SIZE}
+    };
+
+    VkWriteDescriptorSet scatterWrites[2];
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        scatterWrites[i] = (VkWriteDescriptorSet) {
+            .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet          = vkData.scatterDescriptorSet,
+            .dstBinding      = i,
+            .dstArrayElement = 0,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .pBufferInfo     = &scatterInfos[i]
+        };
+    }
+
+    vkUpdateDescriptorSets(vkData.device, 2, scatterWrites, 0, NULL);
+
+    // Starts out as the identity so instances can be drawn directly without
+    // the cull pass filling it in. The late Hi-Z phase uses a second half.
+    size_t visibleCount = vkData.hiZSupported ? 2 * MAX_INSTANCES : MAX_INSTANCES;
+    uint32_t *visible = malloc(visibleCount * sizeof(uint32_t));
+    for (uint32_t i = 0; i < visibleCount; ++i)
+        visible[i] = i % MAX_INSTANCES;
+
+    // CPU culling rewrites the list every frame
+    if (vkData.cpuCullEnabled) {
+        createBuffer(vkData.physicalDevice, vkData.device, visibleCount * sizeof(uint32_t),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &vkData.visibleBuffer, &vkData.visibleBufferMemory);
+
+        void *data;
+        vkMapMemory(vkData.device, vkData.visibleBufferMemory, 0, visibleCount * sizeof(uint32_t), 0, &data);
+        memcpy(data, visible, visibleCount * sizeof(uint32_t));
+        vkUnmapMemory(vkData.device, vkData.visibleBufferMemory);
+    } else
+        createDeviceLocalBuffer(&vkData.visibleBuffer, &vkData.visibleBufferMemory,
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, visible, visibleCount * sizeof(uint32_t));
+    free(visible);
+
+    VkDescriptorBufferInfo sceneInfo = {
+        .buffer = vkData.sceneBuffer,
+        .offset = 0,
+        .range  = sizeof(struct SceneData)
+    };
+
+    VkDescriptorBufferInfo objectInfo = {
+        .buffer = vkData.objectBuffer,
+        .offset = 0,
+        .range  = VK_WHOLE_SIZE
+    };
+
+    VkDescriptorBufferInfo visibleInfo = {
+        .buffer = vkData.visibleBuffer,
+        .offset = 0,
+        .range  = VK_WHOLE_SIZE
+    };
+
+    VkWriteDescriptorSet descriptorWrites[] = {
+        {
+            .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet           = vkData.descriptorSet,
+            .dstBinding       = 0,
+            .dstArrayElement  = 0,
+            .descriptorType   = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorCount  = 1,
+            .pBufferInfo      = &sceneInfo
+        }, {
+            .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet           = vkData.descriptorSet,
+            .dstBinding       = 1,
+            .dstArrayElement  = 0,
+            .descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount  = 1,
+            .pBufferInfo      = &objectInfo
+        }, {
+            .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet           = vkData.descriptorSet,
+            .dstBinding       = 2,
+            .dstArrayElement  = 0,
+            .descriptorType   = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount  = 1,
+            .pBufferInfo      = &visibleInfo
+        }
+    };
+
+    vkUpdateDescriptorSets(vkData.device, sizeof(descriptorWrites) / sizeof(descriptorWrites[0]),
+                           descriptorWrites, 0, NULL);
+}
+
+// Per batch data for the cull shader along with the indirect draw commands
+// and counts it writes, every batch gets a command slot at its index. With
+// Hi-Z the late phase has its own copy of the commands and counts.
+// Written again whenever loaded assets change the batches
+void writeBatchData()
+{
+    struct BatchData *batchData = malloc(batchCount * sizeof(struct BatchData));
+
+    for (size_t i = 0; i < drawGroupCount; ++i) {
+        DrawGroup *group = &drawGroups[i];
+
+        for (uint32_t j = group->firstBatch; j < group->firstBatch + group->batchCount; ++j) {
+            Mesh *mesh = &meshes[batches[j].mesh];
+
+            memcpy(batchData[j].boundingSphere, mesh->boundingSphere, sizeof(vec4));
+            batchData[j].firstInstance   = batches[j].firstInstance;
+            batchData[j].indexCount      = mesh->indexCount;
+            batchData[j].group           = i;
+            batchData[j].groupFirstBatch = group->firstBatch;
+            batchData[j].firstIndex      = mesh->firstIndex;
+            batchData[j].vertexOffset    = mesh->vertexOffset;
+        }
+    }
+
+    queueSceneUpload(vkData.batchBuffer, batchData, batchCount * sizeof(struct BatchData));
+    free(batchData);
+}
+
+void createCullResources()
+{
+    if (!vkData.gpuCullSupported)
+        return;
+
+    createBuffer(vkData.physicalDevice, vkData.device, batchCount * sizeof(struct BatchData),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vkData.batchBuffer, &vkData.batchBufferMemory);
+    writeBatchData();
+
+    uint32_t phaseCount = vkData.hiZSupported ? 2 : 1;
+
+    createBuffer(vkData.physicalDevice, vkData.device,
+                 phaseCount * batchCount * sizeof(VkDrawIndexedIndirectCommand),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &vkData.drawCommandBuffer, &vkData.drawCommandBufferMemory);
+
+    // Room for as many groups as batches, loaded assets can split the groups
+    createBuffer(vkData.physicalDevice, vkData.device, phaseCount * 2 * batchCount * sizeof(uint32_t),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                 | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &vkData.drawCountBuffer, &vkData.drawCountBufferMemory);
+
+    // Nothing counts as visible on the first frame, so it's all drawn late
+    if (vkData.hiZSupported) {
+        uint32_t *visibility = calloc(instanceCount, sizeof(uint32_t));
+        createDeviceLocalBuffer(&vkData.visibilityBuffer, &vkData.visibilityBufferMemory,
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, visibility, instanceCount * sizeof(uint32_t));
+        free(visibility);
+    }
+
+    VkDescriptorSetLayout setLayouts[] = {vkData.cullSetLayout, vkData.cullSetLayout};
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = vkData.cullDescriptorPool,
+        .descriptorSetCount = 2,
+        .pSetLayouts        = setLayouts
+    };
+
+    VK_CHECK(vkAllocateDescriptorSets(vkData.device, &allocInfo, vkData.cullDescriptorSets));
+    vkData.cullDescriptorSet = 0;
+
+    VkDescriptorBufferInfo bufferInfos[] = {
+        {vkData.sceneBuffer,       0, VK_WHOLE_SIZE},
+        {vkData.objectBuffer,      0, VK_WHOLE_SIZE},
+        {vkData.batchBuffer,       0, VK_WHOLE_SIZE},
+        {vkData.visibleBuffer,     0, VK_WHOLE_SIZE},
+        {vkData.drawCommandBuffer, 0, VK_WHOLE_SIZE},
+        {vkData.drawCountBuffer,   0, VK_WHOLE_SIZE},
+        {vkData.visibilityBuffer,  0, VK_WHOLE_SIZE}
+    };
+
+    // The depth pyramid at binding 7 is written with the pyramid itself
+    uint32_t writeCount = vkData.hiZSupported ? 7 : 6;
+    VkWriteDescriptorSet descriptorWrites[2 * 7];
+
+    for (uint32_t i = 0; i < 2 * writeCount; ++i) {
+        descriptorWrites[i] = (VkWriteDescriptorSet) {
+            .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet          = vkData.cullDescriptorSets[i / writeCount],
+            .dstBinding      = i % writeCount,
+            .dstArrayElement = 0,
+            .descriptorType  = i % writeCount == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+                                                   : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .pBufferInfo     = &bufferInfos[i % writeCount]
+        };
+    }
+
+    vkUpdateDescriptorSets(vkData.device, 2 * writeCount, descriptorWrites, 0, NULL);
+}
+
+// Records the cull passes of a phase, the draw commands and counts are ready
+// for the draw indirect stage when this returns. Must be outside a render pass.
+void cmdCullInstances(VkCommandBuffer commandBuffer, bool compact, uint32_t phase)
+{
+    VkDeviceSize countSize = (drawGroupCount + batchCount) * sizeof(uint32_t);
+    vkCmdFillBuffer(commandBuffer, vkData.drawCountBuffer, phase == CULL_PHASE_LATE ? countSize : 0, countSize, 0);
+
+    VkMemoryBarrier barrier = {
+        .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+
+    struct CullPushConstantData cullConsts = {
+        .instanceCount = instanceCount,
+        .batchCount    = batchCount,
+        .groupCount    = drawGroupCount,
+        .compact       = compact,
+        .phase         = phase,
+        .visibleOffset = phase == CULL_PHASE_LATE ? MAX_INSTANCES : 0
+    };
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.cullPipelineLayout,
+                            0, 1, &vkData.cullDescriptorSets[vkData.cullDescriptorSet], 0, NULL);
+    vkCmdPushConstants(commandBuffer, vkData.cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(struct CullPushConstantData), &cullConsts);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.cullPipeline);
+    vkCmdDispatch(commandBuffer, (instanceCount + 63) / 64, 1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.cullCompactPipeline);
+    vkCmdDispatch(commandBuffer, (batchCount + 63) / 64, 1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+void createCpuCullResources()
+{
+    if (!vkData.cpuCullEnabled)
+        return;
+
+    occInit(&cpuCull.occBuffer, OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        Mesh *mesh = &meshes[i];
+        occSimplify(mesh->vertices[0].pos, sizeof(Vertex), mesh->vertexCount, mesh->indices, mesh->indexCount,
+                    OCCLUDER_TRIANGLES, &mesh->occluderPositions, &mesh->occluderVertexCount,
+                    &mesh->occluderIndices, &mesh->occluderIndexCount);
+    }
+
+    cpuCull.visible       = malloc(instanceCount * sizeof(bool));
+    cpuCull.visibleCounts = malloc(batchCount * sizeof(uint32_t));
+
+    for (size_t i = 0; i < batchCount; ++i)
+        cpuCull.visibleCounts[i] = batches[i].instanceCount;
+}
+
+typedef struct {
+    float    size;
+    uint32_t instance;
+} OccluderCandidate;
+
+int compareOccluders(const void *a, const void *b)
+{
+    const OccluderCandidate *oa = a, *ob = b;
+    return (oa->size < ob->size) - (oa->size > ob->size);
+}
+
+void rasterizeOccluderTile(void *data, size_t tile)
+{
+    (void) data;
+
+    occRasterizeTile(&cpuCull.occBuffer, tile);
+}
+
+// Each task tests a run of 64 instances
+void testInstanceRange(void *data, size_t task)
+{
+    (void) data;
+
+    size_t end = (task + 1) * 64 < instanceCount ? (task + 1) * 64 : instanceCount;
+
+    for (size_t i = task * 64; i < end; ++i) {
+        Mesh *mesh = &meshes[instances[i].mesh];
+        mat4x4 *model = (mat4x4 *) transforms.worlds[instances[i].transform];
+
+        mat4x4 mvp;
+        mat4x4_mul(mvp, cpuCull.viewProj, *model);
+
+        cpuCull.visible[i] = occTestBox(&cpuCull.occBuffer, (float *) mvp, mesh->boundsMin, mesh->boundsMax);
+    }
+}
+
+// Rasterizes the instances that look largest from the eye as occluders, then
+// writes the instances that pass the test to each batch's range of the
+// visible instance list
+void cullInstancesCpu(vec3 eye)
+{
+    double start = glfwGetTime();
+
+    OccluderCandidate *candidates = malloc(instanceCount * sizeof(OccluderCandidate));
+    size_t candidateCount = 0;
+
+    for (size_t i = 0; i < instanceCount; ++i) {
+        Mesh *mesh = &meshes[instances[i].mesh];
+        if (mesh->occluderIndexCount == 0)
+            continue;
+
+        mat4x4 *model = (mat4x4 *) transforms.worlds[instances[i].transform];
+
+        vec4 center = {mesh->boundingSphere[0], mesh->boundingSphere[1], mesh->boundingSphere[2], 1.0f}, world;
+        mat4x4_mul_vec4(world, *model, center);
+
+        float scale = fmaxf(vec3_len((*model)[0]), fmaxf(vec3_len((*model)[1]), vec3_len((*model)[2])));
+        float radius = mesh->boundingSphere[3] * scale;
+
+        vec3 d;
+        vec3_sub(d, world, eye);
+        float distance = vec3_len(d);
+
+        // Occluders the eye is inside of would be clipped anyway
+        if (distance > radius)
+            candidates[candidateCount++] = (OccluderCandidate) {radius / distance, i};
+    }
+
+    qsort(candidates, candidateCount, sizeof(OccluderCandidate), compareOccluders);
+
+    occBegin(&cpuCull.occBuffer);
+
+    for (size_t i = 0; i < candidateCount && i < MAX_OCCLUDERS; ++i) {
+        uint32_t instance = candidates[i].instance;
+        Mesh *mesh = &meshes[instances[instance].mesh];
+        mat4x4 *model = (mat4x4 *) transforms.worlds[instances[instance].transform];
+
+        mat4x4 mvp;
+        mat4x4_mul(mvp, cpuCull.viewProj, *model);
+
+        occAddOccluder(&cpuCull.occBuffer, (float *) mvp, mesh->occluderPositions, mesh->occluderVertexCount,
+                       mesh->occluderIndices, mesh->occluderIndexCount);
+    }
+
+    free(candidates);
+
+    threadPoolFor(&threadPool, cpuCull.occBuffer.tilesX * cpuCull.occBuffer.tilesY, rasterizeOccluderTile, NULL);
+    threadPoolFor(&threadPool, (instanceCount + 63) / 64, testInstanceRange, NULL);
+
+    for (size_t i = 0; i < batchCount; ++i) {
+        Batch *batch = &batches[i];
+        uint32_t count = 0;
+
+        for (uint32_t j = batch->firstInstance; j < batch->firstInstance + batch->instanceCount; ++j)
+            count += cpuCull.visible[j];
+
+        cpuCull.visibleCounts[i] = count;
+        cpuCull.visibleTotal += count;
+    }
+
+    cpuCull.time += glfwGetTime() - start;
+    cpuCull.frames += 1;
+}
+
+// Writes the visible list cullInstancesCpu() found, only once the frame in
+// flight that reads the buffer has finished
+void writeVisibleInstances()
+{
+    void *data;
+    vkMapMemory(vkData.device, vkData.visibleBufferMemory, 0, instanceCount * sizeof(uint32_t), 0, &data);
+    uint32_t *visibleInstances = data;
+
+    for (size_t i = 0; i < batchCount; ++i) {
+        Batch *batch = &batches[i];
+        uint32_t count = 0;
+
+        for (uint32_t j = batch->firstInstance; j < batch->firstInstance + batch->instanceCount; ++j)
+            if (cpuCull.visible[j])
+                visibleInstances[batch->firstInstance + count++] = j;
+    }
+
+    vkUnmapMemory(vkData.device, vkData.visibleBufferMemory);
+}
+
+// Depth is the view distance, so opaque draws within the same state go front
+// to back
+uint64_t makeSortKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh, float depth)
+{
+    float normalized = fminf(fmaxf(depth / FAR_PLANE, 0.0f), 1.0f);
+
+    return (uint64_t) (pass & 0xf) << SORT_KEY_PASS_SHIFT
+         | (uint64_t) (pipeline & 0xff) << SORT_KEY_PIPELINE_SHIFT
+         | (uint64_t) (material & 0xffff) << SORT_KEY_MATERIAL_SHIFT
+         | (uint64_t) (mesh & 0xfff) << SORT_KEY_MESH_SHIFT
+         | (uint64_t) (normalized * SORT_KEY_DEPTH_MAX);
+}
+
+// Queues every batch with visible instances at the depth of its nearest
+// instance. Bindless draws never rebind textures, so their texture array
+// doesn't take part in the key.
+void buildRenderQueue(vec3 eye, vec3 forward)
+{
+    renderQueueClear(&renderQueue);
+
+    for (size_t i = 0; i < batchCount; ++i) {
+        Batch *batch = &batches[i];
+
+        if (vkData.cpuCullEnabled && cpuCull.visibleCounts[i] == 0)
+            continue;
+
+        float nearest = FAR_PLANE;
+        for (uint32_t j = batch->firstInstance; j < batch->firstInstance + batch->instanceCount; ++j) {
+            if (vkData.cpuCullEnabled && !cpuCull.visible[j])
+                continue;
+
+            vec3 d;
+            vec3_sub(d, transforms.worlds[instances[j].transform] + 12, eye);
+            nearest = fminf(nearest, vec3_mul_inner(d, forward));
+        }
+
+        uint32_t material = vkData.bindlessSupported ? 0 : materials[batch->material].textureArray;
+
+        renderQueuePush(&renderQueue, makeSortKey(RENDER_PASS_OPAQUE, meshes[batch->mesh].variant, material, batch->mesh,
+                                                  nearest), i);
+    }
+
+    renderQueueSort(&renderQueue, &threadPool);
+}
+
+void cleanupCpuCullResources()
+{
+    if (!vkData.cpuCullEnabled)
+        return;
+
+    occFree(&cpuCull.occBuffer);
+
+    free(cpuCull.visible);
+    free(cpuCull.visibleCounts);
+}
+
+// Applies the frame's object updates, the object buffer is ready for the
+// cull and vertex shaders when this returns
+void cmdScatterObjectUpdates(VkCommandBuffer commandBuffer)
+{
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.scatterPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkData.scatterPipelineLayout,
+                            0, 1, &vkData.scatterDescriptorSet, 0, NULL);
+
+    vkCmdDispatchIndirect(commandBuffer, vkData.objectUpdateBuffer, 0);
+
+    VkMemoryBarrier barrier = {
+        .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+// Pushes the lighting constants and binds set 0 and the shared geometry
+// buffers. The viewport covers the whole swapchain image. The pipeline
+// variant is bound per draw by the caller.
+void cmdBindScene(VkCommandBuffer commandBuffer)
+{
+    VkViewport viewport = {
+        .x        = 0.0f,
+        .y        = 0.0f,
+        .width    = (float) vkData.swapchainImageExtent.width,
+        .height   = (float) vkData.swapchainImageExtent.height,
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f
+    };
+
+    VkRect2D scissor = {
+        .offset = {0, 0},
+        .extent = vkData.swapchainImageExtent
+    };
+
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    vkCmdPushConstants(commandBuffer, vkData.pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT,
+                       0, sizeof(struct PushConstantData), &pushConsts);
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            vkData.pipelineLayout, 0, 1, &vkData.descriptorSet, 0, NULL);
+
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vkData.vertexBuffer, &offset);
+    vkCmdBindIndexBuffer(commandBuffer, vkData.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 }
 
-void loadModelTexture(Model *model, const char *texturePath, size_t mipCount)
+// One indirect draw per group, each batch's command draws its visible
+// instances from the phase's half of the command and count buffers
+void cmdDrawCulled(VkCommandBuffer commandBuffer, uint32_t phase)
 {
-    model->textureMipLevels = createTextureImage(&model->textureImage, &model->textureImageMemory,
-                                                 texturePath, mipCount);
-    createTextureImageView(&model->textureImageView, model->textureImage, model->textureMipLevels);
-    createTextureSampler(&model->textureSampler, model->textureMipLevels);
+    VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+    VkDeviceSize commandOffset = 0, countOffset = 0;
+
+    if (phase == CULL_PHASE_LATE) {
+        commandOffset = batchCount * stride;
+        countOffset   = (drawGroupCount + batchCount) * sizeof(uint32_t);
+    }
+
+    uint32_t boundVariant = VARIANT_EMPTY;
 
+    for (size_t j = 0; j < drawGroupCount; j++) {
+        DrawGroup *group = &drawGroups[j];
+
+        if (group->variant != boundVariant) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, findPipelineVariant(group->variant));
+            boundVariant = group->variant;
+        }
+
+        if (!vkData.bindlessSupported)
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vkData.pipelineLayout, 1, 1,
+                                    &textureArrays[group->textureArray].descriptorSet, 0, NULL);
+
+        VkDeviceSize offset = commandOffset + group->firstBatch * stride;
+
+        if (vkData.drawIndirectCountSupported)
+            vkData.fpCmdDrawIndexedIndirectCountKHR(commandBuffer, vkData.drawCommandBuffer, offset,
+                                                    vkData.drawCountBuffer, countOffset + j * sizeof(uint32_t),
+                                                    group->batchCount, stride);
+        else if (vkData.multiDrawIndirectSupported)
+            vkCmdDrawIndexedIndirect(commandBuffer, vkData.drawCommandBuffer, offset, group->batchCount, stride);
+        else
+            for (uint32_t k = 0; k < group->batchCount; k++)
+                vkCmdDrawIndexedIndirect(commandBuffer, vkData.drawCommandBuffer, offset + k * stride, 1, stride);
+    }
 }
 
-void loadModelGeometry(Model *model, const char *modelPath)
+// With CPU culling only the visible instances are drawn
+uint32_t batchDrawCount(uint32_t batch)
 {
-    size_t dataLen;
-    char *data = getFileData(modelPath, &dataLen);
+    return vkData.cpuCullEnabled ? cpuCull.visibleCounts[batch] : batches[batch].instanceCount;
+}
 
-    VmdData vmd;
-    loadVmd(&vmd, data, dataLen);
+// One draw per queued batch from begin to end, the instance index selects the
+// instance's entry in the object buffer
+void cmdDrawBatches(VkCommandBuffer commandBuffer, size_t begin, size_t end)
+{
+    uint32_t boundVariant = VARIANT_EMPTY;
+    uint32_t boundTextureArray = UINT32_MAX;
 
-    model->vertexCount = vmd.vertexCount;
-    model->indexCount  = vmd.indexCount;
+    for (size_t i = begin; i < end; i++) {
+        uint32_t j = renderQueue.values[i];
+        Batch *batch = &batches[j];
+        Mesh *mesh = &meshes[batch->mesh];
 
-    model->vertices = malloc(vmd.vertexCount * sizeof(Vertex));
-    model->indices  = malloc(vmd.indexCount * sizeof(uint32_t));
+        uint32_t drawCount = batchDrawCount(j);
+        if (drawCount == 0)
+            continue;
 
-    size_t vertFloats = vmdVertexComponents(&vmd);
+        if (mesh->variant != boundVariant) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, findPipelineVariant(mesh->variant));
+            boundVariant = mesh->variant;
+        }
 
-    size_t texOff = 3;
-    if (vmd.vertexMask & VMD_VERTEX_NORMAL_BIT)
-        texOff += 3;
+        uint32_t textureArray = materials[batch->material].textureArray;
+        if (!vkData.bindlessSupported && textureArray != boundTextureArray) {
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vkData.pipelineLayout, 1, 1,
+                                    &textureArrays[textureArray].descriptorSet, 0, NULL);
+            boundTextureArray = textureArray;
+        }
 
-    for (size_t i = 0; i < vmd.vertexCount; ++i) {
-        size_t offset = vertFloats * i;
-        Vertex v = {
-            .pos      = {vmd.vertices[offset + 0], vmd.vertices[offset + 1], vmd.vertices[offset + 2]},
-            .normal   = {vmd.vertices[offset + 3], vmd.vertices[offset + 4], vmd.vertices[offset + 5]},
-            .color    = {1.0f, 1.0f, 1.0f},
-            .texCoord = {vmd.vertices[offset + texOff], vmd.vertices[offset + texOff + 1]}
-        };
-        model->vertices[i] = v;
+        vkCmdDrawIndexed(commandBuffer, mesh->indexCount, drawCount, mesh->firstIndex, mesh->vertexOffset,
+                         batch->firstInstance);
     }
+}
 
-    memcpy(model->indices, vmd.indices, vmd.indexCount * sizeof(uint32_t));
+static uint64_t hashDrawValue(uint64_t hash, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        hash ^= (value >> (8 * i)) & 0xff;
+        hash *= 0x100000001b3ull;
+    }
 
-    vmdFree(&vmd);
-    free(data);
+    return hash;
 }
 
-void createVertexBuffer(VkBuffer *vertexBuffer, VkDeviceMemory *vertexMemory,
-                        Vertex *vertices, uint32_t count)
+// FNV-1a over everything cmdDrawBatches reads for the draws of a segment
+uint64_t hashDrawSegment(uint32_t segment)
 {
-    VkDeviceSize bufferSize = count * sizeof(Vertex);
+    size_t begin = (size_t)segment * RECORD_SEGMENT_DRAWS;
+    size_t end   = begin + RECORD_SEGMENT_DRAWS < renderQueue.count ? begin + RECORD_SEGMENT_DRAWS
+                                                                    : renderQueue.count;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = begin; i < end; i++) {
+        uint32_t j = renderQueue.values[i];
+        Batch *batch = &batches[j];
+        Mesh *mesh = &meshes[batch->mesh];
+
+        hash = hashDrawValue(hash, j);
+        hash = hashDrawValue(hash, batchDrawCount(j));
+        hash = hashDrawValue(hash, mesh->variant);
+        hash = hashDrawValue(hash, materials[batch->material].textureArray);
+        hash = hashDrawValue(hash, batch->firstInstance);
+        hash = hashDrawValue(hash, mesh->firstIndex);
+        hash = hashDrawValue(hash, mesh->vertexOffset);
+        hash = hashDrawValue(hash, mesh->indexCount);
+    }
 
-    VkBuffer       stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(vkData.physicalDevice, vkData.device, bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 &stagingBuffer, &stagingBufferMemory);
+    return hash;
+}
 
-    void *data;
-    vkMapMemory(vkData.device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, vertices, bufferSize);
-    vkUnmapMemory(vkData.device, stagingBufferMemory);
+// Nothing is inherited from the primary, so every segment binds the scene
+void recordDrawSegment(size_t imageIndex, uint32_t segment)
+{
+    VkCommandBuffer commandBuffer = segmentCaches[imageIndex].commandBuffers[segment];
 
-    createBuffer(vkData.physicalDevice, vkData.device, bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                 vertexBuffer, vertexMemory);
+    VkCommandBufferInheritanceInfo inheritanceInfo = {
+        .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .renderPass  = vkData.renderPass,
+        .subpass     = 0,
+        .framebuffer = vkData.swapchainFramebuffers[imageIndex]
+    };
 
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags            = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+                            VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT,
+        .pInheritanceInfo = &inheritanceInfo
+    };
 
-    cmdCopyBuffer(commandBuffer, stagingBuffer, *vertexBuffer, bufferSize);
+    // Begin resets the buffer implicitly
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
 
-    endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, commandBuffer);
+    size_t begin = (size_t)segment * RECORD_SEGMENT_DRAWS;
+    size_t end   = begin + RECORD_SEGMENT_DRAWS < renderQueue.count ? begin + RECORD_SEGMENT_DRAWS
+                                                                    : renderQueue.count;
 
-    vkDestroyBuffer(vkData.device, stagingBuffer, NULL);
-    vkFreeMemory(vkData.device, stagingBufferMemory, NULL);
+    cmdBindScene(commandBuffer);
+    cmdDrawBatches(commandBuffer, begin, end);
+
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
 }
 
-void createIndexBuffer(VkBuffer *indexBuffer, VkDeviceMemory *indexMemory,
-                       uint32_t *indices, uint32_t count)
+typedef struct {
+    size_t    imageIndex;
+    uint32_t *dirty;
+    uint32_t  dirtyCount;
+} SegmentRecording;
+
+// Records the dirty segments allocated from one pool
+void recordPoolSegments(void *data, size_t pool)
 {
-    VkDeviceSize bufferSize = count * sizeof(uint32_t);
+    SegmentRecording *recording = data;
 
-    VkBuffer       stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(vkData.physicalDevice, vkData.device, bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 &stagingBuffer, &stagingBufferMemory);
+    for (uint32_t i = 0; i < recording->dirtyCount; i++)
+        if (recording->dirty[i] % vkData.recordPoolCount == pool)
+            recordDrawSegment(recording->imageIndex, recording->dirty[i]);
+}
 
-    void *data;
-    vkMapMemory(vkData.device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, indices, bufferSize);
-    vkUnmapMemory(vkData.device, stagingBufferMemory);
+// Records the image's segments whose draws changed since they were last
+// recorded. Returns whether the primary command buffer has to be recorded
+// again, which is the case whenever a segment it executes was.
+bool updateDrawSegments(size_t imageIndex)
+{
+    SegmentCache *cache = &segmentCaches[imageIndex];
+    uint32_t segmentCount = (renderQueue.count + RECORD_SEGMENT_DRAWS - 1) / RECORD_SEGMENT_DRAWS;
+
+    if (segmentCount > cache->capacity) {
+        cache->commandBuffers = realloc(cache->commandBuffers, segmentCount * sizeof(VkCommandBuffer));
+        cache->hashes         = realloc(cache->hashes, segmentCount * sizeof(uint64_t));
+        cache->dirty          = realloc(cache->dirty, segmentCount * sizeof(uint32_t));
+
+        VkCommandBufferAllocateInfo allocInfo = {
+            .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .level              = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = 1
+        };
 
-    createBuffer(vkData.physicalDevice, vkData.device, bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                 indexBuffer, indexMemory);
+        for (uint32_t i = cache->capacity; i < segmentCount; i++) {
+            allocInfo.commandPool = vkData.recordCommandPools[i % vkData.recordPoolCount];
+            VK_CHECK(vkAllocateCommandBuffers(vkData.device, &allocInfo, &cache->commandBuffers[i]));
 
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+            // Never recorded, so never matches
+            cache->hashes[i] = 0;
+        }
 
-    cmdCopyBuffer(commandBuffer, stagingBuffer, *indexBuffer, bufferSize);
+        cache->capacity = segmentCount;
+    }
 
-    endSingleTimeCommands(vkData.device, vkData.commandPool, vkData.graphicsQueue, commandBuffer);
+    SegmentRecording recording = {
+        .imageIndex = imageIndex,
+        .dirty      = cache->dirty,
+        .dirtyCount = 0
+    };
 
-    vkDestroyBuffer(vkData.device, stagingBuffer, NULL);
-    vkFreeMemory(vkData.device, stagingBufferMemory, NULL);
+    for (uint32_t i = 0; i < segmentCount; i++) {
+        uint64_t hash = hashDrawSegment(i);
+        if (hash != cache->hashes[i]) {
+            cache->hashes[i] = hash;
+            cache->dirty[recording.dirtyCount++] = i;
+        }
+    }
+
+    // A lone dirty segment, the common case for a moving object, isn't worth
+    // waking the workers for
+    if (recording.dirtyCount == 1)
+        recordDrawSegment(imageIndex, recording.dirty[0]);
+    else if (recording.dirtyCount > 1)
+        threadPoolFor(&threadPool, vkData.recordPoolCount, recordPoolSegments, &recording);
+
+    bool changed = recording.dirtyCount > 0 || segmentCount != cache->count || !cache->primaryValid;
+
+    cache->count        = segmentCount;
+    cache->primaryValid = true;
+
+    return changed;
 }
 
-void createUniformBuffer(VkBuffer *uniformBuffer, VkDeviceMemory *uniformMemory)
+void freeSegmentCaches(uint32_t imageCount, SegmentCache *caches)
 {
-    VkDeviceSize bufferSize = sizeof(struct UniformBufferData);
-    createBuffer(vkData.physicalDevice, vkData.device, bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 uniformBuffer, uniformMemory);
+    if (vkData.recordPoolCount == 0)
+        return;
+
+    for (uint32_t i = 0; i < imageCount; ++i) {
+        for (uint32_t j = 0; j < caches[i].capacity; j++)
+            vkFreeCommandBuffers(vkData.device, vkData.recordCommandPools[j % vkData.recordPoolCount], 1,
+                                 &caches[i].commandBuffers[j]);
+
+        free(caches[i].commandBuffers);
+        free(caches[i].hashes);
+        free(caches[i].dirty);
+    }
+
+    free(caches);
 }
 
-void createDescriptorSet(VkDescriptorSet *descriptorSet, VkBuffer uniformBuffer,
-                         VkImageView imageView, VkSampler sampler)
+void recordCommandBuffer(size_t i)
 {
-    VkDescriptorSetLayout layouts[] = {vkData.descriptorSetLayout};
+    VkCommandBuffer commandBuffer = vkData.swapchainCommandBuffers[i];
 
-    VkDescriptorSetAllocateInfo allocInfo = {
-        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-        .descriptorPool     = vkData.descriptorPool,
-        .descriptorSetCount = 1,
-        .pSetLayouts        = layouts
+    // Only the count variant can skip the empty draws of culled batches
+    bool compact = vkData.drawIndirectCountSupported;
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT
     };
 
-    VK_CHECK(vkAllocateDescriptorSets(vkData.device, &allocInfo, descriptorSet));
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-    VkDescriptorBufferInfo bufferInfo = {
-        .buffer = uniformBuffer,
-        .offset = 0,
-        .range  = sizeof(struct UniformBufferData)
+    cmdScatterObjectUpdates(commandBuffer);
+
+    if (vkData.gpuCullSupported)
+        cmdCullInstances(commandBuffer, compact, vkData.hiZSupported ? CULL_PHASE_EARLY : CULL_PHASE_SINGLE);
+
+    VkClearValue clearValues[3];
+    size_t clearValueCount = 2;
+
+    clearValues[0].color.float32[0] = 0.0f;
+    clearValues[0].color.float32[1] = 0.0f;
+    clearValues[0].color.float32[2] = 0.0f;
+    clearValues[0].color.float32[3] = 1.0f;
+
+    clearValues[1].depthStencil.depth   = 1.0f;
+    clearValues[1].depthStencil.stencil = 0;
+
+    if (vkData.samples > VK_SAMPLE_COUNT_1_BIT) {
+        clearValues[2].color.float32[0] = 0.0f;
+        clearValues[2].color.float32[1] = 0.0f;
+        clearValues[2].color.float32[2] = 0.0f;
+        clearValues[2].color.float32[3] = 1.0f;
+
+        clearValueCount = 3;
+    }
+
+    VkRenderPassBeginInfo renderPassInfo = {
+        .sType       = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass  = vkData.renderPass,
+        .framebuffer = vkData.swapchainFramebuffers[i],
+        .renderArea = {
+            .offset = {0, 0},
+            .extent = vkData.swapchainImageExtent
+        },
+        .clearValueCount = clearValueCount,
+        .pClearValues    = clearValues
     };
 
-    VkDescriptorImageInfo imageInfo = {
-        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .imageView   = imageView,
-        .sampler     = sampler
+    // Without GPU culling the render pass only executes the cached segments
+    bool secondary = vkData.recordPoolCount > 0;
+
+    // Record draw commands into the command buffer
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                         secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+    if (!secondary)
+        cmdBindScene(commandBuffer);
+
+    if (secondary) {
+        if (segmentCaches[i].count > 0)
+            vkCmdExecuteCommands(commandBuffer, segmentCaches[i].count, segmentCaches[i].commandBuffers);
+    } else if (!vkData.gpuCullSupported)
+        cmdDrawBatches(commandBuffer, 0, renderQueue.count);
+    else if (!vkData.hiZSupported)
+        cmdDrawCulled(commandBuffer, CULL_PHASE_SINGLE);
+    else {
+        cmdDrawCulled(commandBuffer, CULL_PHASE_EARLY);
+        vkCmdEndRenderPass(commandBuffer);
+
+        // The late phase tests against the depth of the early phase's
+        // draws and adds what was hidden last frame but isn't anymore
+        cmdBuildDepthPyramid(commandBuffer);
+        cmdCullInstances(commandBuffer, compact, CULL_PHASE_LATE);
+
+        renderPassInfo.renderPass = vkData.lateRenderPass;
+
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        cmdBindScene(commandBuffer);
+        cmdDrawCulled(commandBuffer, CULL_PHASE_LATE);
+    }
+
+    vkCmdEndRenderPass(commandBuffer);
+
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
+}
+
+void createCommandBuffers()
+{
+    VkCommandBufferAllocateInfo allocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool        = vkData.commandPool,
+        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = vkData.swapchainImageCount
     };
 
-    VkWriteDescriptorSet descriptorWrites[] = {
-        {
-            .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet           = *descriptorSet,
-            .dstBinding       = 0,
-            .dstArrayElement  = 0,
-            .descriptorType   = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            .descriptorCount  = 1,
-            .pBufferInfo      = &bufferInfo
-        }, {
-            .sType            = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet           = *descriptorSet,
-            .dstBinding       = 1,
-            .dstArrayElement  = 0,
-            .descriptorType   = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .descriptorCount  = 1,
-            .pImageInfo       = &imageInfo
+    vkData.swapchainCommandBuffers = malloc(vkData.swapchainImageCount * sizeof(VkCommandBuffer));
+
+    VK_CHECK(vkAllocateCommandBuffers(vkData.device, &allocInfo, vkData.swapchainCommandBuffers));
+
+    // Segments are allocated as the render queue grows, starting empty
+    if (vkData.recordPoolCount > 0)
+        segmentCaches = calloc(vkData.swapchainImageCount, sizeof(SegmentCache));
+
+    for (size_t i = 0; i < vkData.swapchainImageCount; ++i)
+        recordCommandBuffer(i);
+}
+
+void createSemaphores()
+{
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+    };
+
+    VK_CHECK(vkCreateSemaphore(vkData.device, &semaphoreInfo, NULL, &vkData.imageAvailableSemaphore));
+    VK_CHECK(vkCreateSemaphore(vkData.device, &semaphoreInfo, NULL, &vkData.renderFinishedSemaphore));
+
+    // Signaled, as if a frame had already finished
+    VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT
+    };
+
+    VK_CHECK(vkCreateFence(vkData.device, &fenceInfo, NULL, &vkData.frameFence));
+    vkData.submittedFrames = 0;
+    vkData.completedFrames = 0;
+}
+
+// Retired objects may be used by any frame submitted so far
+void deferDeletion(DeferredDestroy destroy, void *data)
+{
+    if (deletionQueue.count == deletionQueue.capacity) {
+        deletionQueue.capacity = deletionQueue.capacity ? 2 * deletionQueue.capacity : 16;
+        deletionQueue.entries  = realloc(deletionQueue.entries, deletionQueue.capacity * sizeof(DeferredDeletion));
+    }
+
+    deletionQueue.entries[deletionQueue.count++] = (DeferredDeletion) {
+        .frame   = vkData.submittedFrames,
+        .destroy = destroy,
+        .data    = data
+    };
+}
+
+void runDeferredDeletions(uint64_t completedFrames)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < deletionQueue.count; i++) {
+        if (deletionQueue.entries[i].frame <= completedFrames)
+            deletionQueue.entries[i].destroy(deletionQueue.entries[i].data);
+        else
+            deletionQueue.entries[kept++] = deletionQueue.entries[i];
+    }
+
+    deletionQueue.count = kept;
+}
+
+// Only one frame is in flight, so waiting for the last one completes them all
+void waitForSubmittedFrames()
+{
+    VK_CHECK(vkWaitForFences(vkData.device, 1, &vkData.frameFence, VK_TRUE, UINT64_MAX));
+
+    vkData.completedFrames = vkData.submittedFrames;
+    runDeferredDeletions(vkData.completedFrames);
+}
+
+typedef struct {
+    VkBuffer       buffer;
+    VkDeviceMemory memory;
+} RetiredBuffer;
+
+static void destroyRetiredBuffer(void *data)
+{
+    RetiredBuffer *old = data;
+
+    vkDestroyBuffer(vkData.device, old->buffer, NULL);
+    vkFreeMemory(vkData.device, old->memory, NULL);
+    free(old);
+}
+
+void retireBuffer(VkBuffer buffer, VkDeviceMemory memory)
+{
+    RetiredBuffer *old = malloc(sizeof(RetiredBuffer));
+    old->buffer = buffer;
+    old->memory = memory;
+
+    deferDeletion(destroyRetiredBuffer, old);
+}
+
+// Dispatchable handles are pointers, so the command buffer is the data
+static void freeRetiredCommandBuffer(void *data)
+{
+    VkCommandBuffer commandBuffer = data;
+
+    vkFreeCommandBuffers(vkData.device, vkData.commandPool, 1, &commandBuffer);
+}
+
+// Makes the queued scene uploads visible to the frame's commands, returns
+// VK_NULL_HANDLE without any
+VkCommandBuffer endSceneUploads()
+{
+    if (sceneUploads.commandBuffer == VK_NULL_HANDLE)
+        return VK_NULL_HANDLE;
+
+    VkMemoryBarrier barrier = {
+        .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+
+    vkCmdPipelineBarrier(sceneUploads.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+
+    VK_CHECK(vkEndCommandBuffer(sceneUploads.commandBuffer));
+
+    return sceneUploads.commandBuffer;
+}
+
+// Called once the uploads were submitted, or at exit when they never were
+void retireSceneUploads()
+{
+    if (sceneUploads.commandBuffer == VK_NULL_HANDLE)
+        return;
+
+    deferDeletion(freeRetiredCommandBuffer, sceneUploads.commandBuffer);
+
+    for (size_t i = 0; i < sceneUploads.count; i++)
+        retireBuffer(sceneUploads.stagingBuffers[i], sceneUploads.stagingMemories[i]);
+
+    sceneUploads.commandBuffer = VK_NULL_HANDLE;
+    sceneUploads.count         = 0;
+}
+
+// Every cached segment is recorded again, for changes the draw hashes don't
+// cover such as new geometry buffers
+void invalidateSegmentCaches()
+{
+    if (vkData.recordPoolCount == 0)
+        return;
+
+    for (uint32_t i = 0; i < vkData.swapchainImageCount; ++i) {
+        for (uint32_t j = 0; j < segmentCaches[i].capacity; j++)
+            segmentCaches[i].hashes[j] = 0;
+
+        segmentCaches[i].primaryValid = false;
+    }
+}
+
+// Brings everything derived from the meshes and materials up to date after
+// loads replaced placeholders. Waits for the frame in flight so the command
+// buffers can be recorded again, the buffers are uploaded with the next frame.
+void rebuildScene()
+{
+    waitForSubmittedFrames();
+
+    createPipelineVariants();
+
+    // The instances are sorted again, so queued updates may name the wrong
+    // instance. writeObjectData() writes every transform anyway.
+    for (uint32_t i = 0; i < objectUpdates.count; ++i)
+        objectUpdates.slots[objectUpdates.entries[i].index] = UINT32_MAX;
+    objectUpdates.count = 0;
+
+    buildBatches();
+
+    free(transformInstances);
+    writeObjectData();
+
+    // The visibility of last frame belongs to the old instance order, the
+    // late phase draws whatever that gets wrong
+    if (vkData.gpuCullSupported) {
+        writeBatchData();
+
+        for (size_t i = 0; i < vkData.swapchainImageCount; ++i) {
+            vkResetCommandBuffer(vkData.swapchainCommandBuffers[i], 0);
+            recordCommandBuffer(i);
         }
+    } else
+        invalidateSegmentCaches();
+}
+
+// The upload of decoded loads in flight, the staging memory and the bigger
+// geometry buffers are kept until its fence signals
+struct {
+    bool            pending;
+    VkFence         fence;
+    VkCommandBuffer commandBuffer;
+
+    AssetLoad **loads;
+    size_t      loadCount;
+
+    // Copies of the geometry buffers with the loaded meshes appended,
+    // VK_NULL_HANDLE without meshes
+    VkBuffer       stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    VkBuffer       vertexBuffer;
+    VkDeviceMemory vertexBufferMemory;
+    VkBuffer       indexBuffer;
+    VkDeviceMemory indexBufferMemory;
+    uint32_t       vertexCount;
+    uint32_t       indexCount;
+
+    // At most one texture per upload, since finishing the compute mip
+    // generation resets its descriptor pool
+    AssetLoad    *texture;
+    TextureArray  textureArray;
+    TextureUpload textureUpload;
+} assetUpload;
+
+// Records the new geometry buffers: the old contents followed by the loaded
+// meshes, which already have their offsets
+static void cmdAppendGeometry(VkCommandBuffer commandBuffer)
+{
+    VkDeviceSize oldVertexSize = (VkDeviceSize) vkData.vertexCount * sizeof(Vertex);
+    VkDeviceSize oldIndexSize  = (VkDeviceSize) vkData.indexCount * sizeof(uint32_t);
+    VkDeviceSize vertexSize    = (VkDeviceSize) assetUpload.vertexCount * sizeof(Vertex) - oldVertexSize;
+    VkDeviceSize indexSize     = (VkDeviceSize) assetUpload.indexCount * sizeof(uint32_t) - oldIndexSize;
+
+    createBuffer(vkData.physicalDevice, vkData.device, vertexSize + indexSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &assetUpload.stagingBuffer, &assetUpload.stagingBufferMemory);
+
+    void *data;
+    vkMapMemory(vkData.device, assetUpload.stagingBufferMemory, 0, vertexSize + indexSize, 0, &data);
+
+    for (size_t i = 0; i < assetUpload.loadCount; ++i) {
+        Mesh *mesh = &assetUpload.loads[i]->mesh;
+        if (assetUpload.loads[i]->type != ASSET_MESH)
+            continue;
+
+        memcpy((Vertex *) data + (mesh->vertexOffset - vkData.vertexCount), mesh->vertices,
+               mesh->vertexCount * sizeof(Vertex));
+        memcpy((uint32_t *) ((char *) data + vertexSize) + (mesh->firstIndex - vkData.indexCount), mesh->indices,
+               mesh->indexCount * sizeof(uint32_t));
+    }
+
+    vkUnmapMemory(vkData.device, assetUpload.stagingBufferMemory);
+
+    createBuffer(vkData.physicalDevice, vkData.device, oldVertexSize + vertexSize,
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                 | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &assetUpload.vertexBuffer, &assetUpload.vertexBufferMemory);
+    createBuffer(vkData.physicalDevice, vkData.device, oldIndexSize + indexSize,
+                 VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                 | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &assetUpload.indexBuffer, &assetUpload.indexBufferMemory);
+
+    // Frames still in flight only read the old buffers
+    VkBufferCopy vertexCopies[] = {
+        {.srcOffset = 0, .dstOffset = 0,             .size = oldVertexSize},
+        {.srcOffset = 0, .dstOffset = oldVertexSize, .size = vertexSize}
+    };
+    VkBufferCopy indexCopies[] = {
+        {.srcOffset = 0,          .dstOffset = 0,            .size = oldIndexSize},
+        {.srcOffset = vertexSize, .dstOffset = oldIndexSize, .size = indexSize}
+    };
+
+    vkCmdCopyBuffer(commandBuffer, vkData.vertexBuffer, assetUpload.vertexBuffer, 1, &vertexCopies[0]);
+    vkCmdCopyBuffer(commandBuffer, assetUpload.stagingBuffer, assetUpload.vertexBuffer, 1, &vertexCopies[1]);
+    vkCmdCopyBuffer(commandBuffer, vkData.indexBuffer, assetUpload.indexBuffer, 1, &indexCopies[0]);
+    vkCmdCopyBuffer(commandBuffer, assetUpload.stagingBuffer, assetUpload.indexBuffer, 1, &indexCopies[1]);
+
+    // The fence doesn't make the copies visible to later submissions
+    VkMemoryBarrier barrier = {
+        .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT
     };
 
-    vkUpdateDescriptorSets(vkData.device, sizeof(descriptorWrites) / sizeof(descriptorWrites[0]),
-                           descriptorWrites, 0, NULL);
-}
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+// Records every ready mesh and up to one texture into a command buffer that
+// is submitted with a fence, frames keep drawing the placeholders meanwhile
+void startAssetUpload()
+{
+    assetUpload.loads       = malloc(assetLoads.readyCount * sizeof(AssetLoad *));
+    assetUpload.loadCount   = 0;
+    assetUpload.texture     = NULL;
+    assetUpload.vertexCount = vkData.vertexCount;
+    assetUpload.indexCount  = vkData.indexCount;
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < assetLoads.readyCount; ++i) {
+        AssetLoad *load = assetLoads.ready[i];
+
+        if (load->type == ASSET_TEXTURE && assetUpload.texture) {
+            assetLoads.ready[kept++] = load;
+            continue;
+        }
+
+        if (load->type == ASSET_TEXTURE)
+            assetUpload.texture = load;
+        else {
+            load->mesh.vertexOffset = assetUpload.vertexCount;
+            load->mesh.firstIndex   = assetUpload.indexCount;
+            assetUpload.vertexCount += load->mesh.vertexCount;
+            assetUpload.indexCount  += load->mesh.indexCount;
+        }
+
+        assetUpload.loads[assetUpload.loadCount++] = load;
+    }
+
+    assetLoads.readyCount = kept;
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands(vkData.device, vkData.commandPool);
+
+    if (assetUpload.vertexCount > vkData.vertexCount)
+        cmdAppendGeometry(commandBuffer);
+
+    if (assetUpload.texture) {
+        VtdData *image = &assetUpload.texture->image;
+        VtdPackArray src = {
+            .channels   = 4,
+            .width      = image->width,
+            .height     = image->height,
+            .layerCount = 1,
+            .atlas      = false,
+            .pixels     = image->pixels
+        };
 
-void loadModel(Model *model, const char *modelPath, const char *texturePath)
-{
-    loadModelGeometry(model, modelPath);
-    loadModelTexture(model, texturePath, MIP_LEVELS);
-    createVertexBuffer(&model->vertexBuffer, &model->vertexBufferMemory, model->vertices, model->vertexCount);
-    createIndexBuffer(&model->indexBuffer, &model->indexBufferMemory, model->indices, model->indexCount);
-    createUniformBuffer(&model->uniformBuffer, &model->uniformBufferMemory);
-    createDescriptorSet(&model->descriptorSet, model->uniformBuffer,
-                        model->textureImageView, model->textureSampler);
-}
+        cmdUploadTextureArray(commandBuffer, &assetUpload.textureArray, &src, MIP_LEVELS, true,
+                              &assetUpload.textureUpload);
+    }
 
-void createDescriptorPool()
-{
-    VkDescriptorPoolSize poolSizes[] = {
-        {
-            .type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            .descriptorCount = modelCount
-        }, {
-            .type            = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .descriptorCount = modelCount
-        }
-    };
+    VK_CHECK(vkEndCommandBuffer(commandBuffer));
 
-    VkDescriptorPoolCreateInfo poolInfo = {
-        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-        .poolSizeCount = sizeof(poolSizes) / sizeof(poolSizes[0]),
-        .pPoolSizes    = poolSizes,
-        .maxSets       = modelCount
+    if (assetUpload.fence == VK_NULL_HANDLE) {
+        VkFenceCreateInfo fenceInfo = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+        };
+
+        VK_CHECK(vkCreateFence(vkData.device, &fenceInfo, NULL, &assetUpload.fence));
+    }
+
+    VkSubmitInfo submitInfo = {
+        .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers    = &commandBuffer
     };
 
-    VK_CHECK(vkCreateDescriptorPool(vkData.device, &poolInfo, NULL, &vkData.descriptorPool));
+    VK_CHECK(vkQueueSubmit(vkData.graphicsQueue, 1, &submitInfo, assetUpload.fence));
+
+    assetUpload.commandBuffer = commandBuffer;
+    assetUpload.pending       = true;
 }
 
-void createCommandBuffers()
+// Swaps the uploaded assets in for their placeholders
+void finishAssetUpload()
 {
-    VkCommandBufferAllocateInfo allocInfo = {
-        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool        = vkData.commandPool,
-        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = vkData.swapchainImageCount
-    };
+    vkFreeCommandBuffers(vkData.device, vkData.commandPool, 1, &assetUpload.commandBuffer);
+    VK_CHECK(vkResetFences(vkData.device, 1, &assetUpload.fence));
 
-    vkData.swapchainCommandBuffers = malloc(vkData.swapchainImageCount * sizeof(VkCommandBuffer));
+    if (assetUpload.vertexBuffer != VK_NULL_HANDLE) {
+        vkDestroyBuffer(vkData.device, assetUpload.stagingBuffer, NULL);
+        vkFreeMemory(vkData.device, assetUpload.stagingBufferMemory, NULL);
 
-    VK_CHECK(vkAllocateCommandBuffers(vkData.device, &allocInfo, vkData.swapchainCommandBuffers));
+        retireBuffer(vkData.vertexBuffer, vkData.vertexBufferMemory);
+        retireBuffer(vkData.indexBuffer, vkData.indexBufferMemory);
 
-    for (size_t i = 0; i < vkData.swapchainImageCount; ++i) {
-        VkCommandBufferBeginInfo beginInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT
-        };
+        vkData.vertexBuffer       = assetUpload.vertexBuffer;
+        vkData.vertexBufferMemory = assetUpload.vertexBufferMemory;
+        vkData.indexBuffer        = assetUpload.indexBuffer;
+        vkData.indexBufferMemory  = assetUpload.indexBufferMemory;
+        vkData.vertexCount        = assetUpload.vertexCount;
+        vkData.indexCount         = assetUpload.indexCount;
+
+        assetUpload.vertexBuffer = VK_NULL_HANDLE;
+        assetUpload.indexBuffer  = VK_NULL_HANDLE;
+    }
 
-        vkBeginCommandBuffer(vkData.swapchainCommandBuffers[i], &beginInfo);
+    for (size_t i = 0; i < assetUpload.loadCount; ++i) {
+        AssetLoad *load = assetUpload.loads[i];
 
-        VkClearValue clearValues[3];
-        size_t clearValueCount = 2;
+        if (load->type == ASSET_MESH) {
+            Mesh *mesh = &meshes[load->index];
 
-        clearValues[0].color.float32[0] = 0.0f;
-        clearValues[0].color.float32[1] = 0.0f;
-        clearValues[0].color.float32[2] = 0.0f;
-        clearValues[0].color.float32[3] = 1.0f;
+            load->mesh.path = mesh->path;
+            cleanupMesh(mesh);
+            *mesh = load->mesh;
+        } else {
+            finishTextureUpload(&assetUpload.textureUpload);
 
-        clearValues[1].depthStencil.depth   = 1.0f;
-        clearValues[1].depthStencil.stencil = 0;
+            textureArrays = realloc(textureArrays, (textureArrayCount + 1) * sizeof(TextureArray));
+            textureArrays[textureArrayCount] = assetUpload.textureArray;
+            addTextureDescriptor(textureArrayCount);
 
-        if (vkData.samples > VK_SAMPLE_COUNT_1_BIT) {
-            clearValues[2].color.float32[0] = 0.0f;
-            clearValues[2].color.float32[1] = 0.0f;
-            clearValues[2].color.float32[2] = 0.0f;
-            clearValues[2].color.float32[3] = 1.0f;
+            Material *material = &materials[load->index];
+            material->textureArray   = textureArrayCount++;
+            material->textureLayer   = 0;
+            material->uvTransform[0] = 1.0f;
+            material->uvTransform[1] = 1.0f;
+            material->uvTransform[2] = 0.0f;
+            material->uvTransform[3] = 0.0f;
+            material->loading        = false;
 
-            clearValueCount = 3;
+            vtdFree(&load->image);
         }
 
-        VkRenderPassBeginInfo renderPassInfo = {
-            .sType       = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-            .renderPass  = vkData.renderPass,
-            .framebuffer = vkData.swapchainFramebuffers[i],
-            .renderArea = {
-                .offset = {0, 0},
-                .extent = vkData.swapchainImageExtent
-            },
-            .clearValueCount = clearValueCount,
-            .pClearValues    = clearValues
-        };
+        free(load);
+        assetLoads.remaining--;
+    }
+
+    free(assetUpload.loads);
+    assetUpload.loads   = NULL;
+    assetUpload.texture = NULL;
+    assetUpload.pending = false;
+
+    rebuildScene();
+}
+
+// Called once a frame. Decoded loads go into an upload, and a finished upload
+// is swapped in, which is the only time this waits for the GPU.
+void updateAssetLoads()
+{
+    if (assetLoads.remaining == 0)
+        return;
+
+    AssetLoad *load;
+    while ((load = assetLoaderPoll(&assetLoader))) {
+        if (assetLoads.readyCount == assetLoads.readyCapacity) {
+            assetLoads.readyCapacity = assetLoads.readyCapacity ? 2 * assetLoads.readyCapacity : 16;
+            assetLoads.ready = realloc(assetLoads.ready, assetLoads.readyCapacity * sizeof(AssetLoad *));
+        }
+
+        assetLoads.ready[assetLoads.readyCount++] = load;
+    }
+
+    if (assetUpload.pending) {
+        VkResult status = vkGetFenceStatus(vkData.device, assetUpload.fence);
+        if (status == VK_NOT_READY)
+            return;
+
+        VK_CHECK(status);
+        finishAssetUpload();
+    }
 
-        // Record draw commands into the command buffer
-        vkCmdBeginRenderPass(vkData.swapchainCommandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    if (assetLoads.readyCount > 0)
+        startAssetUpload();
+}
+
+// The device is idle, so an unfinished upload is simply thrown away
+void cleanupAssetLoads()
+{
+    assetLoaderFree(&assetLoader);
 
-        pushConsts.dirLight[0] = 1.0f;
-        pushConsts.dirLight[1] = 1.0f;
-        pushConsts.dirLight[2] = 1.0f;
-        pushConsts.dirLight[3] = 0.0f;
+    AssetLoad *load;
+    while ((load = assetLoaderPoll(&assetLoader)))
+        freeAssetLoad(load);
 
-        vec3_norm(pushConsts.dirLight, pushConsts.dirLight);
+    for (size_t i = 0; i < assetLoads.readyCount; ++i)
+        freeAssetLoad(assetLoads.ready[i]);
 
-        pushConsts.dirLightColor[0] = 1.0f;
-        pushConsts.dirLightColor[1] = 1.0f;
-        pushConsts.dirLightColor[2] = 1.0f;
-        pushConsts.dirLightColor[3] = 1.0f;
+    free(assetLoads.ready);
 
-        vkCmdPushConstants(vkData.swapchainCommandBuffers[i], vkData.pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT,
-                           0, sizeof(struct PushConstantData), &pushConsts);
+    if (assetUpload.pending) {
+        vkFreeCommandBuffers(vkData.device, vkData.commandPool, 1, &assetUpload.commandBuffer);
 
-        vkCmdBindPipeline(vkData.swapchainCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          vkData.graphicsPipeline);
+        if (assetUpload.vertexBuffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(vkData.device, assetUpload.stagingBuffer, NULL);
+            vkFreeMemory(vkData.device, assetUpload.stagingBufferMemory, NULL);
+            vkDestroyBuffer(vkData.device, assetUpload.vertexBuffer, NULL);
+            vkFreeMemory(vkData.device, assetUpload.vertexBufferMemory, NULL);
+            vkDestroyBuffer(vkData.device, assetUpload.indexBuffer, NULL);
+            vkFreeMemory(vkData.device, assetUpload.indexBufferMemory, NULL);
+        }
 
-        for (size_t j = 0; j < modelCount; j++) {
-            VkBuffer vertexBuffers[] = {models[j].vertexBuffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(vkData.swapchainCommandBuffers[i], 0, 1, vertexBuffers, offsets);
-            vkCmdBindIndexBuffer(vkData.swapchainCommandBuffers[i], models[j].indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-            vkCmdBindDescriptorSets(vkData.swapchainCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    vkData.pipelineLayout, 0, 1, &models[j].descriptorSet, 0, NULL);
-            vkCmdDrawIndexed(vkData.swapchainCommandBuffers[i], models[j].indexCount, 1, 0, 0, 0);
+        if (assetUpload.texture) {
+            finishTextureUpload(&assetUpload.textureUpload);
+            cleanupTextureArray(&assetUpload.textureArray);
         }
 
-        vkCmdEndRenderPass(vkData.swapchainCommandBuffers[i]);
+        for (size_t i = 0; i < assetUpload.loadCount; ++i)
+            freeAssetLoad(assetUpload.loads[i]);
 
-        VK_CHECK(vkEndCommandBuffer(vkData.swapchainCommandBuffers[i]));
+        free(assetUpload.loads);
     }
+
+    vkDestroyFence(vkData.device, assetUpload.fence, NULL);
 }
 
-void createSemaphores()
+void createScene()
 {
-    VkSemaphoreCreateInfo semaphoreInfo = {
-        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
-    };
+    //uint32_t chalet = addMesh("models/chalet.vmd");
+    uint32_t dragon = ASYNC_LOADING ? addMeshAsync("models/dragon.vmd") : addMesh("models/dragon.vmd");
+    uint32_t ground = addMesh("models/test.vmd");
 
-    VK_CHECK(vkCreateSemaphore(vkData.device, &semaphoreInfo, NULL, &vkData.imageAvailableSemaphore));
-    VK_CHECK(vkCreateSemaphore(vkData.device, &semaphoreInfo, NULL, &vkData.renderFinishedSemaphore));
-}
+    uint32_t dragonMaterial = ASYNC_LOADING ? addMaterialAsync("textures/Dragon_ground_color.vtd")
+                                            : addMaterial("textures/Dragon_ground_color.vtd");
+    uint32_t groundMaterial = addMaterial("textures/tile.vtd");
 
-double showTime(char *name, double prev)
-{
-    double time = glfwGetTime();
-    printf("%-30s%-15f%f\n", name, time, time - prev);
-    return time;
+    vec3 dragonScale = {0.04f, 0.04f, 0.04f};
+    float spacing = 1.5f, offset = 0.5f * spacing * (DRAGON_GRID - 1);
+
+    for (size_t z = 0; z < DRAGON_GRID; ++z) {
+        for (size_t x = 0; x < DRAGON_GRID; ++x) {
+            vec3 pos = {x * spacing - offset, -0.5f, z * spacing - offset};
+            addInstance(dragon, dragonMaterial, pos, dragonScale);
+        }
+    }
+
+    vec3 groundPos = {0.0f, -1.0f, 0.0f}, groundScale = {1.0f, 1.0f, 1.0f};
+    addInstance(ground, groundMaterial, groundPos, groundScale);
+
+    pushConsts.dirLight[0] = 1.0f;
+    pushConsts.dirLight[1] = 1.0f;
+    pushConsts.dirLight[2] = 1.0f;
+    pushConsts.dirLight[3] = 0.0f;
+
+    vec3_norm(pushConsts.dirLight, pushConsts.dirLight);
+
+    pushConsts.dirLightColor[0] = 1.0f;
+    pushConsts.dirLightColor[1] = 1.0f;
+    pushConsts.dirLightColor[2] = 1.0f;
+    pushConsts.dirLightColor[3] = 1.0f;
 }
 
-void initVulkan()
-{
-    double time = showTime("start", glfwGetTime());
 
-    createInstance();
-    time = showTime("createInstance", time);
-    loadInstanceFunctions();
-    time = showTime("loadInstanceFunctions", time);
 
-#ifdef VALIDATION_LAYERS
-    setupDebugCallback();
-    time = showTime("setupDebugCallback", time);
-#endif // VALIDATION_LAYERS
+// Everything recreateSwapchain replaces, destroyed once the last frame that
+// may use it has finished
+typedef struct {
+    VkSwapchainKHR   swapchain;
+    uint32_t         imageCount;
+    VkImage         *images;
+    VkImageView     *imageViews;
+    VkFramebuffer   *framebuffers;
+    VkCommandBuffer *commandBuffers;
+    SegmentCache    *segmentCaches;
 
-    createSurface();
-    time = showTime("createSurface", time);
+    VkImageView    depthImageView;
+    VkImage        depthImage;
+    VkDeviceMemory depthImageMemory;
 
-    pickPhysicalDevice();
-    time = showTime("pickPhysicalDevice", time);
-    createLogicalDevice();
-    time = showTime("createLogicalDevice", time);
+    VkImageView    msImageView;
+    VkImage        msImage;
+    VkDeviceMemory msImageMemory;
 
-    createCommandPool();
-    time = showTime("createCommandPool", time);
+    // VK_NULL_HANDLE without Hi-Z
+    VkImage          depthPyramid;
+    VkDeviceMemory   depthPyramidMemory;
+    VkImageView      depthPyramidView;
+    VkImageView      depthPyramidLevelViews[DEPTH_PYRAMID_MAX_LEVELS];
+    uint32_t         depthPyramidLevels;
+    VkDescriptorPool depthPyramidDescriptorPool;
 
-    // Swapchain things
-    createSwapchain(VK_NULL_HANDLE);
-    time = showTime("createSwapchain", time);
-    createImageViews();
-    time = showTime("createImageViews", time);
+    // Only retired when the surface format changed
+    VkRenderPass     renderPass;
+    VkRenderPass     lateRenderPass;
+    VkPipelineLayout pipelineLayout;
+    PipelineVariants pipelineVariants;
+} RetiredSwapchain;
 
-    // These three have to be called in this order
-    createRenderPass();
-    time = showTime("createRenderPass", time);
-    createDepthResources();
-    time = showTime("createDepthResources", time);
-    createFramebuffers();
-    time = showTime("createFramebuffers", time);
+void destroyRetiredSwapchain(void *data)
+{
+    RetiredSwapchain *old = data;
 
-    loadShaders();
-    time = showTime("loadShaders", time);
-    createDescriptorSetLayout();
-    time = showTime("createDescriptorSetLayout", time);
+    vkDestroyImageView(vkData.device, old->depthImageView, NULL);
+    vkDestroyImage(vkData.device, old->depthImage, NULL);
+    vkFreeMemory(vkData.device, old->depthImageMemory, NULL);
 
-    // Swapchain things
-    createGraphicsPipeline();
-    time = showTime("createGraphicsPipeline", time);
+    vkDestroyImageView(vkData.device, old->msImageView, NULL);
+    vkDestroyImage(vkData.device, old->msImage, NULL);
+    vkFreeMemory(vkData.device, old->msImageMemory, NULL);
 
-    // Shadow things
-    createShadowRenderPass();
-    time = showTime("createShadowRenderPass", time);
-    createShadowFramebuffer();
-    time = showTime("createShadowFramebuffer", time);
-    createShadowPipeline();
-    time = showTime("createShadowPipeline", time);
-    createShadowCommandBuffer();
-    time = showTime("createShadowCommandBuffer", time);
-    createShadowSemaphore();
-    time = showTime("createShadowSemaphore", time);
+    if (old->depthPyramid != VK_NULL_HANDLE) {
+        vkDestroyDescriptorPool(vkData.device, old->depthPyramidDescriptorPool, NULL);
 
-    createDescriptorPool();
-    time = showTime("createDescriptorPool", time);
+        for (uint32_t i = 0; i < old->depthPyramidLevels; ++i)
+            vkDestroyImageView(vkData.device, old->depthPyramidLevelViews[i], NULL);
 
-    //loadModel(&models[0], "models/chalet.vmd", "textures/chalet.vtd");
-    loadModel(&models[0], "models/dragon.vmd", "textures/Dragon_ground_color.vtd");
-    time = showTime("loadModel", time);
+        vkDestroyImageView(vkData.device, old->depthPyramidView, NULL);
+        vkDestroyImage(vkData.device, old->depthPyramid, NULL);
+        vkFreeMemory(vkData.device, old->depthPyramidMemory, NULL);
+    }
 
-    loadModel(&models[1], "models/test.vmd", "textures/tile.vtd");
-    time = showTime("loadModel", time);
+    vkFreeCommandBuffers(vkData.device, vkData.commandPool, old->imageCount, old->commandBuffers);
+    free(old->commandBuffers);
+    freeSegmentCaches(old->imageCount, old->segmentCaches);
 
-    // Swapchain things
-    createCommandBuffers();
-    time = showTime("createCommandBuffers", time);
+    destroyPipelineVariants(&old->pipelineVariants);
+    vkDestroyPipelineLayout(vkData.device, old->pipelineLayout, NULL);
+    vkDestroyRenderPass(vkData.device, old->renderPass, NULL);
+    vkDestroyRenderPass(vkData.device, old->lateRenderPass, NULL);
 
-    createSemaphores();
-    time = showTime("createSemaphores", time);
-}
+    for (size_t i = 0; i < old->imageCount; ++i) {
+        vkDestroyFramebuffer(vkData.device, old->framebuffers[i], NULL);
+        vkDestroyImageView(vkData.device, old->imageViews[i], NULL);
+    }
 
+    free(old->framebuffers);
+    free(old->imageViews);
+    free(old->images);
 
+    vkDestroySwapchainKHR(vkData.device, old->swapchain, NULL);
+    free(old);
+}
 
+// The old objects, the depth pyramid included, go to the deletion queue
+// instead of waiting for the GPU.
+// The render pass and pipeline only depend on the image format, not the
+// size, so they are kept unless the format changed.
 void recreateSwapchain()
 {
-    VkSwapchainKHR oldSwapchain = vkData.swapchain;
+    RetiredSwapchain *old = calloc(1, sizeof(RetiredSwapchain));
+
+    old->swapchain      = vkData.swapchain;
+    old->imageCount     = vkData.swapchainImageCount;
+    old->images         = vkData.swapchainImages;
+    old->imageViews     = vkData.swapchainImageViews;
+    old->framebuffers   = vkData.swapchainFramebuffers;
+    old->commandBuffers = vkData.swapchainCommandBuffers;
+    old->segmentCaches  = segmentCaches;
+
+    old->depthImageView   = vkData.depthImageView;
+    old->depthImage       = vkData.depthImage;
+    old->depthImageMemory = vkData.depthImageMemory;
+
+    old->msImage       = vkData.msImage;
+    old->msImageMemory = vkData.msImageMemory;
+    old->msImageView   = vkData.msImageView;
+
+    if (vkData.hiZSupported) {
+        old->depthPyramid               = vkData.depthPyramid;
+        old->depthPyramidMemory         = vkData.depthPyramidMemory;
+        old->depthPyramidView           = vkData.depthPyramidView;
+        old->depthPyramidLevels         = vkData.depthPyramidLevels;
+        old->depthPyramidDescriptorPool = vkData.depthPyramidDescriptorPool;
+        memcpy(old->depthPyramidLevelViews, vkData.depthPyramidLevelViews, sizeof(old->depthPyramidLevelViews));
+    }
+
+    VkFormat oldFormat = vkData.swapchainImageFormat.format;
 
-    uint32_t         oldImageCount     = vkData.swapchainImageCount;
-    VkImage         *oldImages         = vkData.swapchainImages;
-    VkImageView     *oldImageViews     = vkData.swapchainImageViews;
-    VkFramebuffer   *oldFramebuffers   = vkData.swapchainFramebuffers;
-    VkCommandBuffer *oldCommandBuffers = vkData.swapchainCommandBuffers;
+    createSwapchain(old->swapchain);
+    createImageViews();
 
-    VkRenderPass     oldRenderPass       = vkData.renderPass;
-    VkPipelineLayout oldPipelineLayout   = vkData.pipelineLayout;
-    VkPipeline       oldGraphicsPipeline = vkData.graphicsPipeline;
+    bool formatChanged = vkData.swapchainImageFormat.format != oldFormat;
 
-    VkImageView    oldDepthImageView   = vkData.depthImageView;
-    VkImage        oldDepthImage       = vkData.depthImage;
-    VkDeviceMemory oldDepthImageMemory = vkData.depthImageMemory;
+    if (formatChanged) {
+        old->renderPass       = vkData.renderPass;
+        old->lateRenderPass   = vkData.hiZSupported ? vkData.lateRenderPass : VK_NULL_HANDLE;
+        old->pipelineLayout   = vkData.pipelineLayout;
+        old->pipelineVariants = pipelineVariants;
 
-    VkImage        oldMsImage            = vkData.msImage;
-    VkDeviceMemory oldMsImageMemory      = vkData.msImageMemory;
-    VkImageView    oldMsImageView        = vkData.msImageView;
+        memset(&pipelineVariants, 0, sizeof(PipelineVariants));
 
-    createSwapchain(oldSwapchain);
-    createImageViews();
+        createRenderPass();
+    }
 
-    createRenderPass();
     createDepthResources();
     createFramebuffers();
 
-    createGraphicsPipeline();
+    // The frame in flight reads the pyramid through the current cull set, so
+    // the new pyramid goes into the other one. That set's last frame finished
+    // before the one in flight was submitted.
+    if (vkData.hiZSupported) {
+        vkData.cullDescriptorSet ^= 1;
+        createDepthPyramid();
+    }
+
+    if (formatChanged) {
+        createGraphicsPipeline();
+        createPipelineVariants();
+    }
+
     createCommandBuffers();
 
     // TODO: Temporary update for projection matrix
     float aspect = vkData.swapchainImageExtent.width / (float) vkData.swapchainImageExtent.height;
-    mat4x4_perspective(ubo.proj, (M_PI / 2) * (9.0 / 16.0), aspect, 0.1f, 1000.0f);
+    mat4x4_perspective(scene.proj, (M_PI / 2) * (9.0 / 16.0), aspect, NEAR_PLANE, FAR_PLANE);
     // End TODO
 
-    vkQueueWaitIdle(vkData.presentQueue);
-
-    // Clean up old swapchain data
-    vkDestroyImageView(vkData.device, oldDepthImageView, NULL);
-    vkDestroyImage(vkData.device, oldDepthImage, NULL);
-    vkFreeMemory(vkData.device, oldDepthImageMemory, NULL);
-
-    vkDestroyImageView(vkData.device, oldMsImageView, NULL);
-    vkDestroyImage(vkData.device, oldMsImage, NULL);
-    vkFreeMemory(vkData.device, oldMsImageMemory, NULL);
-
-    vkFreeCommandBuffers(vkData.device, vkData.commandPool, oldImageCount, oldCommandBuffers);
-    free(oldCommandBuffers);
-
-    vkDestroyPipeline(vkData.device, oldGraphicsPipeline, NULL);
-    vkDestroyPipelineLayout(vkData.device, oldPipelineLayout, NULL);
-    vkDestroyRenderPass(vkData.device, oldRenderPass, NULL);
-
-    for (size_t i = 0; i < oldImageCount; ++i) {
-        vkDestroyFramebuffer(vkData.device, oldFramebuffers[i], NULL);
-        vkDestroyImageView(vkData.device, oldImageViews[i], NULL);
-    }
-
-    free(oldFramebuffers);
-    free(oldImageViews);
-    free(oldImages);
-
-    vkDestroySwapchainKHR(vkData.device, oldSwapchain, NULL);
+    deferDeletion(destroyRetiredSwapchain, old);
 }
 
 
-
 void windowErrorCallback(int error, const char *desc)
 {
     fprintf(stderr, "GLFW Error: %s\n", desc);
@@ -2118,32 +6361,269 @@ void initWindow()
     glfwSetWindowSizeCallback(window, windowResizeCallback);
 }
 
+// Startup steps grouped into tasks, the functions in each depend on the ones
+// before them
+static void startInstance()
+{
+    createInstance();
+    loadInstanceFunctions();
+
+#ifdef VALIDATION_LAYERS
+    setupDebugCallback();
+#endif // VALIDATION_LAYERS
 
+    createSurface();
+}
 
-void initMats()
+static void startDevice()
+{
+    pickPhysicalDevice();
+    checkBindlessSupport();
+    checkGpuCullSupport();
+    createLogicalDevice();
+    createPipelineCache();
+    createCommandPool();
+}
+
+static void startSwapchain()
+{
+    createSwapchain(VK_NULL_HANDLE);
+    createImageViews();
+
+    // These three have to be called in this order
+    createRenderPass();
+    createDepthResources();
+    createFramebuffers();
+}
+
+static void startShaders()
+{
+    loadShaders();
+    createDescriptorSetLayout();
+    createGraphicsPipeline();
+}
+
+static void startShadows()
+{
+    createShadowRenderPass();
+    createShadowFramebuffer();
+    createShadowCommandBuffer();
+    createShadowSemaphore();
+}
+
+// The thread pool is running the task graph, so the variant jobs are run by
+// the instances of the createSceneVariants task instead
+static void requestSceneVariants()
+{
+    for (size_t i = 0; i < meshCount; ++i)
+        requestPipelineVariant(meshes[i].variant);
+
+    queuePipelineVariants();
+}
+
+static void startSceneResources()
+{
+    createDescriptorPool();
+    createSceneResources();
+}
+
+static void startObjects()
+{
+    buildBatches();
+    writeObjectData();
+}
+
+static void startCulling()
+{
+    createCullResources();
+    createDepthPyramid();
+    createCpuCullResources();
+}
+
+static void startFrames()
+{
+    createCommandBuffers();
+    createSemaphores();
+}
+
+enum {
+    STARTUP_WINDOW,
+    STARTUP_SCENE,
+    STARTUP_MESHES,
+    STARTUP_TEXTURE_PACK,
+    STARTUP_INSTANCE,
+    STARTUP_DEVICE,
+    STARTUP_SWAPCHAIN,
+    STARTUP_SHADERS,
+    STARTUP_SHADOWS,
+    STARTUP_SHADOW_PIPELINE,
+    STARTUP_MIP_GEN_PIPELINE,
+    STARTUP_CULL_PIPELINE,
+    STARTUP_SCATTER_PIPELINE,
+    STARTUP_DEPTH_REDUCE_PIPELINE,
+    STARTUP_REQUEST_VARIANTS,
+    STARTUP_SCENE_VARIANTS,
+    STARTUP_GEOMETRY,
+    STARTUP_SCENE_RESOURCES,
+    STARTUP_TEXTURES,
+    STARTUP_OBJECTS,
+    STARTUP_CULLING,
+    STARTUP_FRAMES,
+    STARTUP_TASK_COUNT
+};
+
+// File reads and decoding start right away on the workers. Everything that
+// touches the window, the queue or the command pool stays on the main thread.
+TaskGraphTask startupTasks[STARTUP_TASK_COUNT] = {
+    [STARTUP_WINDOW] = {
+        .name       = "initWindow",
+        .run        = initWindow,
+        .mainThread = true
+    },
+    [STARTUP_SCENE] = {
+        .name = "createScene",
+        .run  = createScene
+    },
+    [STARTUP_MESHES] = {
+        .name = "loadMeshes",
+        .run  = loadMeshes,
+        .deps = TASK_BIT(STARTUP_SCENE)
+    },
+    [STARTUP_TEXTURE_PACK] = {
+        .name = "packTextures",
+        .run  = packTextures,
+        .deps = TASK_BIT(STARTUP_SCENE)
+    },
+    [STARTUP_INSTANCE] = {
+        .name       = "createInstance",
+        .run        = startInstance,
+        .deps       = TASK_BIT(STARTUP_WINDOW),
+        .mainThread = true
+    },
+    [STARTUP_DEVICE] = {
+        .name       = "createDevice",
+        .run        = startDevice,
+        .deps       = TASK_BIT(STARTUP_INSTANCE),
+        .mainThread = true
+    },
+    [STARTUP_SWAPCHAIN] = {
+        .name       = "createSwapchain",
+        .run        = startSwapchain,
+        .deps       = TASK_BIT(STARTUP_DEVICE),
+        .mainThread = true
+    },
+    [STARTUP_SHADERS] = {
+        .name       = "loadShaders",
+        .run        = startShaders,
+        .deps       = TASK_BIT(STARTUP_SWAPCHAIN),
+        .mainThread = true
+    },
+    [STARTUP_SHADOWS] = {
+        .name       = "createShadows",
+        .run        = startShadows,
+        .deps       = TASK_BIT(STARTUP_DEVICE),
+        .mainThread = true
+    },
+    [STARTUP_SHADOW_PIPELINE] = {
+        .name = "createShadowPipeline",
+        .run  = createShadowPipeline,
+        .deps = TASK_BIT(STARTUP_SHADERS) | TASK_BIT(STARTUP_SHADOWS)
+    },
+    [STARTUP_MIP_GEN_PIPELINE] = {
+        .name = "createMipGenPipeline",
+        .run  = createMipGenPipeline,
+        .deps = TASK_BIT(STARTUP_SHADERS)
+    },
+    [STARTUP_CULL_PIPELINE] = {
+        .name = "createCullPipeline",
+        .run  = createCullPipeline,
+        .deps = TASK_BIT(STARTUP_SHADERS)
+    },
+    [STARTUP_SCATTER_PIPELINE] = {
+        .name = "createScatterPipeline",
+        .run  = createScatterPipeline,
+        .deps = TASK_BIT(STARTUP_SHADERS)
+    },
+    [STARTUP_DEPTH_REDUCE_PIPELINE] = {
+        .name = "createDepthReducePipeline",
+        .run  = createDepthReducePipeline,
+        .deps = TASK_BIT(STARTUP_SHADERS)
+    },
+    [STARTUP_REQUEST_VARIANTS] = {
+        .name = "requestSceneVariants",
+        .run  = requestSceneVariants,
+        .deps = TASK_BIT(STARTUP_MESHES)
+    },
+    // Runs on every thread at once, initVulkan() sets the instance count
+    [STARTUP_SCENE_VARIANTS] = {
+        .name = "createSceneVariants",
+        .run  = runPipelineJobs,
+        .deps = TASK_BIT(STARTUP_REQUEST_VARIANTS) | TASK_BIT(STARTUP_SHADERS)
+    },
+    [STARTUP_GEOMETRY] = {
+        .name       = "createGeometryBuffers",
+        .run        = createGeometryBuffers,
+        .deps       = TASK_BIT(STARTUP_MESHES) | TASK_BIT(STARTUP_DEVICE),
+        .mainThread = true
+    },
+    [STARTUP_SCENE_RESOURCES] = {
+        .name       = "createSceneResources",
+        .run        = startSceneResources,
+        .deps       = TASK_BIT(STARTUP_SHADERS) | TASK_BIT(STARTUP_SCATTER_PIPELINE),
+        .mainThread = true
+    },
+    [STARTUP_TEXTURES] = {
+        .name       = "loadTextures",
+        .run        = loadTextures,
+        .deps       = TASK_BIT(STARTUP_TEXTURE_PACK) | TASK_BIT(STARTUP_MIP_GEN_PIPELINE)
+                    | TASK_BIT(STARTUP_SCENE_RESOURCES),
+        .mainThread = true
+    },
+    [STARTUP_OBJECTS] = {
+        .name       = "writeObjectData",
+        .run        = startObjects,
+        .deps       = TASK_BIT(STARTUP_MESHES) | TASK_BIT(STARTUP_TEXTURES),
+        .mainThread = true
+    },
+    [STARTUP_CULLING] = {
+        .name       = "createCullResources",
+        .run        = startCulling,
+        .deps       = TASK_BIT(STARTUP_OBJECTS) | TASK_BIT(STARTUP_CULL_PIPELINE)
+                    | TASK_BIT(STARTUP_DEPTH_REDUCE_PIPELINE),
+        .mainThread = true
+    },
+    [STARTUP_FRAMES] = {
+        .name       = "createCommandBuffers",
+        .run        = startFrames,
+        .deps       = TASK_BIT(STARTUP_GEOMETRY) | TASK_BIT(STARTUP_CULLING) | TASK_BIT(STARTUP_SCENE_VARIANTS)
+                    | TASK_BIT(STARTUP_SHADOW_PIPELINE),
+        .mainThread = true
+    }
+};
+
+void initVulkan()
 {
-    models[0].pos[0] = 0;
-    models[0].pos[1] = -0.5;
-    models[0].pos[2] = 0;
+    startupTasks[STARTUP_SCENE_VARIANTS].instances = threadPool.threadCount + 1;
 
-    models[0].scale[0] = 0.04;
-    models[0].scale[1] = 0.04;
-    models[0].scale[2] = 0.04;
+    taskGraphRun(startupTasks, STARTUP_TASK_COUNT, &threadPool);
+    taskGraphPrintTimes(startupTasks, STARTUP_TASK_COUNT);
+    clearPipelineJobs();
+
+#ifdef MIP_BENCHMARK
+    benchmarkMipGeneration();
+#endif // MIP_BENCHMARK
+}
 
-    models[1].pos[0] = 0;
-    models[1].pos[1] = -1;
-    models[1].pos[2] = 0;
 
-    models[1].scale[0] = 1;
-    models[1].scale[1] = 1;
-    models[1].scale[2] = 1;
 
+void initMats()
+{
     positions.distance = 4.0f;
     positions.direction[0] = -M_PI / 4.0;
     positions.direction[1] =  M_PI / 12.0;
 
     float aspect = vkData.swapchainImageExtent.width / (float) vkData.swapchainImageExtent.height;
-    mat4x4_perspective(ubo.proj, (M_PI / 2) * (9.0 / 16.0), aspect, 0.1f, 1000.0f);
+    mat4x4_perspective(scene.proj, (M_PI / 2) * (9.0 / 16.0), aspect, NEAR_PLANE, FAR_PLANE);
 }
 
 
@@ -2160,29 +6640,62 @@ void updateUniformBuffer(double delta)
     quat_mul_vec3(eye, hRot, eye);
 
     vec3_scale(eye, eye, positions.distance);
-    mat4x4_look_at(ubo.view, eye, center, up);
-
-    for (size_t i = 0; i < modelCount; ++i) {
-        //mat4x4_translate(mats.model, models[i].pos[0], models[i].pos[1], models[i].pos[2]);
-        //mat4x4_identity(mats.model);
-        mat4x4 scaleMat;
-        mat4x4_identity(scaleMat);
-        mat4x4_scale_aniso(scaleMat, scaleMat, models[i].scale[0], models[i].scale[1], models[i].scale[2]);
-        mat4x4_translate(ubo.model, models[i].pos[0], models[i].pos[1], models[i].pos[2]);
-        mat4x4_mul(ubo.model, ubo.model, scaleMat);
-        //mat4x4_translate_in_place(mats.model, models[i].pos[0], models[i].pos[1], models[i].pos[2]);
-        void *data;
-        vkMapMemory(vkData.device, models[i].uniformBufferMemory, 0, sizeof(struct UniformBufferData), 0, &data);
-        memcpy(data, &ubo, sizeof(struct UniformBufferData));
-        vkUnmapMemory(vkData.device, models[i].uniformBufferMemory);
+    mat4x4_look_at(scene.view, eye, center, up);
+
+    // Frustum planes from the rows of the view projection matrix, the clip
+    // space depth range is [0, 1] so the near plane is the third row alone
+    mat4x4 viewProj;
+    mat4x4_mul(viewProj, scene.proj, scene.view);
+    mat4x4_dup(scene.viewProj, viewProj);
+
+    for (int i = 0; i < 4; ++i) {
+        float r0 = viewProj[i][0], r1 = viewProj[i][1], r2 = viewProj[i][2], r3 = viewProj[i][3];
+        scene.frustum[0][i] = r3 + r0;
+        scene.frustum[1][i] = r3 - r0;
+        scene.frustum[2][i] = r3 + r1;
+        scene.frustum[3][i] = r3 - r1;
+        scene.frustum[4][i] = r2;
+        scene.frustum[5][i] = r3 - r2;
+    }
+
+    for (int i = 0; i < 6; ++i)
+        vec4_scale(scene.frustum[i], scene.frustum[i], 1.0f / vec3_len(scene.frustum[i]));
+
+    void *data;
+    vkMapMemory(vkData.device, vkData.sceneBufferMemory, 0, sizeof(struct SceneData), 0, &data);
+    memcpy(data, &scene, sizeof(struct SceneData));
+    vkUnmapMemory(vkData.device, vkData.sceneBufferMemory);
+
+    // Only moved transforms and their descendants are recomputed and sent
+    // to the object buffer
+    transformUpdate(&transforms);
+
+    for (size_t i = 0; i < transforms.changedCount; ++i) {
+        uint32_t node = transforms.changed[i];
+        uint32_t instance = transformInstances[node];
+
+        if (instance != UINT32_MAX)
+            queueObjectUpdate(instance, transforms.worlds[node], transforms.normals[node]);
+    }
+
+    if (vkData.cpuCullEnabled) {
+        memcpy(cpuCull.viewProj, viewProj, sizeof(mat4x4));
+        cullInstancesCpu(eye);
+    }
+
+    if (!vkData.gpuCullSupported) {
+        vec3 forward;
+        vec3_sub(forward, center, eye);
+        vec3_norm(forward, forward);
+        buildRenderQueue(eye, forward);
     }
 }
 
 void renderFrame()
 {
-    // QueueWaitIdle is here before rendering so the CPU doesn't wait while the
-    // GPU is rendering the previous frame
-    vkQueueWaitIdle(vkData.presentQueue);
+    // Waiting here before rendering so the CPU doesn't wait while the GPU is
+    // rendering the previous frame
+    waitForSubmittedFrames();
 
     uint32_t imageIndex;
     VkResult result = vkAcquireNextImageKHR(vkData.device, vkData.swapchain, UINT64_MAX,
@@ -2194,20 +6707,56 @@ void renderFrame()
     } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
         ERR_EXIT("%s\n", getVkResultString(result));
 
+    flushObjectUpdates();
+
+    if (vkData.cpuCullEnabled)
+        writeVisibleInstances();
+
+    // Without GPU culling the draws can change every frame. Only segments
+    // whose draws changed are recorded again and the primary only when one
+    // was. The wait above means none of them is in use anymore.
+    if (!vkData.gpuCullSupported && (vkData.recordPoolCount == 0 || updateDrawSegments(imageIndex))) {
+        vkResetCommandBuffer(vkData.swapchainCommandBuffers[imageIndex], 0);
+        recordCommandBuffer(imageIndex);
+    }
+
     VkPipelineStageFlags waitStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
+    // A new depth pyramid is transitioned and the scene uploads are copied
+    // ahead of the frame's commands
+    VkCommandBuffer commandBuffers[3];
+    uint32_t commandBufferCount = 0;
+
+    if (vkData.depthPyramidInitCommands != VK_NULL_HANDLE)
+        commandBuffers[commandBufferCount++] = vkData.depthPyramidInitCommands;
+
+    VkCommandBuffer uploadCommands = endSceneUploads();
+    if (uploadCommands != VK_NULL_HANDLE)
+        commandBuffers[commandBufferCount++] = uploadCommands;
+
+    commandBuffers[commandBufferCount++] = vkData.swapchainCommandBuffers[imageIndex];
+
     VkSubmitInfo submitInfo = {
         .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
         .waitSemaphoreCount   = 1,
         .pWaitSemaphores      = &vkData.imageAvailableSemaphore,
         .pWaitDstStageMask    = &waitStages,
-        .commandBufferCount   = 1,
-        .pCommandBuffers      = &vkData.swapchainCommandBuffers[imageIndex],
+        .commandBufferCount   = commandBufferCount,
+        .pCommandBuffers      = commandBuffers,
         .signalSemaphoreCount = 1,
         .pSignalSemaphores    = &vkData.renderFinishedSemaphore
     };
 
-    VK_CHECK(vkQueueSubmit(vkData.graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE));
+    VK_CHECK(vkResetFences(vkData.device, 1, &vkData.frameFence));
+    VK_CHECK(vkQueueSubmit(vkData.graphicsQueue, 1, &submitInfo, vkData.frameFence));
+    vkData.submittedFrames++;
+
+    if (vkData.depthPyramidInitCommands != VK_NULL_HANDLE) {
+        deferDeletion(freeRetiredCommandBuffer, vkData.depthPyramidInitCommands);
+        vkData.depthPyramidInitCommands = VK_NULL_HANDLE;
+    }
+
+    retireSceneUploads();
 
     VkPresentInfoKHR presentInfo = {
         .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
@@ -2253,12 +6802,22 @@ void mainLoop()
 
         if (currTime - lastOut > 1.0) {
             printf("Frames in last second: %ld\n", frameCount);
+
+            if (cpuCull.frames > 0) {
+                printf("CPU occlusion culling: %f ms, %zu of %zu instances visible\n",
+                       1000.0 * cpuCull.time / cpuCull.frames, cpuCull.visibleTotal / cpuCull.frames,
+                       instanceCount);
+                cpuCull.time         = 0.0;
+                cpuCull.frames       = 0;
+                cpuCull.visibleTotal = 0;
+            }
             frameCount = 0;
             lastOut = currTime;
         }
         frameCount += 1;
 
-        // process state stuff here if there ever is any
+        // Before the culling and the render queue look at the batches
+        updateAssetLoads();
 
         updateUniformBuffer(delta);
         renderFrame();
@@ -2282,10 +6841,13 @@ void cleanupSwapchain()
     vkFreeCommandBuffers(vkData.device, vkData.commandPool, vkData.swapchainImageCount,
                          vkData.swapchainCommandBuffers);
     free(vkData.swapchainCommandBuffers);
+    freeSegmentCaches(vkData.swapchainImageCount, segmentCaches);
 
-    vkDestroyPipeline(vkData.device, vkData.graphicsPipeline, NULL);
+    destroyPipelineVariants(&pipelineVariants);
     vkDestroyPipelineLayout(vkData.device, vkData.pipelineLayout, NULL);
     vkDestroyRenderPass(vkData.device, vkData.renderPass, NULL);
+    if (vkData.hiZSupported)
+        vkDestroyRenderPass(vkData.device, vkData.lateRenderPass, NULL);
 
     for (size_t i = 0; i < vkData.swapchainImageCount; ++i) {
         vkDestroyFramebuffer(vkData.device, vkData.swapchainFramebuffers[i], NULL);
@@ -2299,23 +6861,6 @@ void cleanupSwapchain()
     vkDestroySwapchainKHR(vkData.device, vkData.swapchain, NULL);
 }
 
-void cleanupModel(Model *model)
-{
-    vkDestroySampler(vkData.device, model->textureSampler, NULL);
-    vkDestroyImageView(vkData.device, model->textureImageView, NULL);
-    vkDestroyImage(vkData.device, model->textureImage, NULL);
-    vkFreeMemory(vkData.device, model->textureImageMemory, NULL);
-
-    vkDestroyBuffer(vkData.device, model->indexBuffer, NULL);
-    vkFreeMemory(vkData.device, model->indexBufferMemory, NULL);
-
-    vkDestroyBuffer(vkData.device, model->vertexBuffer, NULL);
-    vkFreeMemory(vkData.device, model->vertexBufferMemory, NULL);
-
-    vkDestroyBuffer(vkData.device, model->uniformBuffer, NULL);
-    vkFreeMemory(vkData.device, model->uniformBufferMemory, NULL);
-}
-
 void cleanupShadows()
 {
     vkFreeCommandBuffers(vkData.device, vkData.commandPool, 1, &vkData.shadowCommandBuffer);
@@ -2339,25 +6884,119 @@ void cleanupShadows()
 
 void cleanup()
 {
+    // The device is idle, nothing retired is in use anymore
+    retireSceneUploads();
+    runDeferredDeletions(UINT64_MAX);
+    free(deletionQueue.entries);
+    free(sceneUploads.stagingBuffers);
+    free(sceneUploads.stagingMemories);
+
     cleanupSwapchain();
+    cleanupAssetLoads();
+
+    for (size_t i = 0; i < meshCount; ++i)
+        cleanupMesh(&meshes[i]);
+
+    free(meshes);
+    free(materials);
+    free(instances);
+    free(batches);
+    free(drawGroups);
 
-    for (size_t i = 0; i < modelCount; ++i)
-        cleanupModel(&models[i]);
+    cleanupCpuCullResources();
+    renderQueueFree(&renderQueue);
+
+    transformFree(&transforms);
+    free(transformInstances);
+
+    for (size_t i = 0; i < textureArrayCount; ++i)
+        cleanupTextureArray(&textureArrays[i]);
+
+    free(textureArrays);
 
     cleanupShadows();
 
+    vkDestroyPipeline(vkData.device, vkData.scatterPipeline, NULL);
+    vkDestroyPipelineLayout(vkData.device, vkData.scatterPipelineLayout, NULL);
+    vkDestroyDescriptorPool(vkData.device, vkData.scatterDescriptorPool, NULL);
+    vkDestroyDescriptorSetLayout(vkData.device, vkData.scatterSetLayout, NULL);
+
+    free(objectUpdates.entries);
+    free(objectUpdates.slots);
+
+    if (vkData.gpuCullSupported) {
+        vkDestroyBuffer(vkData.device, vkData.drawCountBuffer, NULL);
+        vkFreeMemory(vkData.device, vkData.drawCountBufferMemory, NULL);
+        vkDestroyBuffer(vkData.device, vkData.drawCommandBuffer, NULL);
+        vkFreeMemory(vkData.device, vkData.drawCommandBufferMemory, NULL);
+        vkDestroyBuffer(vkData.device, vkData.batchBuffer, NULL);
+        vkFreeMemory(vkData.device, vkData.batchBufferMemory, NULL);
+
+        vkDestroyPipeline(vkData.device, vkData.cullPipeline, NULL);
+        vkDestroyPipeline(vkData.device, vkData.cullCompactPipeline, NULL);
+        vkDestroyPipelineLayout(vkData.device, vkData.cullPipelineLayout, NULL);
+        vkDestroyDescriptorPool(vkData.device, vkData.cullDescriptorPool, NULL);
+        vkDestroyDescriptorSetLayout(vkData.device, vkData.cullSetLayout, NULL);
+    }
+
+    if (vkData.hiZSupported) {
+        cleanupDepthPyramid();
+
+        vkDestroyBuffer(vkData.device, vkData.visibilityBuffer, NULL);
+        vkFreeMemory(vkData.device, vkData.visibilityBufferMemory, NULL);
+
+        vkDestroySampler(vkData.device, vkData.depthPyramidSampler, NULL);
+        vkDestroyPipeline(vkData.device, vkData.depthReducePipeline, NULL);
+        vkDestroyPipelineLayout(vkData.device, vkData.depthReducePipelineLayout, NULL);
+        vkDestroyDescriptorSetLayout(vkData.device, vkData.depthReduceSetLayout, NULL);
+        vkDestroyShaderModule(vkData.device, shaders.depthReduce, NULL);
+    }
+
+    vkDestroyBuffer(vkData.device, vkData.indexBuffer, NULL);
+    vkFreeMemory(vkData.device, vkData.indexBufferMemory, NULL);
+    vkDestroyBuffer(vkData.device, vkData.vertexBuffer, NULL);
+    vkFreeMemory(vkData.device, vkData.vertexBufferMemory, NULL);
+    vkDestroyBuffer(vkData.device, vkData.visibleBuffer, NULL);
+    vkFreeMemory(vkData.device, vkData.visibleBufferMemory, NULL);
+    vkDestroyBuffer(vkData.device, vkData.objectUpdateBuffer, NULL);
+    vkFreeMemory(vkData.device, vkData.objectUpdateBufferMemory, NULL);
+    vkDestroyBuffer(vkData.device, vkData.objectBuffer, NULL);
+    vkFreeMemory(vkData.device, vkData.objectBufferMemory, NULL);
+    vkDestroyBuffer(vkData.device, vkData.sceneBuffer, NULL);
+    vkFreeMemory(vkData.device, vkData.sceneBufferMemory, NULL);
+
     vkDestroyDescriptorPool(vkData.device, vkData.descriptorPool, NULL);
+    vkDestroyDescriptorPool(vkData.device, vkData.textureDescriptorPool, NULL);
 
     vkDestroyDescriptorSetLayout(vkData.device, vkData.descriptorSetLayout, NULL);
+    vkDestroyDescriptorSetLayout(vkData.device, vkData.textureSetLayout, NULL);
+
+    if (vkData.mipGenSupported) {
+        vkDestroyPipeline(vkData.device, vkData.mipGenPipeline, NULL);
+        vkDestroyPipelineLayout(vkData.device, vkData.mipGenPipelineLayout, NULL);
+        vkDestroyDescriptorPool(vkData.device, vkData.mipGenDescriptorPool, NULL);
+        vkDestroyDescriptorSetLayout(vkData.device, vkData.mipGenSetLayout, NULL);
+    }
 
+    vkDestroyShaderModule(vkData.device, shaders.mipGen, NULL);
+    vkDestroyShaderModule(vkData.device, shaders.cull, NULL);
+    vkDestroyShaderModule(vkData.device, shaders.scatter, NULL);
     vkDestroyShaderModule(vkData.device, shaders.vert, NULL);
     vkDestroyShaderModule(vkData.device, shaders.frag, NULL);
 
     vkDestroySemaphore(vkData.device, vkData.imageAvailableSemaphore, NULL);
     vkDestroySemaphore(vkData.device, vkData.renderFinishedSemaphore, NULL);
+    vkDestroyFence(vkData.device, vkData.frameFence, NULL);
 
     vkDestroyCommandPool(vkData.device, vkData.commandPool, NULL);
 
+    savePipelineCache();
+    vkDestroyPipelineCache(vkData.device, vkData.pipelineCache, NULL);
+
+    for (uint32_t i = 0; i < vkData.recordPoolCount; i++)
+        vkDestroyCommandPool(vkData.device, vkData.recordCommandPools[i], NULL);
+    free(vkData.recordCommandPools);
+
     vkDestroyDevice(vkData.device, NULL);
 
 #ifdef VALIDATION_LAYERS
@@ -2375,12 +7014,32 @@ void cleanup()
 
 int main(int argc, char *argv[])
 {
-    initWindow();
+    threadPoolInit(&threadPool, 0);
+
+    if (assetPackOpen(&assetPack, ASSET_PACK_PATH))
+        printf("Using asset pack %s with %u assets\n", ASSET_PACK_PATH, assetPack.header->entryCount);
+
+    if (DERIVED_CACHE)
+        derivedCacheInit(&derivedCache, DERIVED_CACHE_DIR, DERIVED_CACHE_MAX_SIZE);
+
+    // createScene() may already start background loads
+    assetLoaderInit(&assetLoader, ASSET_LOADER_THREADS);
+
+    // Also opens the window
     initVulkan();
 
+#ifdef LINMATH_BENCHMARK
+    benchmarkLinmath();
+#endif // LINMATH_BENCHMARK
+
     initMats();
 
     mainLoop();
 
     cleanup();
+
+    derivedCachePrintStats(&derivedCache);
+    derivedCacheFree(&derivedCache);
+    assetPackClose(&assetPack);
+    threadPoolFree(&threadPool);
 }
@@ -1,11 +1,29 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(binding = 0) uniform UniformBufferData {
-    mat4 model;
+layout(binding = 0) uniform SceneData {
     mat4 view;
     mat4 proj;
-} ubo;
+    mat4 viewProj;
+    vec4 frustum[6];
+} scene;
+
+struct ObjectData {
+    mat4 model;
+    mat3 normalMatrix;
+    vec4 uvTransform;
+    uint textureIndex;
+    uint textureLayer;
+    uint batch;
+};
+
+layout(std430, binding = 1) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+layout(std430, binding = 2) readonly buffer VisibleBuffer {
+    uint visibleInstances[];
+};
 
 layout(location = 0) in vec3 inPosition;
 
@@ -14,5 +32,5 @@ out gl_PerVertex {
 };
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+    gl_Position = scene.viewProj * (objects[visibleInstances[gl_InstanceIndex]].model * vec4(inPosition, 1.0));
 }
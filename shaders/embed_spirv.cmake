@@ -0,0 +1,21 @@
+# Writes the SPIR-V binary INPUT to the header OUTPUT as a uint32_t array
+# called NAME. Run with cmake -DINPUT=... -DOUTPUT=... -DNAME=... -P
+file (READ ${INPUT} hex HEX)
+
+string (LENGTH "${hex}" hexLength)
+math (EXPR remainder "${hexLength} % 8")
+if (hexLength EQUAL 0 OR NOT remainder EQUAL 0)
+    message (FATAL_ERROR "${INPUT} isn't a whole number of SPIR-V words")
+endif ()
+
+# SPIR-V is stored little endian, eight words to a line
+string (REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1, " words "${hex}")
+set (line "0x[0-9a-f]+,")
+foreach (i RANGE 6)
+    string (APPEND line " 0x[0-9a-f]+,")
+endforeach ()
+string (REGEX REPLACE "(${line}) " "\\1\n    " words "${words}")
+string (STRIP "${words}" words)
+
+file (WRITE ${OUTPUT} "// Generated from ${INPUT}, do not edit\n\n"
+                      "static const uint32_t ${NAME}[] = {\n    ${words}\n};\n")
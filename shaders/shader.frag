@@ -1,7 +1,14 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
+#ifdef BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
 
-layout(binding = 1) uniform sampler2D texSampler;
+#ifdef BINDLESS
+layout(binding = 3) uniform sampler2DArray textures[];
+#else
+layout(set = 1, binding = 0) uniform sampler2DArray texSampler;
+#endif
 
 layout(push_constant) uniform PushConsts {
     vec4 dirLight;
@@ -11,22 +18,57 @@ layout(push_constant) uniform PushConsts {
 layout(location = 0) in vec3 fragDir;
 layout(location = 1) in vec3 fragNormal;
 layout(location = 2) in vec2 fragTexCoord;
+layout(location = 3) flat in vec4 fragUvTransform;
+layout(location = 4) flat in uint fragTextureLayer;
+layout(location = 5) flat in uint fragTextureIndex;
+layout(location = 6) in vec3 fragColor;
+
+#ifdef BINDLESS
+// Instances in one draw may use different textures
+#define texSampler textures[nonuniformEXT(fragTextureIndex)]
+#endif
 
 layout(location = 0) out vec4 outColor;
 
-#define AMBIENT vec3(0.2, 0.2, 0.2)
-#define SPECULAR 25
+// Set per pipeline variant, see createScenePipeline()
+layout(constant_id = 0) const bool  HAS_NORMAL     = true;
+layout(constant_id = 1) const bool  HAS_COLOR      = true;
+layout(constant_id = 2) const bool  HAS_TEXCOORD   = true;
+layout(constant_id = 3) const bool  SPECULAR       = true;
+layout(constant_id = 4) const float AMBIENT        = 0.2;
+layout(constant_id = 5) const float SPECULAR_POWER = 25.0;
 
 void main() {
-    vec4 texColor = texture(texSampler, fragTexCoord);
+    vec4 texColor = vec4(1.0);
+
+    if (HAS_TEXCOORD) {
+        // Atlas entries are wrapped by hand, the gradients come from the unwrapped
+        // coordinates so the seam from fract() doesn't pick the smallest mip
+        vec2 scale = fragUvTransform.xy;
+        vec2 uv = fract(fragTexCoord) * scale + fragUvTransform.zw;
+        texColor = textureGrad(texSampler, vec3(uv, fragTextureLayer),
+                               dFdx(fragTexCoord) * scale, dFdy(fragTexCoord) * scale);
+    }
+
+    if (HAS_COLOR)
+        texColor.xyz *= fragColor;
+
+    // Meshes without normals are drawn unlit
+    if (!HAS_NORMAL) {
+        outColor = texColor;
+        return;
+    }
 
     float dirLightFactor = max(0, dot(fragNormal, pushConsts.dirLight.xyz));
     vec3 diffuse = texColor.xyz * pushConsts.dirLightColor.xyz * dirLightFactor;
 
-    vec3 reflection = normalize(reflect(pushConsts.dirLight.xyz, fragNormal));
-    float lspec = max(0.0, dot(-fragDir, reflection));
-    float fspec = pow(lspec, SPECULAR);
-    vec3 specular = pushConsts.dirLightColor.xyz * fspec;
+    vec3 specular = vec3(0.0);
+    if (SPECULAR) {
+        vec3 reflection = normalize(reflect(pushConsts.dirLight.xyz, fragNormal));
+        float lspec = max(0.0, dot(-fragDir, reflection));
+        float fspec = pow(lspec, SPECULAR_POWER);
+        specular = pushConsts.dirLightColor.xyz * fspec;
+    }
 
     vec3 ambient = AMBIENT * texColor.xyz;
 
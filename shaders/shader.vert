@@ -1,11 +1,36 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(binding = 0) uniform UniformBufferData {
-    mat4 model;
+layout(binding = 0) uniform SceneData {
     mat4 view;
     mat4 proj;
-} ubo;
+    mat4 viewProj;
+    vec4 frustum[6];
+} scene;
+
+struct ObjectData {
+    mat4 model;
+    mat3 normalMatrix;
+    vec4 uvTransform;
+    uint textureIndex;
+    uint textureLayer;
+    uint batch;
+};
+
+layout(std430, binding = 1) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+// Indexed with the instance index, each batch's visible instances are
+// contiguous
+layout(std430, binding = 2) readonly buffer VisibleBuffer {
+    uint visibleInstances[];
+};
+
+// Which vertex attributes the mesh has, set per pipeline variant
+layout(constant_id = 0) const bool HAS_NORMAL   = true;
+layout(constant_id = 1) const bool HAS_COLOR    = true;
+layout(constant_id = 2) const bool HAS_TEXCOORD = true;
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
@@ -15,14 +40,27 @@ layout(location = 3) in vec2 inTexCoord;
 layout(location = 0) out vec3 fragDir;
 layout(location = 1) out vec3 fragNormal;
 layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) flat out vec4 fragUvTransform;
+layout(location = 4) flat out uint fragTextureLayer;
+layout(location = 5) flat out uint fragTextureIndex;
+layout(location = 6) out vec3 fragColor;
 
 out gl_PerVertex {
     vec4 gl_Position;
 };
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragDir = normalize((ubo.view * ubo.model * vec4(inPosition, 1.0)).xyz);
-    fragNormal = normalize((ubo.model * vec4(inNormal, 0.0)).xyz);
-    fragTexCoord = inTexCoord;
+    ObjectData object = objects[visibleInstances[gl_InstanceIndex]];
+
+    // Matrix-vector products only, the matrix products are done on the CPU
+    vec4 worldPos = object.model * vec4(inPosition, 1.0);
+
+    gl_Position = scene.viewProj * worldPos;
+    fragDir = normalize((scene.view * worldPos).xyz);
+    fragNormal = HAS_NORMAL ? normalize(object.normalMatrix * inNormal) : vec3(0.0);
+    fragColor = HAS_COLOR ? inColor : vec3(1.0);
+    fragTexCoord = HAS_TEXCOORD ? inTexCoord : vec2(0.0);
+    fragUvTransform = object.uvTransform;
+    fragTextureLayer = object.textureLayer;
+    fragTextureIndex = object.textureIndex;
 }
@@ -0,0 +1,188 @@
+// Packs files and directories into an asset pack for vulkan-test to map at
+// startup, run from the directory the program runs in:
+//
+//   asset-pack [-c] [-a alignment] assets.pack models textures shaders
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define ASSET_PACK_IMPLEMENTATION
+#include <asset_pack.h>
+
+typedef struct {
+    AssetPackInput *inputs;
+    size_t          count;
+    size_t          capacity;
+    uint32_t        alignment;
+    bool            compress;
+} PackList;
+
+static char *readFile(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    long length = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        length = ftell(fp);
+
+    if (length < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error getting length of %s: %s\n", path, strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+
+    char *data = malloc(length > 0 ? length : 1);
+    *size = fread(data, 1, length, fp);
+    fclose(fp);
+
+    if (*size != (size_t) length) {
+        fprintf(stderr, "Error reading %s\n", path);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+// Adds the file at path, or everything below it if it's a directory
+static bool addPath(PackList *list, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        bool success = true;
+
+        for (struct dirent *ent; success && (ent = readdir(dir));) {
+            if (ent->d_name[0] == '.')
+                continue;
+
+            char *child = malloc(strlen(path) + strlen(ent->d_name) + 2);
+            sprintf(child, "%s/%s", path, ent->d_name);
+            success = addPath(list, child);
+            free(child);
+        }
+
+        closedir(dir);
+
+        return success;
+    }
+
+    // Devices, pipes and sockets have no length to pack
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Skipping %s, not a regular file\n", path);
+        return true;
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->inputs   = realloc(list->inputs, list->capacity * sizeof(AssetPackInput));
+    }
+
+    AssetPackInput *input = &list->inputs[list->count];
+    input->data = readFile(path, &input->size);
+    if (!input->data)
+        return false;
+
+    input->name      = strdup(path);
+    input->alignment = list->alignment;
+    input->compress  = list->compress;
+    list->count++;
+
+    return true;
+}
+
+static int compareInputs(const void *a, const void *b)
+{
+    return strcmp(((const AssetPackInput *) a)->name, ((const AssetPackInput *) b)->name);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-c] [-a alignment] <output> <file or directory>...\n"
+                    "  -c  Compress entries where it saves at least an eighth\n"
+                    "  -a  Align entries to a power of two, %d by default\n", program, ASSET_PACK_ALIGN);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    PackList list = {.alignment = ASSET_PACK_ALIGN};
+    int arg = 1;
+
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-c") == 0) {
+            list.compress = true;
+        } else if (strcmp(argv[arg], "-a") == 0 && arg + 1 < argc) {
+            list.alignment = strtoul(argv[++arg], NULL, 0);
+            if (list.alignment == 0 || (list.alignment & (list.alignment - 1)))
+                usage(argv[0]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - arg < 2)
+        usage(argv[0]);
+
+    const char *output = argv[arg++];
+
+    for (; arg < argc; arg++) {
+        // Paths are looked up as the program names them, without a trailing /
+        size_t length = strlen(argv[arg]);
+        while (length > 1 && argv[arg][length - 1] == '/')
+            argv[arg][--length] = '\0';
+
+        if (!addPath(&list, argv[arg]))
+            return EXIT_FAILURE;
+    }
+
+    // The same inputs always give the same pack
+    if (list.count > 1)
+        qsort(list.inputs, list.count, sizeof(AssetPackInput), compareInputs);
+
+    if (!assetPackWrite(output, list.inputs, list.count))
+        return EXIT_FAILURE;
+
+    size_t rawSize = 0;
+    for (size_t i = 0; i < list.count; i++)
+        rawSize += list.inputs[i].size;
+
+    AssetPack pack;
+    if (!assetPackOpen(&pack, output))
+        return EXIT_FAILURE;
+
+    size_t compressedCount = 0;
+    for (uint32_t i = 0; i < pack.header->entryCount; i++)
+        compressedCount += (pack.entries[i].flags & ASSET_PACK_COMPRESSED) != 0;
+
+    printf("Packed %zu files, %zu compressed, %zu bytes into %zu\n", list.count, compressedCount,
+           rawSize, pack.size);
+
+    assetPackClose(&pack);
+
+    for (size_t i = 0; i < list.count; i++) {
+        free((void *) list.inputs[i].name);
+        free((void *) list.inputs[i].data);
+    }
+    free(list.inputs);
+
+    return EXIT_SUCCESS;
+}
@@ -129,10 +129,10 @@ void cmdCopyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkBuffer d
     vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 }
 
-void createImage(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t width, uint32_t height,
-                 VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkSampleCountFlagBits samples,
-                 uint32_t mipLevels, VkMemoryPropertyFlags properties,
-                 VkImage *image, VkDeviceMemory *imageMemory)
+void createImageArray(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t width, uint32_t height,
+                      uint32_t layers, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
+                      VkSampleCountFlagBits samples, uint32_t mipLevels, VkMemoryPropertyFlags properties,
+                      VkImage *image, VkDeviceMemory *imageMemory)
 {
     VkImageCreateInfo imageInfo = {
         .sType     = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -143,7 +143,7 @@ void createImage(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t widt
             .depth  = 1,
         },
         .mipLevels     = mipLevels,
-        .arrayLayers   = 1,
+        .arrayLayers   = layers,
         .format        = format,
         .tiling        = tiling,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
@@ -169,6 +169,15 @@ void createImage(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t widt
     vkBindImageMemory(device, *image, *imageMemory, 0);
 }
 
+void createImage(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t width, uint32_t height,
+                 VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkSampleCountFlagBits samples,
+                 uint32_t mipLevels, VkMemoryPropertyFlags properties,
+                 VkImage *image, VkDeviceMemory *imageMemory)
+{
+    createImageArray(physicalDevice, device, width, height, 1, format, tiling, usage, samples, mipLevels,
+                     properties, image, imageMemory);
+}
+
 void cmdTransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout,
                        VkImageLayout newLayout, VkImageSubresourceRange subresourceRange)
 {
@@ -189,13 +198,17 @@ void cmdTransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkIm
             barrier.srcAccessMask = 0;
             srcStageMask          = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
             break;
+        case VK_IMAGE_LAYOUT_GENERAL:
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            srcStageMask          = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+            break;
         //case VK_IMAGE_LAYOUT_PREINITIALIZED:
             //barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
             //srcStageMask          =
             break;
         case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
             barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-            //srcStageMask          =
+            srcStageMask          = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
             break;
         //case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL:
             //barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
@@ -218,6 +231,10 @@ void cmdTransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkIm
     }
 
     switch (newLayout) {
+        case VK_IMAGE_LAYOUT_GENERAL:
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            dstStageMask          = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+            break;
         case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
             barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
             dstStageMask          = VK_PIPELINE_STAGE_TRANSFER_BIT;
@@ -247,8 +264,8 @@ void cmdTransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkIm
     vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0, NULL, 0, NULL, 1, &barrier);
 }
 
-void cmdCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
-                       uint32_t width, uint32_t height)
+void cmdCopyBufferToImageArray(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
+                               uint32_t width, uint32_t height, uint32_t layers)
 {
     VkBufferImageCopy region = {
         .bufferOffset      = 0,
@@ -258,7 +275,7 @@ void cmdCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImag
             .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
             .mipLevel       = 0,
             .baseArrayLayer = 0,
-            .layerCount     = 1,
+            .layerCount     = layers,
         },
         .imageOffset = {0, 0, 0},
         .imageExtent = {width, height, 1},
@@ -274,6 +291,12 @@ void cmdCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImag
     );
 }
 
+void cmdCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
+                       uint32_t width, uint32_t height)
+{
+    cmdCopyBufferToImageArray(commandBuffer, buffer, image, width, height, 1);
+}
+
 VkImageView createImageView(VkDevice device, VkImage image, VkFormat format,
                             VkImageAspectFlags aspectFlags, uint32_t mipLevels)
 {
@@ -297,6 +320,23 @@ VkImageView createImageView(VkDevice device, VkImage image, VkFormat format,
     return imageView;
 }
 
+VkImageView createImageSubresourceView(VkDevice device, VkImage image, VkImageViewType viewType,
+                                       VkFormat format, VkImageSubresourceRange subresourceRange)
+{
+    VkImageViewCreateInfo viewInfo = {
+        .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image            = image,
+        .viewType         = viewType,
+        .format           = format,
+        .subresourceRange = subresourceRange,
+    };
+
+    VkImageView imageView;
+    VK_CHECK(vkCreateImageView(device, &viewInfo, NULL, &imageView));
+
+    return imageView;
+}
+
 VkFormat findSupportedFormat(VkPhysicalDevice physicalDevice, const VkFormat *candidates, size_t numCandidates,
                              VkImageTiling tiling, VkFormatFeatureFlags features)
 {
@@ -339,31 +379,31 @@ char * getFileData(const char *fileName, size_t *length)
 {
     FILE *fp = fopen(fileName, "rb");
     if (fp == NULL) {
-        fprintf(stderr, "Error opening %s: %s", fileName, strerror(errno));
-        fclose(fp);
+        fprintf(stderr, "Error opening %s: %s\n", fileName, strerror(errno));
         return NULL;
     }
 
     if (fseek(fp, 0, SEEK_END) == -1) {
-        fprintf(stderr, "Error seeking the end of %s: %s", fileName, strerror(errno));
+        fprintf(stderr, "Error seeking the end of %s: %s\n", fileName, strerror(errno));
         fclose(fp);
         return NULL;
     }
 
     long fileBytes = ftell(fp);
     if (fileBytes == -1) {
-        fprintf(stderr, "Error getting length of %s: %s", fileName, strerror(errno));
+        fprintf(stderr, "Error getting length of %s: %s\n", fileName, strerror(errno));
         fclose(fp);
         return NULL;
     }
 
     rewind(fp);
 
-    char *data = malloc(fileBytes);
+    char *data = malloc(fileBytes > 0 ? fileBytes : 1);
     *length = fread(data, 1, fileBytes, fp);
 
-    if (*length < fileBytes) {
-        fprintf(stderr, "Error reading file %s", fileName);
+    if (*length < (size_t) fileBytes) {
+        fprintf(stderr, "Error reading file %s\n", fileName);
+        free(data);
         fclose(fp);
         return NULL;
     }
@@ -26,15 +26,26 @@ void createImage(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t widt
                  uint32_t mipLevels, VkMemoryPropertyFlags properties,
                  VkImage *image, VkDeviceMemory *imageMemory);
 
+void createImageArray(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t width, uint32_t height,
+                      uint32_t layers, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
+                      VkSampleCountFlagBits samples, uint32_t mipLevels, VkMemoryPropertyFlags properties,
+                      VkImage *image, VkDeviceMemory *imageMemory);
+
 void cmdTransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout,
                        VkImageLayout newLayout, VkImageSubresourceRange subresourceRange);
 
 void cmdCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
                        uint32_t width, uint32_t height);
 
+void cmdCopyBufferToImageArray(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
+                               uint32_t width, uint32_t height, uint32_t layers);
+
 VkImageView createImageView(VkDevice device, VkImage image, VkFormat format,
                             VkImageAspectFlags aspectFlags, uint32_t mipLevels);
 
+VkImageView createImageSubresourceView(VkDevice device, VkImage image, VkImageViewType viewType,
+                                       VkFormat format, VkImageSubresourceRange subresourceRange);
+
 VkFormat findSupportedFormat(VkPhysicalDevice, const VkFormat *candidates, size_t numCandidates,
                              VkImageTiling tiling, VkFormatFeatureFlags features);
 